@@ -34,13 +34,93 @@ Software is furnished to do so, subject to the following conditions:
 #include <boost/asio/ssl/stream.hpp>
 #include <boost/asio/streambuf.hpp>
 
+#include <openssl/ssl.h>
+
 #include <nlohmann/json.hpp>
 
-#include <boost/algorithm/string.hpp>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef NATS_ASIO_IO_URING
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef NATS_ASIO_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+#include <zstd.h>
+#endif
+
+// USDT probes of provider nats_asio. A probe is a nop until a tracer attaches, its semaphore tells when one is
+// attached so timings are taken only then
+#ifdef NATS_ASIO_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define NATS_ASIO_PROBE_ENABLED(name) __builtin_expect(nats_asio_##name##_semaphore != 0, 0)
+#define NATS_ASIO_PROBE1(name, a1) DTRACE_PROBE1(nats_asio, name, a1)
+#define NATS_ASIO_PROBE2(name, a1, a2) DTRACE_PROBE2(nats_asio, name, a1, a2)
+#define NATS_ASIO_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(nats_asio, name, a1, a2, a3)
+
+// names are referenced from probe notes, so they live outside of the namespace
+#define NATS_ASIO_SEMAPHORE __attribute__((unused, section(".probes"))) unsigned short
+NATS_ASIO_SEMAPHORE nats_asio_frame_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_dispatch_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_publish_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_flush_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_write_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_read_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_reconnect_start_semaphore;
+NATS_ASIO_SEMAPHORE nats_asio_reconnect_end_semaphore;
+#else
+// arguments aren't evaluated
+#define NATS_ASIO_PROBE_ENABLED(name) false
+#define NATS_ASIO_PROBE1(name, a1) static_cast<void>(sizeof(a1))
+#define NATS_ASIO_PROBE2(name, a1, a2) static_cast<void>(sizeof(a1) + sizeof(a2))
+#define NATS_ASIO_PROBE3(name, a1, a2, a3) static_cast<void>(sizeof(a1) + sizeof(a2) + sizeof(a3))
+#endif
+
+#if __cplusplus < 201703L
+#include <boost/container/pmr/global_resource.hpp>
+#include <boost/container/pmr/polymorphic_allocator.hpp>
+#include <boost/container/pmr/unsynchronized_pool_resource.hpp>
+#endif
 
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/core/ignore_unused.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -48,7 +128,7 @@ template <> struct fmt::formatter<nats_asio::string_view> {
     template <typename ParseContext> constexpr auto parse(ParseContext& ctx) { return ctx.begin(); }
 
     template <typename FormatContext> auto format(const nats_asio::string_view& d, FormatContext& ctx) {
-        return format_to(ctx.out(), "{}", d.data());
+        return format_to(ctx.out(), "{}", fmt::string_view(d.data(), d.size()));
     }
 };
 
@@ -59,634 +139,6157 @@ namespace ssl = boost::asio::ssl;
 
 constexpr auto sep = "\r\n";
 
+// for probe timings
+inline uint64_t probe_now_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
 typedef boost::asio::ip::tcp::socket raw_socket;
 typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
 
-template <class Socket> auto& take_raw_ref(Socket&);
-
-template <> auto& take_raw_ref(ssl_socket& s) { return s.next_layer(); }
+template <class T> using pmr_vector = std::vector<T, pmr::polymorphic_allocator<T>>;
+typedef std::basic_string<char, std::char_traits<char>, pmr::polymorphic_allocator<char>> pmr_string;
+template <class K, class V>
+using pmr_unordered_map =
+    std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, pmr::polymorphic_allocator<std::pair<const K, V>>>;
 
-template <> auto& take_raw_ref(raw_socket& s) { return s; }
+#ifdef NATS_ASIO_IO_URING
 
-template <class Socket> struct uni_socket {
-    uni_socket(aio& io) : m_socket(io) {}
+// base of operations which get completions from io_uring
+struct uring_op {
+    virtual ~uring_op() = default;
 
-    uni_socket(aio& io, boost::asio::ssl::context& ctx) : m_socket(io, ctx) {}
+    virtual void on_complete(int res, uint32_t flags) = 0;
 
-    void async_connect(const boost::asio::ip::tcp::endpoint& endpoint, ctx c);
+    // called after a buffer was given back to kernel if the op asked for it
+    virtual void on_buffers() {}
+};
 
-    void async_handshake(ctx c);
+// io_uring shared by uring sockets of io_context. Submissions are batched and flushed once per loop turn,
+// completions are reaped when eventfd registered in the ring becomes readable. The eventfd is waited for only while
+// some socket is open, so io runs out of work without them. Receives pick buffers from the group provided to kernel, so
+// one multishot receive per socket serves all reads.
+class uring_service : public boost::asio::execution_context::service {
+public:
+    static boost::asio::execution_context::id id;
 
-    template <class Buf> void async_read_until(Buf& buf, ctx c) {
-        boost::asio::async_read_until(m_socket, buf, sep, c);
-    }
+    static constexpr unsigned entries = 256;
+    static constexpr uint16_t buffers_count = 256;
+    static constexpr std::size_t buffer_size = 16 * 1024;
+    static constexpr uint16_t buffers_group = 0;
+    static constexpr uint64_t probe_key = ~uint64_t(0);
 
-    template <class Buf> void async_read_until_raw(Buf& buf, ctx c) {
-        boost::asio::async_read_until(take_raw_ref(m_socket), buf, sep, c);
-    }
+    explicit uring_service(boost::asio::execution_context& ctx);
 
-    template <class Buf, class Transfer> void async_read(Buf& buf, const Transfer& until, ctx c) {
-        boost::asio::async_read(m_socket, buf, until, c);
-    }
+    ~uring_service();
 
-    template <class Buf, class Transfer> void async_write(const Buf& buf, const Transfer& until, ctx c) {
-        boost::asio::async_write(m_socket, buf, until, c);
-    }
+    // false if kernel has no io_uring or no multishot receive (before 6.0)
+    bool ready() const { return m_fd >= 0; }
 
-    void async_shutdown(ctx c);
+    uint64_t add_op(uring_op* op);
 
-    void close(boost::system::error_code& ec);
+    void remove_op(uint64_t key);
 
-    Socket m_socket;
-};
+    void prep_recv_multishot(int fd, uint64_t key);
 
-template <> void uni_socket<raw_socket>::close(boost::system::error_code& ec) { m_socket.close(ec); }
+    void prep_sendmsg(int fd, const msghdr* msg, uint64_t key);
 
-template <> void uni_socket<ssl_socket>::close(boost::system::error_code& ec) { m_socket.lowest_layer().close(ec); }
+    void prep_cancel(uint64_t key);
 
-template <> void uni_socket<raw_socket>::async_handshake(ctx /*c*/) {}
+    const char* buffer(uint16_t bid) const { return m_buffers.data() + std::size_t(bid) * buffer_size; }
 
-template <> void uni_socket<ssl_socket>::async_handshake(ctx c) {
-    m_socket.async_handshake(boost::asio::ssl::stream_base::client, c);
-}
+    // gives buffer back to kernel
+    void recycle(uint16_t bid);
 
-template <> void uni_socket<raw_socket>::async_shutdown(ctx /*c*/) {}
+    // op gets on_buffers once any buffer is recycled
+    void wait_buffers(uint64_t key);
 
-template <> void uni_socket<ssl_socket>::async_shutdown(ctx c) { m_socket.async_shutdown(c); }
+    // io_uring_enter calls
+    uint64_t submits() const { return m_submits; }
 
-template <> void uni_socket<raw_socket>::async_connect(const boost::asio::ip::tcp::endpoint& endpoint, ctx c) {
-    m_socket.async_connect(endpoint, c);
-}
+private:
+    virtual void shutdown() override;
 
-template <> void uni_socket<ssl_socket>::async_connect(const boost::asio::ip::tcp::endpoint& endpoint, ctx c) {
-    m_socket.lowest_layer().async_connect(endpoint, c);
-}
+    io_uring_sqe* next_sqe();
 
-struct parser_observer {
-    virtual ~parser_observer() = default;
+    void schedule_submit();
 
-    virtual void on_ping(ctx c) = 0;
+    void prep_provide_buffers(uint16_t bid, uint16_t n);
 
-    virtual void on_pong(ctx c) = 0;
+    bool probe_recv_multishot();
 
-    virtual void on_ok(ctx c) = 0;
+    // returns io_uring_enter result, waits for `wait` completions
+    long enter(unsigned wait);
 
-    virtual void on_error(string_view err, ctx c) = 0;
+    void submit();
 
-    virtual void on_info(string_view info, ctx c) = 0;
+    void wait_completions();
 
-    virtual void on_message(string_view subject, string_view sid, optional<string_view> reply_to, std::size_t n,
-                            ctx c) = 0;
+    void reap();
 
-    virtual void consumed(std::size_t n) = 0;
+    aio& m_io;
+    int m_fd;
+    int m_event_fd;
+    boost::asio::posix::stream_descriptor m_event;
+
+    void* m_rings;
+    std::size_t m_rings_size;
+    io_uring_sqe* m_sqes;
+    std::size_t m_sqes_size;
+
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned m_sq_local_tail;
+    unsigned m_to_submit;
+    bool m_submit_scheduled;
+    bool m_waiting;
+
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    std::vector<char> m_buffers;
+
+    uint64_t m_next_key;
+    uint64_t m_submits;
+    std::unordered_map<uint64_t, uring_op*> m_ops;
+    std::vector<uint64_t> m_buffer_waiters;
 };
 
-status parse_header(std::string& header, std::istream& is, parser_observer* observer, ctx c);
+boost::asio::execution_context::id uring_service::id;
 
-enum class mt { INFO, CONNECT, PUB, SUB, UNSUB, MSG, PING, PONG, OK, ERR };
+uring_service::uring_service(boost::asio::execution_context& ctx)
+    : boost::asio::execution_context::service(ctx), m_io(static_cast<aio&>(ctx)), m_fd(-1), m_event_fd(-1),
+      m_event(m_io), m_rings(MAP_FAILED), m_rings_size(0), m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      m_sqes_size(0), m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_mask(0), m_sq_local_tail(0), m_to_submit(0),
+      m_submit_scheduled(false), m_waiting(false), m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(0),
+      m_cqes(nullptr), m_next_key(1), m_submits(0) {
+    io_uring_params p{};
+    auto fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
 
-const std::map<std::string, mt, std::less<>> message_types_map{
-    {"INFO", mt::INFO}, {"CONNECT", mt::CONNECT}, {"PUB", mt::PUB},   {"SUB", mt::SUB}, {"UNSUB", mt::UNSUB},
-    {"MSG", mt::MSG},   {"PING", mt::PING},       {"PONG", mt::PONG}, {"+OK", mt::OK},  {"-ERR", mt::ERR},
-};
+    if (fd < 0) {
+        return;
+    }
 
-std::vector<string_view> split_sv(string_view str, string_view delims = " ") {
-    std::vector<string_view> output;
-    output.reserve(str.size() / 2);
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ::close(fd);
+        return;
+    }
 
-    for (auto first = str.data(), second = str.data(), last = first + str.size(); second != last && first != last;
-         first = second + 1) {
-        second = std::find_first_of(first, last, std::cbegin(delims), std::cend(delims));
+    m_rings_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                            p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+    m_rings = mmap(nullptr, m_rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(
+        mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
 
-        if (first != second) {
-            output.emplace_back(first, second - first);
+    if (m_rings == MAP_FAILED || m_sqes == MAP_FAILED) {
+        ::close(fd);
+        return;
+    }
+
+    auto base = static_cast<char*>(m_rings);
+    m_sq_head = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    m_sq_local_tail = *m_sq_tail;
+    auto array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+
+    // sqes are used in ring order
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    m_cq_head = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+
+    m_fd = fd;
+    m_buffers.resize(std::size_t(buffers_count) * buffer_size);
+    prep_provide_buffers(0, buffers_count);
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (m_event_fd < 0 || syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &m_event_fd, 1) < 0 ||
+        !probe_recv_multishot()) {
+        if (m_event_fd >= 0) {
+            ::close(m_event_fd);
         }
+
+        ::close(fd);
+        m_fd = -1;
+        return;
     }
 
-    return output;
+    m_event.assign(m_event_fd);
 }
 
-status parse_header(std::string& header, std::istream& is, parser_observer* observer, ctx c) {
-    if (!std::getline(is, header)) {
-        return {"can't get line"};
+uring_service::~uring_service() {
+    shutdown();
+
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqes_size);
     }
 
-    if (header.size() < 4) // TODO: maybe delte this check?
-    {
-        return {"too small header"};
+    if (m_rings != MAP_FAILED) {
+        munmap(m_rings, m_rings_size);
     }
+}
 
-    if (header[header.size() - 1] != '\r') {
-        return {"unexpected len of server message"};
+void uring_service::shutdown() {
+    boost::system::error_code ec;
+    m_event.close(ec);
+
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
     }
+}
 
-    header[header.size() - 1] = 0;
-    header.resize(header.size() - 1);
-    auto v = string_view(header);
-    auto p = v.find_first_of(" ");
+uint64_t uring_service::add_op(uring_op* op) {
+    auto key = m_next_key++;
+    m_ops.emplace(key, op);
+    wait_completions();
+    return key;
+}
 
-    if (p == string_view::npos) {
-        if (header.size() != 4 && header.size() != 3) // ok or ping/pong
-        {
-            return {"protocol violation from server"};
-        }
+void uring_service::remove_op(uint64_t key) {
+    m_ops.erase(key);
 
-        p = header.size();
+    if (m_ops.empty()) {
+        boost::system::error_code ec;
+        m_event.cancel(ec);
     }
+}
 
-    auto it = message_types_map.find(v.substr(0, p));
+// a byte sent over a socket pair has to come back with more completions to follow, kernels before 6.0 fail the
+// receive with EINVAL or treat it as a single shot one
+bool uring_service::probe_recv_multishot() {
+    int sv[2];
 
-    if (it == message_types_map.end()) {
-        return {"unknown message"};
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return false;
     }
 
-    switch (it->second) {
-    case mt::INFO: {
-        p += 1; // space
-        auto info_msg = v.substr(p, v.size() - p);
-        observer->on_info(info_msg, c);
-        break;
-    }
+    bool ok = false;
 
-    case mt::MSG: {
-        p += 1;
-        auto info = v.substr(p, v.size() - p);
-        auto results = split_sv(info, " ");
+    if (::send(sv[1], "x", 1, MSG_NOSIGNAL) == 1) {
+        prep_recv_multishot(sv[0], probe_key);
 
-        if (results.size() < 3 || results.size() > 4) {
-            return {"unexpected message format"};
-        }
+        // buffers and the receive
+        if (enter(2) >= 0) {
+            auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
 
-        bool replty_to = results.size() == 4;
-        std::size_t bytes_id = replty_to ? 3 : 2;
-        std::size_t bytes_n = 0;
+            // reap gives the buffer back later
+            for (auto head = *m_cq_head; head != tail; ++head) {
+                const auto& cqe = m_cqes[head & m_cq_mask];
 
-        try {
-            bytes_n = static_cast<std::size_t>(std::stoll(results[bytes_id].data(), nullptr, 10));
-        } catch (const std::exception& e) {
-            return {fmt::format("can't parse int in headers: {}", e.what())};
+                if (cqe.user_data == probe_key) {
+                    ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+                }
+            }
         }
 
-        if (replty_to) {
-            observer->on_message(results[0], results[1], results[2], bytes_n, c);
-        } else {
-            observer->on_message(results[0], results[1], optional<string_view>(), bytes_n, c);
+        if (ok) {
+            prep_cancel(probe_key);
+            enter(0);
         }
-
-        observer->consumed(bytes_n + 2);
-        return {};
     }
 
-    case mt::PING: {
-        observer->on_ping(c);
-        break;
+    ::close(sv[0]);
+    ::close(sv[1]);
+    return ok;
+}
+io_uring_sqe* uring_service::next_sqe() {
+    if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) > m_sq_mask) {
+        submit(); // ring is full
     }
 
-    case mt::PONG: {
-        observer->on_pong(c);
-        break;
+    auto sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_service::schedule_submit() {
+    m_sq_local_tail++;
+    m_to_submit++;
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+    if (!m_submit_scheduled) {
+        m_submit_scheduled = true;
+        boost::asio::post(m_io, [this] { submit(); });
     }
+}
 
-    case mt::OK: {
-        observer->on_ok(c);
-        break;
+void uring_service::prep_recv_multishot(int fd, uint64_t key) {
+    auto sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers_group;
+    sqe->user_data = key;
+    schedule_submit();
+}
+
+void uring_service::prep_sendmsg(int fd, const msghdr* msg, uint64_t key) {
+    auto sqe = next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = key;
+    schedule_submit();
+    // kernel copies msghdr on submit, the socket may be reset or gone before the loop turn ends
+    submit();
+}
+
+void uring_service::prep_cancel(uint64_t key) {
+    auto sqe = next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = key;
+    sqe->user_data = 0;
+    schedule_submit();
+}
+
+void uring_service::prep_provide_buffers(uint16_t bid, uint16_t n) {
+    auto sqe = next_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = n;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    sqe->len = static_cast<uint32_t>(buffer_size);
+    sqe->off = bid;
+    sqe->buf_group = buffers_group;
+    sqe->user_data = 0;
+    schedule_submit();
+}
+
+void uring_service::recycle(uint16_t bid) {
+    prep_provide_buffers(bid, 1);
+
+    if (m_buffer_waiters.empty()) {
+        return;
     }
 
-    case mt::ERR: {
-        p += 1; // space
-        auto err_msg = v.substr(p, v.size() - p);
-        observer->on_error(err_msg, c);
-        break;
+    std::vector<uint64_t> waiters;
+    waiters.swap(m_buffer_waiters);
+    boost::asio::post(m_io, [this, waiters] {
+        for (auto key : waiters) {
+            auto it = m_ops.find(key);
+
+            if (it != m_ops.end()) {
+                it->second->on_buffers();
+            }
+        }
+    });
+}
+
+void uring_service::wait_buffers(uint64_t key) { m_buffer_waiters.push_back(key); }
+
+long uring_service::enter(unsigned wait) {
+    m_submits++;
+    auto r = syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+    if (r > 0) {
+        m_to_submit -= std::min(m_to_submit, static_cast<unsigned>(r));
     }
 
-    default: {
-        return {"unexpected message type"};
+    return r;
+}
+
+void uring_service::submit() {
+    m_submit_scheduled = false;
+
+    if (m_to_submit == 0 || m_fd < 0) {
+        return;
     }
+
+    auto r = enter(0);
+
+    if (r < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+        // entries stay in the ring unsubmitted, ops get the error instead of waiting forever
+        auto err = errno;
+        auto ops = m_ops;
+
+        for (const auto& op : ops) {
+            if (m_ops.count(op.first) > 0) {
+                op.second->on_complete(-err, 0);
+            }
+        }
+
+        return;
     }
 
-    return {};
+    // the rest goes next loop turn, completions are reaped meanwhile
+    if (m_to_submit > 0 && !m_submit_scheduled) {
+        m_submit_scheduled = true;
+        boost::asio::post(m_io, [this] { submit(); });
+    }
 }
 
-struct subscription : public isubscription, private boost::asio::detail::noncopyable {
-    subscription(uint64_t sid, const on_message_cb& cb);
+void uring_service::wait_completions() {
+    if (m_waiting || m_ops.empty() || m_fd < 0) {
+        return;
+    }
 
-    virtual void cancel() override;
+    m_waiting = true;
+    m_event.async_wait(boost::asio::posix::descriptor_base::wait_read, [this](boost::system::error_code ec) {
+        m_waiting = false;
 
-    virtual uint64_t sid() override;
+        // cancelled by remove_op, an op could be added before this ran
+        if (ec == boost::asio::error::operation_aborted) {
+            wait_completions();
+            return;
+        }
 
-    bool m_cancel;
-    on_message_cb m_cb;
-    uint64_t m_sid;
-};
-typedef std::shared_ptr<subscription> subscription_sptr;
+        if (ec.failed()) {
+            return;
+        }
 
-subscription::subscription(uint64_t sid, const on_message_cb& cb) : m_cancel(false), m_cb(cb), m_sid(sid) {}
+        uint64_t counter = 0;
 
-void subscription::cancel() { m_cancel = true; }
+        while (::read(m_event_fd, &counter, sizeof(counter)) > 0) {
+        }
 
-uint64_t subscription::sid() { return m_sid; }
+        reap();
+        wait_completions();
+    });
+}
 
-template <class SocketType>
-class connection : public iconnection, public parser_observer, private boost::asio::detail::noncopyable {
+void uring_service::reap() {
+    auto head = *m_cq_head;
+
+    for (;;) {
+        auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            break;
+        }
+
+        auto cqe = m_cqes[head & m_cq_mask];
+        __atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+        auto it = m_ops.find(cqe.user_data);
+
+        if (it != m_ops.end()) {
+            it->second->on_complete(cqe.res, cqe.flags);
+        } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+            recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT)); // socket is already gone
+        }
+    }
+}
+
+// stream socket doing reads and writes through uring_service, connect is done by asio
+class uring_socket : private boost::asio::detail::noncopyable {
 public:
-    connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-               const on_disconnected_cb& disconnected_cb, const std::shared_ptr<ssl::context>& ctx);
+    typedef aio::executor_type executor_type;
+    typedef uring_socket lowest_layer_type;
 
-    connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-               const on_disconnected_cb& disconnected_cb);
+    explicit uring_socket(aio& io);
 
-    virtual void start(const connect_config& conf) override;
+    ~uring_socket();
 
-    virtual void stop() override { m_stop_flag = true; }
+    executor_type get_executor() { return m_io.get_executor(); }
 
-    virtual bool is_connected() override { return m_is_connected; }
+    lowest_layer_type& lowest_layer() { return *this; }
 
-    virtual status publish(string_view subject, const char* raw, std::size_t n, optional<string_view> reply_to,
-                           ctx c) override;
+    // takes over descriptor of a connected socket
+    void assign(tcp::socket& s, boost::system::error_code& ec);
 
-    virtual status unsubscribe(const isubscription_sptr& p, ctx c) override;
+    void close(boost::system::error_code& ec);
 
-    virtual std::pair<isubscription_sptr, status> subscribe(string_view subject, optional<string_view> queue,
-                                                            on_message_cb cb, ctx c) override;
+    template <class MutableBufferSequence, class Token>
+    auto async_read_some(const MutableBufferSequence& buffers, Token&& token) {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::size_t)>(
+            [this, buffers](auto handler) {
+                m_read_buffers.assign(boost::asio::buffer_sequence_begin(buffers),
+                                      boost::asio::buffer_sequence_end(buffers));
+                m_read_handler = bind_completion(std::move(handler));
+                complete_read();
+            },
+            token);
+    }
+
+    template <class ConstBufferSequence, class Token>
+    auto async_write_some(const ConstBufferSequence& buffers, Token&& token) {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::size_t)>(
+            [this, buffers](auto handler) {
+                m_write_handler = bind_completion(std::move(handler));
+
+                if (m_fd < 0) {
+                    finish(m_write_handler, boost::asio::error::bad_descriptor, 0);
+                    return;
+                }
+
+                m_iov.clear();
+
+                for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                     it != boost::asio::buffer_sequence_end(buffers) && m_iov.size() < max_iov; ++it) {
+                    m_iov.push_back({const_cast<void*>(it->data()), it->size()});
+                }
+
+                m_msg = msghdr{};
+                m_msg.msg_iov = m_iov.data();
+                m_msg.msg_iovlen = m_iov.size();
+                m_service.prep_sendmsg(m_fd, &m_msg, m_send_key);
+            },
+            token);
+    }
 
 private:
-    virtual void on_ping(ctx c) override;
+    typedef std::function<void(boost::system::error_code, std::size_t)> completion;
 
-    virtual void on_pong(ctx) override { m_log->trace("pong recived"); }
+    static constexpr std::size_t max_iov = 64;
 
-    virtual void on_ok(ctx) override { m_log->trace("ok recived"); }
+    struct recv_op : public uring_op {
+        explicit recv_op(uring_socket* s) : m_socket(s) {}
 
-    virtual void on_error(string_view err, ctx) override { m_log->error("error message from server {}", err); }
+        virtual void on_complete(int res, uint32_t flags) override { m_socket->on_recv(res, flags); }
 
-    virtual void on_info(string_view info, ctx c) override;
+        virtual void on_buffers() override { m_socket->on_buffers(); }
 
-    virtual void on_message(string_view subject, string_view sid, optional<string_view> reply_to, std::size_t n,
-                            ctx c) override;
+        uring_socket* m_socket;
+    };
 
-    virtual void consumed(std::size_t n) override { m_buf.consume(n); }
+    struct send_op : public uring_op {
+        explicit send_op(uring_socket* s) : m_socket(s) {}
 
-    status do_connect(const connect_config& conf, ctx c);
+        virtual void on_complete(int res, uint32_t) override { m_socket->on_send(res); }
 
-    void run(const connect_config& conf, ctx c);
+        uring_socket* m_socket;
+    };
 
-    status handle_error(ctx c);
+    struct chunk {
+        uint16_t bid;
+        std::size_t offset;
+        std::size_t size;
+    };
 
-    std::string prepare_info(const connect_config& o);
+    template <class Handler> completion bind_completion(Handler&& handler) {
+        auto ex = boost::asio::get_associated_executor(handler, m_io.get_executor());
+        return [ex, handler](boost::system::error_code ec, std::size_t n) mutable {
+            boost::asio::post(ex, [handler, ec, n]() mutable { handler(ec, n); });
+        };
+    }
 
-    uint64_t next_sid() { return m_sid++; }
+    void finish(completion& handler, boost::system::error_code ec, std::size_t n);
 
-    uint64_t m_sid;
-    std::size_t m_max_payload;
-    logger m_log;
-    aio& m_io;
+    void arm_recv();
 
-    bool m_is_connected;
-    bool m_stop_flag;
+    void on_recv(int res, uint32_t flags);
 
-    std::unordered_map<uint64_t, subscription_sptr> m_subs;
-    on_connected_cb m_connected_cb;
-    on_disconnected_cb m_disconnected_cb;
-    boost::system::error_code ec;
+    void on_send(int res);
 
-    boost::asio::streambuf m_buf;
+    void on_buffers();
 
-    std::shared_ptr<ssl::context> m_ssl_ctx;
-    uni_socket<SocketType> m_socket;
+    void complete_read();
+
+    aio& m_io;
+    uring_service& m_service;
+    int m_fd;
+
+    recv_op m_recv_op;
+    send_op m_send_op;
+    uint64_t m_recv_key;
+    uint64_t m_send_key;
+
+    // true while multishot receive is active in kernel
+    bool m_recv_armed;
+    // receive stopped because kernel had no free buffers
+    bool m_recv_starved;
+    boost::system::error_code m_read_error;
+    std::deque<chunk> m_chunks;
+    std::vector<boost::asio::mutable_buffer> m_read_buffers;
+    completion m_read_handler;
+
+    std::vector<iovec> m_iov;
+    msghdr m_msg;
+    completion m_write_handler;
 };
 
-void load_certificates(const ssl_config& conf, ssl::context& ctx) {
-    ctx.set_options(ssl::context::tls_client);
+uring_socket::uring_socket(aio& io)
+    : m_io(io), m_service(boost::asio::use_service<uring_service>(io)), m_fd(-1), m_recv_op(this), m_send_op(this),
+      m_recv_key(0), m_send_key(0), m_recv_armed(false), m_recv_starved(false), m_msg{} {}
 
-    if (conf.ssl_verify) {
-        ctx.set_verify_mode(ssl::verify_peer);
-    } else {
-        ctx.set_verify_mode(ssl::verify_none);
-    }
+uring_socket::~uring_socket() {
+    boost::system::error_code ec;
+    close(ec);
+}
 
-    if (!conf.ssl_cert.empty()) {
-        ctx.use_certificate(boost::asio::buffer(conf.ssl_cert.data(), conf.ssl_cert.size()),
-                            ssl::context::file_format::pem);
+void uring_socket::assign(tcp::socket& s, boost::system::error_code& ec) {
+    if (!m_service.ready()) {
+        ec = boost::asio::error::operation_not_supported;
+        return;
     }
 
-    if (!conf.ssl_ca.empty()) {
-        ctx.add_certificate_authority(boost::asio::buffer(conf.ssl_ca.data(), conf.ssl_ca.size()));
-    }
+    s.set_option(tcp::no_delay(true), ec);
+    m_fd = s.release(ec);
 
-    if (!conf.ssl_dh.empty()) {
-        ctx.use_tmp_dh_file(conf.ssl_dh);
+    if (ec.failed()) {
+        return;
     }
 
-    if (!conf.ssl_key.empty()) {
+    // fresh keys, completions of a previous descriptor find nothing
+    m_recv_key = m_service.add_op(&m_recv_op);
+    m_send_key = m_service.add_op(&m_send_op);
+    m_read_error = {};
+    arm_recv();
+}
+
+void uring_socket::close(boost::system::error_code& ec) {
+    ec = {};
+
+    if (m_fd < 0) {
+        return;
+    }
+
+    ::shutdown(m_fd, SHUT_RDWR);
+
+    if (m_recv_armed) {
+        m_service.prep_cancel(m_recv_key);
+    }
+
+    if (::close(m_fd) != 0) {
+        ec.assign(errno, boost::system::system_category());
+    }
+
+    m_fd = -1;
+    m_recv_armed = false;
+    m_service.remove_op(m_recv_key);
+    m_service.remove_op(m_send_key);
+
+    for (const auto& ch : m_chunks) {
+        m_service.recycle(ch.bid);
+    }
+
+    m_chunks.clear();
+    m_read_error = boost::asio::error::operation_aborted;
+    finish(m_read_handler, m_read_error, 0);
+    finish(m_write_handler, boost::asio::error::operation_aborted, 0);
+}
+
+void uring_socket::finish(completion& handler, boost::system::error_code ec, std::size_t n) {
+    if (handler == nullptr) {
+        return;
+    }
+
+    auto h = std::move(handler);
+    handler = nullptr;
+    h(ec, n);
+}
+
+void uring_socket::arm_recv() {
+    m_recv_armed = true;
+    m_recv_starved = false;
+    m_service.prep_recv_multishot(m_fd, m_recv_key);
+}
+
+void uring_socket::on_recv(int res, uint32_t flags) {
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        m_chunks.push_back({static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT), 0, std::size_t(res)});
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        m_recv_armed = false;
+
+        if (res == -ENOBUFS) {
+            m_recv_starved = true;
+        } else if (res == 0) {
+            m_read_error = boost::asio::error::eof;
+        } else if (res < 0 && !m_read_error.failed()) {
+            m_read_error.assign(-res, boost::system::system_category());
+        } else if (m_fd >= 0) {
+            arm_recv();
+        }
+    }
+
+    complete_read();
+}
+
+void uring_socket::on_send(int res) {
+    if (res < 0) {
+        finish(m_write_handler, boost::system::error_code(-res, boost::system::system_category()), 0);
+        return;
+    }
+
+    finish(m_write_handler, {}, std::size_t(res));
+}
+
+void uring_socket::on_buffers() {
+    if (m_recv_starved && !m_recv_armed && m_fd >= 0) {
+        arm_recv();
+    }
+}
+
+void uring_socket::complete_read() {
+    if (m_read_handler == nullptr) {
+        return;
+    }
+
+    // asio read ops start with an empty read when data is already buffered, it must not wait for the socket
+    if (boost::asio::buffer_size(m_read_buffers) == 0) {
+        finish(m_read_handler, {}, 0);
+        return;
+    }
+
+    if (m_chunks.empty()) {
+        if (m_read_error.failed()) {
+            finish(m_read_handler, m_read_error, 0);
+        } else if (m_recv_starved) {
+            m_service.wait_buffers(m_recv_key); // all buffers are held by other sockets
+        }
+
+        return;
+    }
+
+    std::size_t n = 0;
+
+    for (auto dst : m_read_buffers) {
+        while (dst.size() > 0 && !m_chunks.empty()) {
+            auto& ch = m_chunks.front();
+            auto copied = boost::asio::buffer_copy(
+                dst, boost::asio::buffer(m_service.buffer(ch.bid) + ch.offset, ch.size - ch.offset));
+            ch.offset += copied;
+            dst += copied;
+            n += copied;
+
+            if (ch.offset == ch.size) {
+                m_service.recycle(ch.bid);
+                m_chunks.pop_front();
+            }
+        }
+    }
+
+    finish(m_read_handler, {}, n);
+
+    if (m_recv_starved && m_fd >= 0) {
+        arm_recv(); // some buffers are free again
+    }
+}
+
+#endif
+
+enum class wire_direction : uint8_t { in, out };
+
+// capture file is a header { "NATSCAP1", start unix time ns } and records { offset ns from start, size, direction,
+// 3 bytes padding, size bytes }, numbers are in host byte order
+constexpr char capture_magic[8] = {'N', 'A', 'T', 'S', 'C', 'A', 'P', '1'};
+constexpr std::size_t capture_header_size = 16;
+constexpr std::size_t capture_record_header_size = 16;
+
+// appends protocol bytes to a memory mapped capture file, file is cut to the written size on close
+class wire_recorder : private boost::asio::detail::noncopyable {
+public:
+    wire_recorder() : m_fd(-1), m_map(nullptr), m_capacity(0), m_size(0) {}
+
+    ~wire_recorder();
+
+    status open(const std::string& path);
+
+    void record(wire_direction dir, const char* data, std::size_t n) {
+        boost::asio::const_buffer buf(data, n);
+        record(dir, &buf, &buf + 1);
+    }
+
+    // pieces of one write go to one record
+    template <class Iterator> void record(wire_direction dir, Iterator first, Iterator last);
+
+private:
+    static constexpr std::size_t initial_capacity = 1024 * 1024;
+
+    bool reserve(std::size_t n);
+
+    int m_fd;
+    char* m_map;
+    std::size_t m_capacity;
+    std::size_t m_size;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+wire_recorder::~wire_recorder() {
+    if (m_map != nullptr) {
+        munmap(m_map, m_capacity);
+    }
+
+    if (m_fd >= 0) {
+        if (ftruncate(m_fd, static_cast<off_t>(m_size)) != 0) {
+            m_size = 0; // file keeps zeroed tail, reader stops on it
+        }
+
+        ::close(m_fd);
+    }
+}
+
+status wire_recorder::open(const std::string& path) {
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (m_fd < 0 || !reserve(capture_header_size)) {
+        return status(fmt::format("can't open capture file {}: {}", path, std::strerror(errno)));
+    }
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    uint64_t start_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    std::memcpy(m_map, capture_magic, sizeof(capture_magic));
+    std::memcpy(m_map + sizeof(capture_magic), &start_ns, sizeof(start_ns));
+    m_size = capture_header_size;
+    m_start = std::chrono::steady_clock::now();
+    return {};
+}
+
+template <class Iterator> void wire_recorder::record(wire_direction dir, Iterator first, Iterator last) {
+    std::size_t n = 0;
+
+    for (auto it = first; it != last; ++it) {
+        n += boost::asio::buffer(*it).size();
+    }
+
+    if (n == 0 || n > std::numeric_limits<uint32_t>::max() || !reserve(m_size + capture_record_header_size + n)) {
+        return;
+    }
+
+    auto offset = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+    uint64_t offset_ns = static_cast<uint64_t>(offset.count());
+    uint32_t size = static_cast<uint32_t>(n);
+    auto p = m_map + m_size;
+    std::memcpy(p, &offset_ns, sizeof(offset_ns));
+    std::memcpy(p + 8, &size, sizeof(size));
+    p[12] = static_cast<char>(dir);
+    p[13] = p[14] = p[15] = 0;
+    p += capture_record_header_size;
+
+    for (auto it = first; it != last; ++it) {
+        boost::asio::const_buffer b = boost::asio::buffer(*it);
+        std::memcpy(p, b.data(), b.size());
+        p += b.size();
+    }
+
+    m_size += capture_record_header_size + n;
+}
+
+bool wire_recorder::reserve(std::size_t n) {
+    if (n <= m_capacity) {
+        return true;
+    }
+
+    std::size_t capacity = m_capacity > initial_capacity ? m_capacity : initial_capacity;
+
+    while (capacity < n) {
+        capacity *= 2;
+    }
+
+    if (m_map != nullptr) {
+        munmap(m_map, m_capacity);
+        m_map = nullptr;
+        m_capacity = 0;
+    }
+
+    if (ftruncate(m_fd, static_cast<off_t>(capacity)) != 0) {
+        return false;
+    }
+
+    auto map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    m_map = static_cast<char*>(map);
+    m_capacity = capacity;
+    return true;
+}
+
+struct capture_record {
+    uint64_t offset_ns;
+    wire_direction direction;
+    const char* data;
+    std::size_t size;
+};
+
+// reads records of a file written by wire_recorder
+class capture_reader : private boost::asio::detail::noncopyable {
+public:
+    capture_reader() : m_map(nullptr), m_size(0), m_pos(0) {}
+
+    ~capture_reader();
+
+    status open(const std::string& path);
+
+    // false at the end of capture or on a truncated record
+    bool next(capture_record& r);
+
+private:
+    const char* m_map;
+    std::size_t m_size;
+    std::size_t m_pos;
+};
+
+capture_reader::~capture_reader() {
+    if (m_map != nullptr) {
+        munmap(const_cast<char*>(m_map), m_size);
+    }
+}
+
+status capture_reader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return status(fmt::format("can't open capture file {}: {}", path, std::strerror(errno)));
+    }
+
+    struct stat st {};
+    auto size = fstat(fd, &st) == 0 ? static_cast<std::size_t>(st.st_size) : 0;
+    void* map = size >= capture_header_size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+
+    if (map == MAP_FAILED || std::memcmp(map, capture_magic, sizeof(capture_magic)) != 0) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+
+        return status(fmt::format("{} is not a capture file", path));
+    }
+
+    m_map = static_cast<const char*>(map);
+    m_size = size;
+    m_pos = capture_header_size;
+    return {};
+}
+
+bool capture_reader::next(capture_record& r) {
+    if (m_size - m_pos < capture_record_header_size) {
+        return false;
+    }
+
+    auto p = m_map + m_pos;
+    uint32_t size = 0;
+    std::memcpy(&r.offset_ns, p, sizeof(r.offset_ns));
+    std::memcpy(&size, p + 8, sizeof(size));
+    r.direction = static_cast<wire_direction>(p[12]);
+
+    if (size == 0 || m_size - m_pos - capture_record_header_size < size) {
+        return false;
+    }
+
+    r.data = p + capture_record_header_size;
+    r.size = size;
+    m_pos += capture_record_header_size + size;
+    return true;
+}
+
+// stream socket returning server bytes of a capture, writes are dropped. With original timing a record is
+// returned when as much time has passed since the first read as between the first and this record in capture
+class replay_socket : private boost::asio::detail::noncopyable {
+public:
+    typedef aio::executor_type executor_type;
+    typedef replay_socket lowest_layer_type;
+
+    replay_socket(aio& io, const std::shared_ptr<capture_reader>& capture, bool original_timing)
+        : m_io(io), m_capture(capture), m_original_timing(original_timing), m_timer(io), m_closed(false),
+          m_started(false), m_first_ns(0), m_pos(0), m_has_record(false) {}
+
+    executor_type get_executor() { return m_io.get_executor(); }
+
+    lowest_layer_type& lowest_layer() { return *this; }
+
+    void close(boost::system::error_code& ec) {
+        ec = {};
+        m_closed = true;
+        m_timer.cancel();
+    }
+
+    template <class MutableBufferSequence, class Token>
+    auto async_read_some(const MutableBufferSequence& buffers, Token&& token) {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::size_t)>(
+            [this, buffers](auto handler) {
+                auto ex = boost::asio::get_associated_executor(handler, m_io.get_executor());
+                m_timer.expires_at(due());
+                m_timer.async_wait(boost::asio::bind_executor(
+                    ex, [this, buffers, handler = std::move(handler)](boost::system::error_code) mutable {
+                        std::size_t n = 0;
+                        auto ec = fill(buffers, n);
+                        handler(ec, n);
+                    }));
+            },
+            token);
+    }
+
+    template <class ConstBufferSequence, class Token>
+    auto async_write_some(const ConstBufferSequence& buffers, Token&& token) {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::size_t)>(
+            [this, buffers](auto handler) {
+                auto ex = boost::asio::get_associated_executor(handler, m_io.get_executor());
+                auto n = boost::asio::buffer_size(buffers);
+                boost::asio::post(ex, [handler = std::move(handler), n]() mutable { handler({}, n); });
+            },
+            token);
+    }
+
+private:
+    // takes the next server record, false at the end of capture
+    bool advance();
+
+    boost::posix_time::ptime due();
+
+    template <class MutableBufferSequence>
+    boost::system::error_code fill(const MutableBufferSequence& buffers, std::size_t& n);
+
+    aio& m_io;
+    std::shared_ptr<capture_reader> m_capture;
+    bool m_original_timing;
+    boost::asio::deadline_timer m_timer;
+    bool m_closed;
+    bool m_started;
+    boost::posix_time::ptime m_start;
+    uint64_t m_first_ns;
+    capture_record m_record;
+    std::size_t m_pos;
+    bool m_has_record;
+};
+
+bool replay_socket::advance() {
+    while (m_capture->next(m_record)) {
+        if (m_record.direction == wire_direction::in) {
+            m_pos = 0;
+            m_has_record = true;
+
+            if (!m_started) {
+                m_started = true;
+                m_start = boost::posix_time::microsec_clock::universal_time();
+                m_first_ns = m_record.offset_ns;
+            }
+
+            return true;
+        }
+    }
+
+    m_has_record = false;
+    return false;
+}
+
+boost::posix_time::ptime replay_socket::due() {
+    auto now = boost::posix_time::microsec_clock::universal_time();
+
+    if ((!m_has_record || m_pos == m_record.size) && !advance()) {
+        return now;
+    }
+
+    if (!m_original_timing) {
+        return now;
+    }
+
+    return m_start + boost::posix_time::microseconds(static_cast<int64_t>((m_record.offset_ns - m_first_ns) / 1000));
+}
+
+template <class MutableBufferSequence>
+boost::system::error_code replay_socket::fill(const MutableBufferSequence& buffers, std::size_t& n) {
+    n = 0;
+
+    if (m_closed) {
+        return boost::asio::error::operation_aborted;
+    }
+
+    if (!m_has_record) {
+        return boost::asio::error::eof;
+    }
+
+    auto now = boost::posix_time::microsec_clock::universal_time();
+
+    for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers);
+         ++it) {
+        boost::asio::mutable_buffer dst(*it);
+
+        while (dst.size() > 0) {
+            if (m_pos == m_record.size) {
+                // records which are due are read together like socket does with arrived segments
+                if (!advance() || (m_original_timing && due() > now)) {
+                    return {};
+                }
+            }
+
+            auto src = boost::asio::buffer(m_record.data + m_pos, m_record.size - m_pos);
+            auto copied = boost::asio::buffer_copy(dst, src);
+            m_pos += copied;
+            dst += copied;
+            n += copied;
+        }
+    }
+
+    return {};
+}
+
+template <class Socket> auto& take_raw_ref(Socket&);
+
+template <> auto& take_raw_ref(ssl_socket& s) { return s.next_layer(); }
+
+template <> auto& take_raw_ref(raw_socket& s) { return s; }
+
+#ifdef NATS_ASIO_IO_URING
+template <> auto& take_raw_ref(uring_socket& s) { return s; }
+#endif
+
+template <> auto& take_raw_ref(replay_socket& s) { return s; }
+
+// ssl context of a connection, keeps the last session ticket to resume it on reconnect
+struct tls_context : private boost::asio::detail::noncopyable {
+    tls_context(const ssl_config& conf);
+
+    ~tls_context();
+
+    ssl::context m_ctx;
+    SSL_SESSION* m_session;
+};
+
+// app data of SSL_CTX is taken by asio for verify callback
+int tls_context_index() {
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+tls_context* get_tls_context(SSL* ssl) {
+    return static_cast<tls_context*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_context_index()));
+}
+
+template <class Socket> struct uni_socket {
+    template <class... Args> uni_socket(aio& io, Args&&... args) : m_socket(io, std::forward<Args>(args)...) {}
+
+    // takes a socket connected by connect_race
+    void assign(tcp::socket&& s, boost::system::error_code& ec);
+
+    // returns true if previous session was resumed
+    bool async_handshake(ctx c);
+
+    template <class Buf> void async_read_until_raw(Buf& buf, ctx c) {
+        auto before = buf.size();
+        boost::asio::async_read_until(take_raw_ref(m_socket), buf, sep, c);
+
+        if (m_recorder != nullptr && buf.size() > before) {
+            m_recorder->record(wire_direction::in, static_cast<const char*>(buf.data().data()) + before,
+                               buf.size() - before);
+        }
+    }
+
+    std::size_t async_read_some(boost::asio::mutable_buffer buf, ctx c) {
+        auto n = m_socket.async_read_some(buf, c);
+
+        if (m_recorder != nullptr && n > 0) {
+            m_recorder->record(wire_direction::in, static_cast<const char*>(buf.data()), n);
+        }
+
+        return n;
+    }
+
+    template <class Buf, class Transfer> void async_write(const Buf& buf, const Transfer& until, ctx c) {
+        record_write(buf);
+        boost::asio::async_write(m_socket, buf, until, c);
+    }
+
+    template <class Buf> void record_write(const Buf& buf) {
+        if (m_recorder != nullptr) {
+            m_recorder->record(wire_direction::out, boost::asio::buffer_sequence_begin(buf),
+                               boost::asio::buffer_sequence_end(buf));
+        }
+    }
+
+    void async_shutdown(ctx c);
+
+    void close(boost::system::error_code& ec);
+
+    Socket m_socket;
+    wire_recorder* m_recorder = nullptr;
+    // multi-buffer writes to ssl stream are joined here, kept to reuse its capacity
+    std::vector<char> m_joined;
+};
+
+template <> void uni_socket<raw_socket>::close(boost::system::error_code& ec) { m_socket.close(ec); }
+
+template <> void uni_socket<ssl_socket>::close(boost::system::error_code& ec) { m_socket.lowest_layer().close(ec); }
+
+template <> bool uni_socket<raw_socket>::async_handshake(ctx /*c*/) { return false; }
+
+template <> bool uni_socket<ssl_socket>::async_handshake(ctx c) {
+    auto ssl = m_socket.native_handle();
+    auto tls = get_tls_context(ssl);
+
+    if (tls != nullptr && tls->m_session != nullptr) {
+        SSL_set_session(ssl, tls->m_session);
+    }
+
+    m_socket.async_handshake(boost::asio::ssl::stream_base::client, c);
+    return SSL_session_reused(ssl) == 1;
+}
+
+// ssl stream makes a record from the first buffer of sequence only, so join them to write all at once
+template <>
+template <class Buf, class Transfer>
+void uni_socket<ssl_socket>::async_write(const Buf& buf, const Transfer& until, ctx c) {
+    record_write(buf);
+    auto first = boost::asio::buffer_sequence_begin(buf);
+
+    if (std::next(first) == boost::asio::buffer_sequence_end(buf)) {
+        boost::asio::async_write(m_socket, buf, until, c);
+        return;
+    }
+
+    m_joined.resize(boost::asio::buffer_size(buf));
+    boost::asio::buffer_copy(boost::asio::buffer(m_joined), buf);
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_joined), until, c);
+}
+
+template <> void uni_socket<raw_socket>::async_shutdown(ctx /*c*/) {}
+
+template <> void uni_socket<ssl_socket>::async_shutdown(ctx c) { m_socket.async_shutdown(c); }
+
+template <> void uni_socket<raw_socket>::assign(tcp::socket&& s, boost::system::error_code& ec) {
+    ec = {};
+    m_socket = std::move(s);
+}
+
+template <> void uni_socket<ssl_socket>::assign(tcp::socket&& s, boost::system::error_code& ec) {
+    ec = {};
+    m_socket.next_layer() = std::move(s);
+}
+
+template <> void uni_socket<replay_socket>::close(boost::system::error_code& ec) { m_socket.close(ec); }
+
+template <> bool uni_socket<replay_socket>::async_handshake(ctx /*c*/) { return false; }
+
+template <> void uni_socket<replay_socket>::async_shutdown(ctx /*c*/) {}
+
+template <> void uni_socket<replay_socket>::assign(tcp::socket&& /*s*/, boost::system::error_code& ec) { ec = {}; }
+
+#ifdef NATS_ASIO_IO_URING
+template <> void uni_socket<uring_socket>::close(boost::system::error_code& ec) { m_socket.close(ec); }
+
+template <> bool uni_socket<uring_socket>::async_handshake(ctx /*c*/) { return false; }
+
+template <> void uni_socket<uring_socket>::async_shutdown(ctx /*c*/) {}
+
+template <> void uni_socket<uring_socket>::assign(tcp::socket&& s, boost::system::error_code& ec) {
+    m_socket.assign(s, ec);
+}
+#endif
+
+// alternates address families starting with the family of the first endpoint, so an unreachable family costs
+// one stagger delay instead of a timeout per address
+std::vector<tcp::endpoint> interleave_families(const std::vector<tcp::endpoint>& endpoints) {
+    std::vector<tcp::endpoint> first, second, out;
+
+    for (const auto& e : endpoints) {
+        (e.protocol() == endpoints.front().protocol() ? first : second).push_back(e);
+    }
+
+    for (std::size_t i = 0; i < first.size() || i < second.size(); ++i) {
+        if (i < first.size()) {
+            out.push_back(first[i]);
+        }
+
+        if (i < second.size()) {
+            out.push_back(second[i]);
+        }
+    }
+
+    return out;
+}
+
+// connects to endpoints in order, starting the next attempt when the previous ones failed or after stagger
+// without waiting for them. The first connected socket wins and the others are closed
+class connect_race : public std::enable_shared_from_this<connect_race> {
+public:
+    explicit connect_race(aio& io) : m_io(io), m_failed(0), m_winner(npos), m_event(io) {}
+
+    // attempts is incremented for every started connect
+    boost::system::error_code run(const std::vector<tcp::endpoint>& endpoints, duration stagger,
+                                  boost::posix_time::ptime deadline, tcp::socket& out, uint64_t& attempts, ctx c);
+
+private:
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    void start(const tcp::endpoint& endpoint);
+
+    aio& m_io;
+    std::vector<std::unique_ptr<tcp::socket>> m_sockets;
+    std::size_t m_failed;
+    std::size_t m_winner;
+    boost::system::error_code m_error;
+    // woken by every finished attempt
+    boost::asio::deadline_timer m_event;
+};
+
+boost::system::error_code connect_race::run(const std::vector<tcp::endpoint>& endpoints, duration stagger,
+                                            boost::posix_time::ptime deadline, tcp::socket& out, uint64_t& attempts,
+                                            ctx c) {
+    if (endpoints.empty()) {
+        return boost::asio::error::host_not_found;
+    }
+
+    auto next_start = boost::asio::deadline_timer::traits_type::now();
+
+    while (m_winner == npos) {
+        auto now = boost::asio::deadline_timer::traits_type::now();
+        auto started = m_sockets.size();
+
+        if (started < endpoints.size() && (now >= next_start || m_failed == started)) {
+            start(endpoints[started]);
+            attempts++;
+            next_start = now + stagger;
+            continue;
+        }
+
+        if (m_failed == endpoints.size()) {
+            return m_error;
+        }
+
+        if (now >= deadline) {
+            m_error = boost::asio::error::timed_out;
+            break;
+        }
+
+        boost::system::error_code ec;
+        m_event.expires_at(started < endpoints.size() && next_start < deadline ? next_start : deadline);
+        m_event.async_wait(c[ec]);
+    }
+
+    // pending attempts complete with operation_aborted, they keep the race alive until then
+    for (std::size_t i = 0; i < m_sockets.size(); ++i) {
+        if (i != m_winner) {
+            boost::system::error_code ec;
+            m_sockets[i]->close(ec);
+        }
+    }
+
+    if (m_winner == npos) {
+        return m_error;
+    }
+
+    out = std::move(*m_sockets[m_winner]);
+    return {};
+}
+
+void connect_race::start(const tcp::endpoint& endpoint) {
+    auto i = m_sockets.size();
+    m_sockets.push_back(std::make_unique<tcp::socket>(m_io));
+    auto self = shared_from_this();
+    m_sockets.back()->async_connect(endpoint, [self, i](boost::system::error_code ec) {
+        if (ec.failed()) {
+            self->m_failed++;
+            self->m_error = ec;
+        } else if (self->m_winner == npos) {
+            self->m_winner = i;
+        } else {
+            self->m_sockets[i]->close(ec);
+        }
+
+        self->m_event.cancel();
+    });
+}
+
+struct parser_observer {
+    virtual ~parser_observer() = default;
+
+    virtual void on_ping(ctx c) = 0;
+
+    virtual void on_pong(ctx c) = 0;
+
+    virtual void on_ok(ctx c) = 0;
+
+    virtual void on_error(string_view err, ctx c) = 0;
+
+    virtual void on_info(string_view info, ctx c) = 0;
+
+    // header_n is a size of header block in front of the payload, n is a total size of both
+    virtual void on_message(string_view subject, string_view sid, optional<string_view> reply_to, std::size_t header_n,
+                            std::size_t n, ctx c) = 0;
+
+    virtual void consumed(std::size_t n) = 0;
+};
+
+status parse_header(std::string& header, std::istream& is, parser_observer* observer, ctx c);
+
+enum class mt { INFO, CONNECT, PUB, HPUB, SUB, UNSUB, MSG, HMSG, PING, PONG, OK, ERR };
+
+const std::map<std::string, mt, std::less<>> message_types_map{
+    {"INFO", mt::INFO}, {"CONNECT", mt::CONNECT}, {"PUB", mt::PUB},   {"HPUB", mt::HPUB}, {"SUB", mt::SUB},
+    {"UNSUB", mt::UNSUB}, {"MSG", mt::MSG},     {"HMSG", mt::HMSG}, {"PING", mt::PING}, {"PONG", mt::PONG},
+    {"+OK", mt::OK},    {"-ERR", mt::ERR},
+};
+
+std::vector<string_view> split_sv(string_view str, string_view delims = " ") {
+    std::vector<string_view> output;
+    output.reserve(str.size() / 2);
+
+    for (auto first = str.data(), second = str.data(), last = first + str.size(); second != last && first != last;
+         first = second + 1) {
+        second = std::find_first_of(first, last, std::cbegin(delims), std::cend(delims));
+
+        if (first != second) {
+            output.emplace_back(first, second - first);
+        }
+    }
+
+    return output;
+}
+
+// like split_sv but into fields array, returns max + 1 if str has more than max fields
+std::size_t split_fields(string_view str, string_view* fields, std::size_t max) {
+    std::size_t n = 0;
+
+    for (auto first = str.data(), second = str.data(), last = first + str.size(); second != last && first != last;
+         first = second + 1) {
+        second = std::find(first, last, ' ');
+
+        if (first == second) {
+            continue;
+        }
+
+        if (n == max) {
+            return max + 1;
+        }
+
+        fields[n++] = string_view(first, static_cast<std::size_t>(second - first));
+    }
+
+    return n;
+}
+
+bool parse_uint(string_view str, uint64_t& out) {
+    if (str.empty()) {
+        return false;
+    }
+
+    uint64_t v = 0;
+
+    for (auto ch : str) {
+        if (ch < '0' || ch > '9') {
+            return false;
+        }
+
+        v = v * 10 + static_cast<uint64_t>(ch - '0');
+    }
+
+    out = v;
+    return true;
+}
+
+status parse_header(std::string& header, std::istream& is, parser_observer* observer, ctx c) {
+    if (!std::getline(is, header)) {
+        return {"can't get line"};
+    }
+
+    if (header.size() < 4) // TODO: maybe delte this check?
+    {
+        return {"too small header"};
+    }
+
+    if (header[header.size() - 1] != '\r') {
+        return {"unexpected len of server message"};
+    }
+
+    header[header.size() - 1] = 0;
+    header.resize(header.size() - 1);
+    auto v = string_view(header);
+    auto p = v.find_first_of(" ");
+
+    if (p == string_view::npos) {
+        if (header.size() != 4 && header.size() != 3) // ok or ping/pong
+        {
+            return {"protocol violation from server"};
+        }
+
+        p = header.size();
+    }
+
+    auto it = message_types_map.find(v.substr(0, p));
+
+    if (it == message_types_map.end()) {
+        return {"unknown message"};
+    }
+
+    // MSG and HMSG fire it with payload size
+    if (it->second != mt::MSG && it->second != mt::HMSG) {
+        NATS_ASIO_PROBE3(frame, it->first.data(), header.size(), 0);
+    }
+
+    switch (it->second) {
+    case mt::INFO: {
+        p += 1; // space
+        auto info_msg = v.substr(p, v.size() - p);
+        observer->on_info(info_msg, c);
+        break;
+    }
+
+    case mt::MSG: {
+        p += 1;
+        auto info = v.substr(p, v.size() - p);
+        string_view results[4];
+        auto results_n = split_fields(info, results, 4);
+
+        if (results_n < 3 || results_n > 4) {
+            return {"unexpected message format"};
+        }
+
+        bool replty_to = results_n == 4;
+        std::size_t bytes_id = replty_to ? 3 : 2;
+        std::size_t bytes_n = 0;
+
+        try {
+            bytes_n = static_cast<std::size_t>(std::stoll(results[bytes_id].data(), nullptr, 10));
+        } catch (const std::exception& e) {
+            return {fmt::format("can't parse int in headers: {}", e.what())};
+        }
+
+        NATS_ASIO_PROBE3(frame, "MSG", header.size(), bytes_n);
+
+        if (replty_to) {
+            observer->on_message(results[0], results[1], results[2], 0, bytes_n, c);
+        } else {
+            observer->on_message(results[0], results[1], optional<string_view>(), 0, bytes_n, c);
+        }
+
+        observer->consumed(bytes_n + 2);
+        return {};
+    }
+
+    case mt::HMSG: {
+        p += 1;
+        auto info = v.substr(p, v.size() - p);
+        string_view results[5];
+        auto results_n = split_fields(info, results, 5);
+
+        if (results_n < 4 || results_n > 5) {
+            return {"unexpected message format"};
+        }
+
+        bool replty_to = results_n == 5;
+        std::size_t header_id = replty_to ? 3 : 2;
+        uint64_t header_n = 0;
+        uint64_t bytes_n = 0;
+
+        if (!parse_uint(results[header_id], header_n) || !parse_uint(results[header_id + 1], bytes_n) ||
+            header_n > bytes_n) {
+            return {"can't parse sizes in headers"};
+        }
+
+        NATS_ASIO_PROBE3(frame, "HMSG", header.size(), bytes_n);
+
+        if (replty_to) {
+            observer->on_message(results[0], results[1], results[2], header_n, bytes_n, c);
+        } else {
+            observer->on_message(results[0], results[1], optional<string_view>(), header_n, bytes_n, c);
+        }
+
+        observer->consumed(bytes_n + 2);
+        return {};
+    }
+
+    case mt::PING: {
+        observer->on_ping(c);
+        break;
+    }
+
+    case mt::PONG: {
+        observer->on_pong(c);
+        break;
+    }
+
+    case mt::OK: {
+        observer->on_ok(c);
+        break;
+    }
+
+    case mt::ERR: {
+        p += 1; // space
+        auto err_msg = v.substr(p, v.size() - p);
+        observer->on_error(err_msg, c);
+        break;
+    }
+
+    default: {
+        return {"unexpected message type"};
+    }
+    }
+
+    return {};
+}
+
+optional<string_view> find_header(string_view headers, string_view key) {
+    // first line is a version with optional status
+    auto eol = headers.find("\r\n");
+
+    while (eol != string_view::npos) {
+        headers.remove_prefix(eol + 2);
+        eol = headers.find("\r\n");
+        auto line = headers.substr(0, eol);
+        auto p = line.find(':');
+
+        if (p == string_view::npos) {
+            continue;
+        }
+
+        if (!boost::algorithm::iequals(line.substr(0, p), key)) {
+            continue;
+        }
+
+        auto value = line.substr(p + 1);
+
+        while (!value.empty() && value.front() == ' ') {
+            value.remove_prefix(1);
+        }
+
+        return value;
+    }
+
+    return {};
+}
+
+// status code from the version line `NATS/1.0 503`, 0 if absent
+uint64_t headers_status(string_view headers) {
+    const string_view version("NATS/1.0");
+
+    if (headers.size() < version.size() + 4 || headers.substr(0, version.size()) != version) {
+        return 0;
+    }
+
+    uint64_t code = 0;
+
+    if (!parse_uint(headers.substr(version.size() + 1, 3), code)) {
+        return 0;
+    }
+
+    return code;
+}
+
+constexpr auto encoding_header = "Nats-Asio-Encoding";
+constexpr auto encoded_size_header = "Nats-Asio-Size";
+
+const char* compression_name(compression codec) {
+    switch (codec) {
+    case compression::lz4:
+        return "lz4";
+    case compression::zstd:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+optional<compression> compression_from_name(string_view name) {
+    if (name == "lz4") {
+        return compression::lz4;
+    }
+
+    if (name == "zstd") {
+        return compression::zstd;
+    }
+
+    return {};
+}
+
+const compression_rule* find_compression_rule(const std::vector<compression_rule>& rules, string_view subject) {
+    for (const auto& r : rules) {
+        if (subject.substr(0, r.subject_prefix.size()) == string_view(r.subject_prefix)) {
+            return &r;
+        }
+    }
+
+    return nullptr;
+}
+
+// byte buffers which keep their capacity between messages
+class buffer_pool {
+public:
+    explicit buffer_pool(pmr::memory_resource* resource = pmr::get_default_resource());
+
+    pmr_vector<char> take();
+
+    void give(pmr_vector<char>&& buf);
+
+private:
+    static constexpr std::size_t max_free = 16;
+
+    pmr::memory_resource* m_resource;
+    pmr_vector<pmr_vector<char>> m_free;
+};
+
+buffer_pool::buffer_pool(pmr::memory_resource* resource) : m_resource(resource), m_free(resource) {}
+
+pmr_vector<char> buffer_pool::take() {
+    if (m_free.empty()) {
+        return pmr_vector<char>(m_resource);
+    }
+
+    auto buf = std::move(m_free.back());
+    m_free.pop_back();
+    return buf;
+}
+
+void buffer_pool::give(pmr_vector<char>&& buf) {
+    if (m_free.size() < max_free && buf.capacity() > 0 && buf.get_allocator().resource() == m_resource) {
+        buf.clear();
+        m_free.push_back(std::move(buf));
+    }
+}
+
+constexpr auto header_version = "NATS/1.0\r\n";
+
+// `key: value\r\n` per header
+template <class Out> void append_header_lines(Out& out, const headers_t& headers) {
+    const string_view colon(": ");
+
+    for (const auto& h : headers) {
+        out.insert(out.end(), h.first.begin(), h.first.end());
+        out.insert(out.end(), colon.begin(), colon.end());
+        out.insert(out.end(), h.second.begin(), h.second.end());
+        out.insert(out.end(), sep, sep + 2);
+    }
+}
+
+std::size_t header_lines_size(const headers_t& headers) {
+    std::size_t n = 0;
+
+    for (const auto& h : headers) {
+        n += h.first.size() + h.second.size() + 4;
+    }
+
+    return n;
+}
+
+// `NATS/1.0\r\n` and a line per header, without the closing empty line
+template <class Out> void append_header_block(Out& out, const headers_t& headers) {
+    const string_view version(header_version);
+    out.insert(out.end(), version.begin(), version.end());
+    append_header_lines(out, headers);
+}
+
+// bounded queue of publishes from many threads to the connection thread, slots keep their buffers
+class publish_ring : private boost::asio::detail::noncopyable {
+public:
+    explicit publish_ring(std::size_t capacity);
+
+    // any thread, false if the ring is full
+    bool push(string_view subject, optional<string_view> reply_to, const char* raw, std::size_t n) {
+        return push(subject, reply_to, headers_t(), raw, n);
+    }
+
+    // headers are encoded by the calling thread
+    bool push(string_view subject, optional<string_view> reply_to, const headers_t& headers, const char* raw,
+              std::size_t n);
+
+    // consumer thread only, calls f(subject, reply_to, header_block, raw, n) for up to max messages and returns their
+    // number. header_block is `NATS/1.0\r\n` with header lines and without the closing empty line, or empty
+    template <class F> std::size_t drain(std::size_t max, F&& f);
+
+private:
+    struct slot {
+        std::atomic<std::size_t> seq{0};
+        std::size_t subject_n = 0;
+        std::size_t reply_to_n = 0;
+        bool has_reply_to = false;
+        std::size_t headers_n = 0;
+        std::vector<char> data;
+    };
+
+    static constexpr std::size_t cache_line = 64;
+
+    std::unique_ptr<slot[]> m_slots;
+    std::size_t m_mask;
+    // producers and consumer positions are kept on separate cache lines
+    char m_pad0[cache_line];
+    std::atomic<std::size_t> m_tail;
+    char m_pad1[cache_line];
+    std::size_t m_head;
+};
+
+publish_ring::publish_ring(std::size_t capacity) : m_mask(0), m_tail(0), m_head(0) {
+    std::size_t size = 1;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    m_slots.reset(new slot[size]);
+    m_mask = size - 1;
+
+    for (std::size_t i = 0; i < size; ++i) {
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    boost::ignore_unused(m_pad0, m_pad1);
+}
+
+bool publish_ring::push(string_view subject, optional<string_view> reply_to, const headers_t& headers,
+                        const char* raw, std::size_t n) {
+    auto pos = m_tail.load(std::memory_order_relaxed);
+    slot* s = nullptr;
+
+    // slot at pos is free when its seq is pos, and still holds a message from the previous lap when it is less
+    for (;;) {
+        s = &m_slots[pos & m_mask];
+        auto seq = s->seq.load(std::memory_order_acquire);
+
+        if (seq == pos) {
+            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq < pos) {
+            return false;
+        } else {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    s->subject_n = subject.size();
+    s->has_reply_to = reply_to.has_value();
+    s->reply_to_n = s->has_reply_to ? reply_to.value().size() : 0;
+    s->data.clear();
+    s->data.insert(s->data.end(), subject.data(), subject.data() + subject.size());
+
+    if (s->has_reply_to) {
+        s->data.insert(s->data.end(), reply_to.value().data(), reply_to.value().data() + s->reply_to_n);
+    }
+
+    auto headers_start = s->data.size();
+
+    if (!headers.empty()) {
+        append_header_block(s->data, headers);
+    }
+
+    s->headers_n = s->data.size() - headers_start;
+    s->data.insert(s->data.end(), raw, raw + n);
+    s->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <class F> std::size_t publish_ring::drain(std::size_t max, F&& f) {
+    std::size_t done = 0;
+
+    for (; done < max; ++done, ++m_head) {
+        auto& s = m_slots[m_head & m_mask];
+
+        if (s.seq.load(std::memory_order_acquire) != m_head + 1) {
+            break;
+        }
+
+        auto d = s.data.data();
+        optional<string_view> reply_to;
+
+        if (s.has_reply_to) {
+            reply_to = string_view(d + s.subject_n, s.reply_to_n);
+        }
+
+        auto headers_offset = s.subject_n + s.reply_to_n;
+        auto payload_offset = headers_offset + s.headers_n;
+        f(string_view(d, s.subject_n), reply_to, string_view(d + headers_offset, s.headers_n), d + payload_offset,
+          s.data.size() - payload_offset);
+        s.seq.store(m_head + m_mask + 1, std::memory_order_release);
+    }
+
+    return done;
+}
+
+// payload compression with contexts reused between messages
+class payload_codec : private boost::asio::detail::noncopyable {
+public:
+    // decoded size from the header is not trusted beyond this
+    static constexpr std::size_t max_decoded_size = 64 * 1024 * 1024;
+
+    payload_codec();
+
+    ~payload_codec();
+
+    static bool available(compression codec);
+
+    // false if codec is not available or payload doesn't get smaller
+    bool compress(compression codec, int level, const char* raw, std::size_t n, pmr_vector<char>& out);
+
+    status decompress(compression codec, const char* raw, std::size_t n, std::size_t decoded_n,
+                      pmr_vector<char>& out);
+
+private:
+#ifdef NATS_ASIO_LZ4
+    std::vector<char> m_lz4_state;
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+    ZSTD_CCtx* m_zstd_cctx;
+    ZSTD_DCtx* m_zstd_dctx;
+#endif
+};
+
+payload_codec::payload_codec() {
+#ifdef NATS_ASIO_LZ4
+    m_lz4_state.resize(static_cast<std::size_t>(LZ4_sizeofState()));
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+    m_zstd_cctx = ZSTD_createCCtx();
+    m_zstd_dctx = ZSTD_createDCtx();
+#endif
+}
+
+payload_codec::~payload_codec() {
+#ifdef NATS_ASIO_ZSTD
+    ZSTD_freeCCtx(m_zstd_cctx);
+    ZSTD_freeDCtx(m_zstd_dctx);
+#endif
+}
+
+bool payload_codec::available(compression codec) {
+    switch (codec) {
+#ifdef NATS_ASIO_LZ4
+    case compression::lz4:
+        return true;
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+    case compression::zstd:
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+bool payload_codec::compress(compression codec, int level, const char* raw, std::size_t n, pmr_vector<char>& out) {
+    boost::ignore_unused(level, raw, n, out); // without codecs built in
+    switch (codec) {
+#ifdef NATS_ASIO_LZ4
+    case compression::lz4: {
+        if (n > LZ4_MAX_INPUT_SIZE) {
+            return false;
+        }
+
+        out.resize(static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(n))));
+        auto r = LZ4_compress_fast_extState(m_lz4_state.data(), raw, out.data(), static_cast<int>(n),
+                                            static_cast<int>(out.size()), level > 0 ? level : 1);
+
+        if (r <= 0 || static_cast<std::size_t>(r) >= n) {
+            return false;
+        }
+
+        out.resize(static_cast<std::size_t>(r));
+        return true;
+    }
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+    case compression::zstd: {
+        out.resize(ZSTD_compressBound(n));
+        auto r = ZSTD_compressCCtx(m_zstd_cctx, out.data(), out.size(), raw, n,
+                                   level != 0 ? level : ZSTD_CLEVEL_DEFAULT);
+
+        if (ZSTD_isError(r) || r >= n) {
+            return false;
+        }
+
+        out.resize(r);
+        return true;
+    }
+#endif
+
+    default:
+        return false;
+    }
+}
+
+status payload_codec::decompress(compression codec, const char* raw, std::size_t n, std::size_t decoded_n,
+                                 pmr_vector<char>& out) {
+    boost::ignore_unused(raw, n);
+
+    if (decoded_n > max_decoded_size) {
+        return status(fmt::format("decoded payload is too big: {}", decoded_n));
+    }
+
+    out.resize(decoded_n);
+
+    switch (codec) {
+#ifdef NATS_ASIO_LZ4
+    case compression::lz4: {
+        auto r = LZ4_decompress_safe(raw, out.data(), static_cast<int>(n), static_cast<int>(decoded_n));
+
+        if (r < 0 || static_cast<std::size_t>(r) != decoded_n) {
+            return status("lz4 payload is corrupted");
+        }
+
+        return {};
+    }
+#endif
+
+#ifdef NATS_ASIO_ZSTD
+    case compression::zstd: {
+        auto r = ZSTD_decompressDCtx(m_zstd_dctx, out.data(), decoded_n, raw, n);
+
+        if (ZSTD_isError(r) || r != decoded_n) {
+            return status("zstd payload is corrupted");
+        }
+
+        return {};
+    }
+#endif
+
+    default:
+        return status(fmt::format("{} codec is not built in", compression_name(codec)));
+    }
+}
+
+// tokens are separated by dots and can't be empty, whitespace is not allowed anywhere
+status check_subject(string_view subject, bool allow_wildcards) {
+    if (subject.empty()) {
+        return status("empty subject");
+    }
+
+    // post_publish checks every message, so tokens are walked without splitting
+    for (std::size_t pos = 0; !allow_wildcards && pos <= subject.size();) {
+        auto end = std::min(subject.find('.', pos), subject.size());
+        auto token = subject.substr(pos, end - pos);
+
+        if (token == "*" || token == ">") {
+            return status(fmt::format("wildcard in subject {}", subject));
+        }
+
+        pos = end + 1;
+    }
+
+    if (subject.front() == '.' || subject.back() == '.' || subject.find("..") != string_view::npos) {
+        return status(fmt::format("empty token in subject {}", subject));
+    }
+
+    if (subject.find_first_of(" \t\r\n") != string_view::npos) {
+        return status(fmt::format("whitespace in subject {}", subject));
+    }
+
+    return {};
+}
+
+// `*` matches one token, `>` one or more at the end
+bool subject_matches(string_view pattern, string_view subject) {
+    std::size_t p = 0;
+    std::size_t s = 0;
+
+    for (;;) {
+        auto pe = std::min(pattern.find('.', p), pattern.size());
+        auto se = std::min(subject.find('.', s), subject.size());
+        auto token = pattern.substr(p, pe - p);
+
+        if (token == ">") {
+            return s < subject.size();
+        }
+
+        if (token != "*" && token != subject.substr(s, se - s)) {
+            return false;
+        }
+
+        if (pe == pattern.size() || se == subject.size()) {
+            return pe == pattern.size() && se == subject.size();
+        }
+
+        p = pe + 1;
+        s = se + 1;
+    }
+}
+
+boost::posix_time::ptime never() { return boost::posix_time::ptime(boost::posix_time::pos_infin); }
+
+std::string random_token(std::size_t n) {
+    static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    static thread_local std::mt19937_64 gen{std::random_device{}()};
+    std::uniform_int_distribution<std::size_t> dist(0, sizeof(alphabet) - 2);
+    std::string token;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        token.push_back(alphabet[dist(gen)]);
+    }
+
+    return token;
+}
+
+std::string new_inbox() { return "_INBOX." + random_token(22); }
+
+// seen keys of a subscription: ring of the latest hashes checked exactly and two generations of blocked bloom
+// filter, the older one is cleared and becomes current after window or capacity inserts
+class dedup_filter {
+public:
+    enum class result { unique, exact, filter };
+
+    explicit dedup_filter(const dedup_config& conf);
+
+    result check(string_view subject, string_view headers, const char* raw, std::size_t n);
+
+private:
+    // a key sets k bits within one block of 512 bits, so a lookup touches one cache line
+    static constexpr std::size_t block_words = 8;
+
+    static uint64_t hash(string_view key);
+
+    bool in_filter(const std::vector<uint64_t>& bits, uint64_t h) const;
+
+    void add(uint64_t h);
+
+    dedup_config m_conf;
+    std::size_t m_blocks;
+    unsigned m_k;
+    std::vector<uint64_t> m_current;
+    std::vector<uint64_t> m_previous;
+    std::size_t m_inserted;
+    std::chrono::steady_clock::time_point m_generation_start;
+    std::vector<uint64_t> m_ring;
+    std::size_t m_ring_pos;
+};
+
+dedup_filter::dedup_filter(const dedup_config& conf)
+    : m_conf(conf), m_inserted(0), m_generation_start(std::chrono::steady_clock::now()),
+      m_ring(std::max<std::size_t>(conf.exact_size, 1), 0), m_ring_pos(0) {
+    auto p = std::min(std::max(conf.false_positive_rate, 1e-9), 0.5);
+    auto bits_per_key = -std::log(p) / (std::log(2.0) * std::log(2.0));
+    // blocking costs some accuracy, it is made up with more bits
+    auto bits = static_cast<double>(std::max<std::size_t>(conf.capacity, 1)) * bits_per_key * 1.2;
+    m_blocks = static_cast<std::size_t>(std::ceil(bits / (block_words * 64)));
+    m_k = static_cast<unsigned>(std::min(std::max(std::lround(bits_per_key * std::log(2.0)), 1l), 16l));
+    m_current.assign(m_blocks * block_words, 0);
+    m_previous.assign(m_blocks * block_words, 0);
+}
+
+uint64_t dedup_filter::hash(string_view key) {
+    // fnv-1a with a final mix, so both halves are usable
+    uint64_t h = 14695981039346656037ull;
+
+    for (auto ch : key) {
+        h = (h ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h; // 0 is an empty ring slot
+}
+
+bool dedup_filter::in_filter(const std::vector<uint64_t>& bits, uint64_t h) const {
+    auto block = bits.data() + (h % m_blocks) * block_words;
+    auto a = static_cast<uint32_t>(h >> 32);
+    auto b = static_cast<uint32_t>(h >> 16) | 1;
+
+    for (unsigned i = 0; i < m_k; ++i) {
+        auto bit = (a + i * b) & 511;
+
+        if ((block[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void dedup_filter::add(uint64_t h) {
+    auto now = std::chrono::steady_clock::now();
+
+    if (m_inserted >= m_conf.capacity ||
+        now - m_generation_start >= std::chrono::microseconds(m_conf.window.total_microseconds())) {
+        std::swap(m_current, m_previous);
+        std::fill(m_current.begin(), m_current.end(), 0);
+        m_inserted = 0;
+        m_generation_start = now;
+    }
+
+    auto block = m_current.data() + (h % m_blocks) * block_words;
+    auto a = static_cast<uint32_t>(h >> 32);
+    auto b = static_cast<uint32_t>(h >> 16) | 1;
+
+    for (unsigned i = 0; i < m_k; ++i) {
+        auto bit = (a + i * b) & 511;
+        block[bit >> 6] |= uint64_t(1) << (bit & 63);
+    }
+
+    m_inserted++;
+    m_ring[m_ring_pos] = h;
+    m_ring_pos = (m_ring_pos + 1) % m_ring.size();
+}
+
+dedup_filter::result dedup_filter::check(string_view subject, string_view headers, const char* raw, std::size_t n) {
+    string_view key;
+
+    if (m_conf.key != nullptr) {
+        key = m_conf.key(subject, headers, raw, n);
+    } else {
+        auto id = find_header(headers, m_conf.header);
+
+        if (id.has_value()) {
+            key = id.value();
+        }
+    }
+
+    if (key.empty()) {
+        return result::unique;
+    }
+
+    auto h = hash(key);
+
+    if (std::find(m_ring.begin(), m_ring.end(), h) != m_ring.end()) {
+        return result::exact;
+    }
+
+    if (in_filter(m_current, h) || in_filter(m_previous, h)) {
+        return result::filter;
+    }
+
+    add(h);
+    return result::unique;
+}
+
+// what connections on an io_context report about a spin runner driving it
+class spin_state : public boost::asio::execution_context::service {
+public:
+    static boost::asio::execution_context::id id;
+
+    explicit spin_state(boost::asio::execution_context& ctx)
+        : boost::asio::execution_context::service(ctx), active(false), cpu(-1), polls(0) {}
+
+    std::atomic<bool> active;
+    std::atomic<int> cpu;
+    std::atomic<uint64_t> polls;
+
+private:
+    virtual void shutdown() override {}
+};
+
+boost::asio::execution_context::id spin_state::id;
+
+class spin_runner : public ispin_runner, private boost::asio::detail::noncopyable {
+public:
+    spin_runner(aio& io, int cpu)
+        : m_io(io), m_state(boost::asio::use_service<spin_state>(io)), m_stop(false),
+          m_thread([this, cpu]() { run(cpu); }) {}
+
+    virtual ~spin_runner() override {
+        stop();
+        join();
+    }
+
+    virtual void stop() override { m_stop = true; }
+
+    virtual void join() override {
+        if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id()) {
+            m_thread.join();
+        }
+    }
+
+private:
+    void run(int cpu) {
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+                m_state.cpu = cpu;
+            }
+        }
+
+        m_state.active = true;
+
+        // poll checks epoll with zero timeout, so an idle io costs a cpu instead of a sleep and a wakeup
+        while (!m_stop.load(std::memory_order_relaxed) && !m_io.stopped()) {
+            m_io.poll();
+            m_state.polls.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        m_state.active = false;
+        m_state.cpu = -1;
+    }
+
+    aio& m_io;
+    spin_state& m_state;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+};
+
+ispin_runner_sptr create_spin_runner(aio& io, int cpu) { return std::make_shared<spin_runner>(io, cpu); }
+
+// connection side of subscription::cancel
+struct subscription_owner {
+    virtual ~subscription_owner() = default;
+
+    virtual void cancel_subscription(uint64_t sid) = 0;
+};
+
+struct subscription : public isubscription, private boost::asio::detail::noncopyable {
+    subscription(uint64_t sid, const on_message_cb& cb, pmr::memory_resource* resource);
+
+    subscription(uint64_t sid, const on_headers_message_cb& cb, pmr::memory_resource* resource);
+
+    subscription(uint64_t sid, const on_batch_message_cb& cb, pmr::memory_resource* resource);
+
+    virtual void cancel() override;
+
+    virtual uint64_t sid() override;
+
+    virtual void dedup(const dedup_config& conf) override;
+
+    // message waiting for batch callback, subject and reply_to are kept in connection batch text
+    struct batched_message {
+        std::size_t text_offset;
+        std::size_t subject_n;
+        std::size_t reply_to_n;
+        bool has_reply_to;
+        string_view headers;
+        const char* raw;
+        std::size_t n;
+    };
+
+    // set by cancel from any thread, the sid is erased on the connection thread
+    std::atomic<bool> m_cancel;
+    // for local delivery, queue subscriptions don't get own messages
+    pmr_string m_subject;
+    bool m_queue;
+    // 0 is unlimited, the sid is dropped locally after max messages as the server does
+    uint64_t m_max;
+    uint64_t m_received;
+    std::weak_ptr<subscription_owner> m_owner;
+    std::unique_ptr<dedup_filter> m_dedup;
+    on_message_cb m_cb;
+    on_headers_message_cb m_hcb;
+    on_batch_message_cb m_bcb;
+    pmr_vector<batched_message> m_batch;
+    uint64_t m_sid;
+};
+typedef std::shared_ptr<subscription> subscription_sptr;
+
+subscription::subscription(uint64_t sid, const on_message_cb& cb, pmr::memory_resource* resource)
+    : m_cancel(false), m_subject(resource), m_queue(false), m_max(0), m_received(0), m_cb(cb), m_batch(resource),
+      m_sid(sid) {}
+
+subscription::subscription(uint64_t sid, const on_headers_message_cb& cb, pmr::memory_resource* resource)
+    : m_cancel(false), m_subject(resource), m_queue(false), m_max(0), m_received(0), m_hcb(cb), m_batch(resource),
+      m_sid(sid) {}
+
+subscription::subscription(uint64_t sid, const on_batch_message_cb& cb, pmr::memory_resource* resource)
+    : m_cancel(false), m_subject(resource), m_queue(false), m_max(0), m_received(0), m_bcb(cb), m_batch(resource),
+      m_sid(sid) {}
+
+void subscription::cancel() {
+    if (m_cancel.exchange(true)) {
+        return;
+    }
+
+    auto owner = m_owner.lock();
+
+    if (owner != nullptr) {
+        owner->cancel_subscription(m_sid);
+    }
+}
+
+uint64_t subscription::sid() { return m_sid; }
+
+void subscription::dedup(const dedup_config& conf) { m_dedup = std::make_unique<dedup_filter>(conf); }
+
+template <class SocketType>
+class connection : public iconnection,
+                   public parser_observer,
+                   public subscription_owner,
+                   public std::enable_shared_from_this<connection<SocketType>>,
+                   private boost::asio::detail::noncopyable {
+public:
+    connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+               const on_disconnected_cb& disconnected_cb, const std::shared_ptr<tls_context>& tls,
+               pmr::memory_resource* resource = pmr::get_default_resource());
+
+    connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+               const on_disconnected_cb& disconnected_cb,
+               pmr::memory_resource* resource = pmr::get_default_resource());
+
+    connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+               const on_disconnected_cb& disconnected_cb, const std::shared_ptr<capture_reader>& replay,
+               bool original_timing);
+
+    virtual void start(const connect_config& conf) override;
+
+    virtual void stop() override;
+
+    virtual void drain(duration timeout, on_drained_cb cb) override;
+
+    virtual bool is_connected() override { return m_is_connected; }
+
+    virtual connection_stats stats() override;
+
+    virtual std::size_t max_payload() override { return m_max_payload; }
+
+    virtual status publish(string_view subject, const char* raw, std::size_t n, optional<string_view> reply_to,
+                           ctx c) override;
+
+    virtual status publish(string_view subject, const boost::asio::const_buffer* parts, std::size_t count,
+                           optional<string_view> reply_to, ctx c) override;
+
+    virtual status publish(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                           optional<string_view> reply_to, ctx c) override;
+
+    virtual status publish_encoded(string_view subject, optional<string_view> reply_to, const payload_writer& write,
+                                   ctx c) override;
+
+    virtual status post_publish(string_view subject, const char* raw, std::size_t n,
+                                optional<string_view> reply_to) override;
+
+    virtual status post_publish(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                                optional<string_view> reply_to) override;
+
+    virtual status unsubscribe(const isubscription_sptr& p, ctx c) override;
+
+    virtual std::pair<ipublisher_sptr, status> make_publisher(string_view subject,
+                                                              optional<string_view> reply_to) override;
+
+    virtual std::pair<isubscription_sptr, status> subscribe(string_view subject, optional<string_view> queue,
+                                                            on_message_cb cb, ctx c,
+                                                            uint64_t max_messages = 0) override;
+
+    virtual std::pair<isubscription_sptr, status> subscribe_headers(string_view subject, optional<string_view> queue,
+                                                                    on_headers_message_cb cb, ctx c,
+                                                                    uint64_t max_messages = 0) override;
+
+    virtual std::pair<isubscription_sptr, status> subscribe_batch(string_view subject, optional<string_view> queue,
+                                                                  on_batch_message_cb cb, ctx c,
+                                                                  uint64_t max_messages = 0) override;
+
+    virtual void cancel_subscription(uint64_t sid) override;
+
+    virtual std::pair<std::string, status> request(string_view subject, const char* raw, std::size_t n,
+                                                   const headers_t& headers, duration timeout, ctx c) override;
+
+    // prefix is `PUB subject [reply_to] `
+    status publish_prefixed(string_view prefix, const boost::asio::const_buffer* parts, std::size_t count,
+                            std::size_t n, ctx c);
+
+    bool local_delivery() const { return m_local_delivery; }
+
+private:
+    struct pending_request {
+        pending_request(aio& io) : m_timer(io), m_done(false) {}
+
+        boost::asio::deadline_timer m_timer;
+        bool m_done;
+        std::string m_payload;
+        status m_result;
+    };
+
+    virtual void on_ping(ctx c) override;
+
+    virtual void on_pong(ctx c) override;
+
+    virtual void on_ok(ctx) override { m_log->trace("ok recived"); }
+
+    virtual void on_error(string_view err, ctx) override { m_log->error("error message from server {}", err); }
+
+    virtual void on_info(string_view info, ctx c) override;
+
+    virtual void on_message(string_view subject, string_view sid, optional<string_view> reply_to, std::size_t header_n,
+                            std::size_t n, ctx c) override;
+
+    virtual void consumed(std::size_t n) override { m_buf.consume(n); }
+
+    void on_inbox_message(string_view subject, string_view headers, const char* raw, std::size_t n);
+
+    std::pair<isubscription_sptr, status> do_subscribe(string_view subject, optional<string_view> queue,
+                                                       const subscription_sptr& sub, uint64_t max_messages, ctx c);
+
+    // payloads of batched messages point to m_buf, so batches must be delivered before it is read into again
+    void flush_batches(ctx c);
+
+    bool has_buffered_line() const;
+
+    // reads at least n bytes to m_buf, batches must be flushed before
+    void read_more(std::size_t n, ctx c);
+
+    // false if payload is sent as is, out is taken from the buffer pool
+    bool compress_payload(string_view subject, const char* raw, std::size_t n, compression& codec,
+                          pmr_vector<char>& out);
+
+    // replaces raw and n with a decoded payload if headers have encoding marker
+    status decode_payload(string_view headers, const char*& raw, std::size_t& n, pmr_vector<char>& out);
+
+    status do_connect(const connect_config& conf, ctx c);
+
+    status do_drain(duration timeout, ctx c);
+
+    // server closes the connection on a message over max_payload
+    status check_size(std::size_t n) const;
+
+    // payload and, for HPUB, header block against max_payload. Compressed messages are left to the server
+    status check_message_size(string_view subject, std::size_t n, const headers_t& headers, bool hpub) const;
+
+    // resolves address unless cached addresses are fresh and races connects to them
+    status connect_socket(const connect_config& conf, boost::posix_time::ptime deadline, ctx c);
+
+    // reads INFO, makes tls handshake and sends CONNECT
+    status handshake(const connect_config& conf, ctx c);
+
+    // writes queued data until the connection of `generation` is lost
+    void write_loop(uint64_t generation, ctx c);
+
+    // waits while the queue is over max_pending_bytes
+    status wait_for_space(ctx c);
+
+    void append(const char* data, std::size_t n) { m_out.insert(m_out.end(), data, data + n); }
+
+    void append(string_view data) { append(data.data(), data.size()); }
+
+    void append(const boost::asio::const_buffer* parts, std::size_t count);
+
+    void append_pub(string_view subject, optional<string_view> reply_to, const boost::asio::const_buffer* parts,
+                    std::size_t count, std::size_t n);
+
+    // compresses payload if a rule says so
+    void append_hpub(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                     optional<string_view> reply_to);
+
+    // header block is block followed by lines of headers, the closing empty line is added here. Block starts with
+    // `NATS/1.0\r\n`, lines are formatted straight into the outbound queue
+    void append_hpub_block(string_view subject, string_view block, const headers_t& headers, const char* raw,
+                           std::size_t n, optional<string_view> reply_to);
+
+    void append_control(string_view data) { m_control.insert(m_control.end(), data.data(), data.data() + data.size()); }
+
+    // called with complete frames queued, so the end of m_out is a place where control frames can go
+    // hands an own publish to matching subscriptions, the server doesn't echo it with local_delivery
+    void deliver_local(string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                       std::size_t n, ctx c);
+
+    bool has_local_match(string_view subject) const;
+
+    // posted messages are copied for delivery from a coroutine
+    void queue_local(string_view subject, optional<string_view> reply_to, string_view header_block, const char* raw,
+                     std::size_t n);
+
+    void deliver_queued_local(ctx c);
+
+    void wake_writer() {
+        if (m_out.size() - (m_out_marks.empty() ? 0 : m_out_marks.back()) >= write_slice) {
+            m_out_marks.push_back(m_out.size());
+        }
+
+        m_write_signal.cancel();
+    }
+
+    // moves post_publish queue to m_out while connected and under max_pending_bytes
+    void drain_posted();
+
+    void schedule_drain();
+
+    void run(const connect_config& conf, ctx c);
+
+    status handle_error(ctx c);
+
+    std::string prepare_info(const connect_config& o);
+
+    uint64_t next_sid() { return m_sid++; }
+
+    template <class Cb> subscription_sptr make_subscription(const Cb& cb) {
+        auto sub = std::allocate_shared<subscription>(pmr::polymorphic_allocator<char>(m_resource), next_sid(), cb,
+                                                      m_resource);
+        sub->m_owner = this->shared_from_this();
+        return sub;
+    }
+
+    // ssl stream can't be reused after close, so socket is created for each connect
+    void reset_socket();
+
+    // objects handed out to the user come from m_resource, the rest from m_pool
+    pmr::memory_resource* m_resource;
+    pmr::unsynchronized_pool_resource m_pool;
+
+    uint64_t m_sid;
+    uint64_t m_request_id;
+    // read by post_publish from other threads
+    std::atomic<std::size_t> m_max_payload;
+    logger m_log;
+    aio& m_io;
+
+    bool m_is_connected;
+    bool m_stop_flag;
+    bool m_draining;
+    uint64_t m_generation;
+    uint64_t m_pongs;
+    // expires at drain deadline, PONG wakes the drain early
+    boost::asio::deadline_timer m_drain_timer;
+
+    // bulk writes are split at frame ends about this far apart, so control frames don't wait for a whole queue
+    static constexpr std::size_t write_slice = 64 * 1024;
+
+    // outbound queue, the writer swaps it with m_out_writing and writes that one
+    pmr_vector<char> m_out;
+    pmr_vector<char> m_out_writing;
+    // frame ends in m_out and m_out_writing where a slice may end
+    pmr_vector<std::size_t> m_out_marks;
+    pmr_vector<std::size_t> m_writing_marks;
+    std::size_t m_writing_pos;
+    std::size_t m_writing_mark;
+    // publishes queued since the writer took m_out
+    std::size_t m_out_publishes;
+    // size digits publish_encoded reserves, those of its last payload
+    std::size_t m_encoded_digits;
+    // SUB, UNSUB and PONG, written ahead of the rest of m_out_writing
+    pmr_vector<char> m_control;
+    pmr_vector<char> m_control_writing;
+    std::size_t m_max_pending;
+    std::unique_ptr<publish_ring> m_posted;
+    std::atomic<bool> m_drain_scheduled;
+    // posted messages wait for connect or for the writer to free space
+    bool m_drain_blocked;
+    // timers are never expired, cancel wakes who waits for them
+    boost::asio::deadline_timer m_write_signal;
+    boost::asio::deadline_timer m_space_signal;
+
+    pmr_unordered_map<uint64_t, subscription_sptr> m_subs;
+    pmr_vector<subscription_sptr> m_batched;
+    pmr_vector<message_view> m_batch_views;
+    pmr_string m_batch_text;
+    pmr_vector<pmr_vector<char>> m_batch_buffers;
+
+    // posted message waiting for local delivery, strings are in m_local_text
+    struct local_message {
+        std::size_t offset;
+        std::size_t subject_n;
+        std::size_t reply_to_n;
+        bool has_reply_to;
+        std::size_t headers_n;
+        std::size_t n;
+    };
+
+    bool m_local_delivery;
+    bool m_local_scheduled;
+    pmr_vector<char> m_local_text;
+    pmr_vector<local_message> m_local_queue;
+
+    std::vector<compression_rule> m_compression;
+    payload_codec m_codec;
+    buffer_pool m_buffers;
+    pmr_unordered_map<uint64_t, pending_request*> m_requests;
+    std::string m_inbox_prefix;
+    isubscription_sptr m_inbox_sub;
+    on_connected_cb m_connected_cb;
+    on_disconnected_cb m_disconnected_cb;
+    boost::system::error_code ec;
+
+    static constexpr std::size_t min_read_size = 4 * 1024;
+    static constexpr std::size_t max_read_size = 1024 * 1024;
+
+    boost::asio::streambuf m_buf;
+    std::size_t m_read_size;
+    connection_stats m_stats;
+
+    std::shared_ptr<tls_context> m_tls;
+    std::shared_ptr<capture_reader> m_replay;
+    bool m_replay_timing;
+    std::unique_ptr<wire_recorder> m_recorder;
+
+    std::vector<tcp::endpoint> m_endpoints;
+    boost::posix_time::ptime m_resolved_at;
+    // closes the socket if handshake of connect m_connect_id takes longer than connect_timeout
+    boost::asio::deadline_timer m_connect_timer;
+    uint64_t m_connect_id;
+
+    std::unique_ptr<uni_socket<SocketType>> m_socket;
+};
+
+template <class SocketType> class publisher : public ipublisher {
+public:
+    publisher(const std::shared_ptr<connection<SocketType>>& conn, string_view subject, optional<string_view> reply_to,
+              std::size_t compress_from);
+
+    virtual status publish(const char* raw, std::size_t n, ctx c) override;
+
+    virtual status publish(const boost::asio::const_buffer* parts, std::size_t count, ctx c) override;
+
+private:
+    std::shared_ptr<connection<SocketType>> m_conn;
+    std::string m_subject;
+    optional<std::string> m_reply_to;
+    std::string m_prefix;
+    // payloads of this size go through regular publish to get compressed, all do with local delivery
+    std::size_t m_compress_from;
+};
+
+template <class SocketType>
+publisher<SocketType>::publisher(const std::shared_ptr<connection<SocketType>>& conn, string_view subject,
+                                 optional<string_view> reply_to, std::size_t compress_from)
+    : m_conn(conn), m_subject(subject.data(), subject.size()), m_compress_from(compress_from) {
+    m_prefix = "PUB " + m_subject + " ";
+
+    if (reply_to.has_value()) {
+        m_reply_to = std::string(reply_to.value().data(), reply_to.value().size());
+        m_prefix += m_reply_to.value() + " ";
+    }
+}
+
+template <class SocketType> status publisher<SocketType>::publish(const char* raw, std::size_t n, ctx c) {
+    boost::asio::const_buffer part(raw, n);
+    return publish(&part, 1, c);
+}
+
+template <class SocketType>
+status publisher<SocketType>::publish(const boost::asio::const_buffer* parts, std::size_t count, ctx c) {
+    std::size_t n = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        n += parts[i].size();
+    }
+
+    if (n >= m_compress_from || m_conn->local_delivery()) {
+        optional<string_view> reply_to;
+
+        if (m_reply_to.has_value()) {
+            reply_to = string_view(m_reply_to.value());
+        }
+
+        return m_conn->publish(m_subject, parts, count, reply_to, c);
+    }
+
+    if (!m_conn->is_connected()) {
+        return status("not connected");
+    }
+
+    return m_conn->publish_prefixed(m_prefix, parts, count, n, c);
+}
+
+void load_certificates(const ssl_config& conf, ssl::context& ctx) {
+    // TLS 1.2 and 1.3 only
+    ctx.set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3 |
+                    ssl::context::no_tlsv1 | ssl::context::no_tlsv1_1);
+
+    if (conf.ssl_verify) {
+        ctx.set_verify_mode(ssl::verify_peer);
+    } else {
+        ctx.set_verify_mode(ssl::verify_none);
+    }
+
+    if (!conf.ssl_cert.empty()) {
+        ctx.use_certificate(boost::asio::buffer(conf.ssl_cert.data(), conf.ssl_cert.size()),
+                            ssl::context::file_format::pem);
+    }
+
+    if (!conf.ssl_ca.empty()) {
+        ctx.add_certificate_authority(boost::asio::buffer(conf.ssl_ca.data(), conf.ssl_ca.size()));
+    }
+
+    if (!conf.ssl_dh.empty()) {
+        ctx.use_tmp_dh_file(conf.ssl_dh);
+    }
+
+    if (!conf.ssl_key.empty()) {
         ctx.use_private_key(boost::asio::buffer(conf.ssl_key.data(), conf.ssl_key.size()),
                             ssl::context::file_format::pem);
     }
-}
+}
+
+int on_new_tls_session(SSL* ssl, SSL_SESSION* session) {
+    auto tls = get_tls_context(ssl);
+
+    if (tls == nullptr) {
+        return 0;
+    }
+
+    if (tls->m_session != nullptr) {
+        SSL_SESSION_free(tls->m_session);
+    }
+
+    // session of connection closed without shutdown is marked as not resumable on free, so keep a copy
+    tls->m_session = SSL_SESSION_dup(session);
+    return 0;
+}
+
+tls_context::tls_context(const ssl_config& conf) : m_ctx(ssl::context::tls_client), m_session(nullptr) {
+    load_certificates(conf, m_ctx);
+    auto native = m_ctx.native_handle();
+
+    if (conf.ssl_session_resumption) {
+        SSL_CTX_set_ex_data(native, tls_context_index(), this);
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(native, on_new_tls_session);
+    }
+
+    if (conf.ssl_max_record_size > 0) {
+        SSL_CTX_set_max_send_fragment(native, static_cast<long>(conf.ssl_max_record_size));
+    }
+}
+
+tls_context::~tls_context() {
+    if (m_session != nullptr) {
+        SSL_SESSION_free(m_session);
+    }
+}
+
+iconnection_sptr create_connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+                                   const on_disconnected_cb& disconnected_cb, optional<ssl_config> ssl_conf,
+                                   pmr::memory_resource* resource) {
+    if (resource == nullptr) {
+        resource = pmr::get_default_resource();
+    }
+
+    if (ssl_conf.has_value()) {
+        auto tls = std::make_shared<tls_context>(ssl_conf.value());
+        return std::allocate_shared<connection<ssl_socket>>(pmr::polymorphic_allocator<char>(resource), io, log,
+                                                            connected_cb, disconnected_cb, tls, resource);
+    }
+
+#ifdef NATS_ASIO_IO_URING
+    if (boost::asio::use_service<uring_service>(io).ready()) {
+        return std::allocate_shared<connection<uring_socket>>(pmr::polymorphic_allocator<char>(resource), io, log,
+                                                              connected_cb, disconnected_cb, resource);
+    }
+
+    log->warn("io_uring is not available, falling back to epoll transport");
+#endif
+
+    return std::allocate_shared<connection<raw_socket>>(pmr::polymorphic_allocator<char>(resource), io, log,
+                                                        connected_cb, disconnected_cb, resource);
+}
+
+std::pair<iconnection_sptr, status> create_replay_connection(aio& io, const logger& log, const replay_config& conf,
+                                                             const on_connected_cb& connected_cb,
+                                                             const on_disconnected_cb& disconnected_cb) {
+    auto capture = std::make_shared<capture_reader>();
+    auto s = capture->open(conf.capture_path);
+
+    if (s.failed()) {
+        return {iconnection_sptr(), s};
+    }
+
+    // there is nothing to reconnect to
+    auto stop_at_end = [disconnected_cb](iconnection& conn, ctx c) {
+        if (disconnected_cb != nullptr) {
+            disconnected_cb(conn, c);
+        }
+
+        conn.stop();
+    };
+
+    return {std::make_shared<connection<replay_socket>>(io, log, connected_cb, stop_at_end, capture,
+                                                        conf.original_timing),
+            {}};
+}
+
+template <class SocketType>
+connection<SocketType>::connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+                                   const on_disconnected_cb& disconnected_cb, const std::shared_ptr<tls_context>& tls,
+                                   pmr::memory_resource* resource)
+    : m_resource(resource), m_pool(resource), m_sid(0), m_request_id(0), m_max_payload(0), m_log(log), m_io(io),
+      m_is_connected(false), m_stop_flag(false), m_draining(false), m_generation(0), m_pongs(0), m_drain_timer(io),
+      m_out(&m_pool), m_out_writing(&m_pool), m_out_marks(&m_pool), m_writing_marks(&m_pool), m_writing_pos(0),
+      m_writing_mark(0), m_out_publishes(0), m_encoded_digits(1), m_control(&m_pool), m_control_writing(&m_pool),
+      m_max_pending(0), m_drain_scheduled(false), m_drain_blocked(false), m_write_signal(io, never()),
+      m_space_signal(io, never()), m_subs(&m_pool),
+      m_batched(&m_pool), m_batch_views(&m_pool), m_batch_text(&m_pool), m_batch_buffers(&m_pool),
+      m_local_delivery(false), m_local_scheduled(false), m_local_text(&m_pool), m_local_queue(&m_pool),
+      m_buffers(&m_pool), m_requests(&m_pool), m_inbox_prefix(new_inbox() + "."), m_connected_cb(connected_cb),
+      m_disconnected_cb(disconnected_cb), m_read_size(min_read_size), m_tls(tls), m_replay_timing(false),
+      m_connect_timer(io), m_connect_id(0) {}
+
+template <class SocketType>
+connection<SocketType>::connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+                                   const on_disconnected_cb& disconnected_cb, pmr::memory_resource* resource)
+    : connection(io, log, connected_cb, disconnected_cb, nullptr, resource) {}
+
+template <class SocketType>
+connection<SocketType>::connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
+                                   const on_disconnected_cb& disconnected_cb,
+                                   const std::shared_ptr<capture_reader>& replay, bool original_timing)
+    : connection(io, log, connected_cb, disconnected_cb, pmr::get_default_resource()) {
+    m_replay = replay;
+    m_replay_timing = original_timing;
+}
+
+template <> void connection<raw_socket>::reset_socket() {
+    m_socket = std::make_unique<uni_socket<raw_socket>>(m_io);
+}
+
+template <> void connection<ssl_socket>::reset_socket() {
+    m_socket = std::make_unique<uni_socket<ssl_socket>>(m_io, m_tls->m_ctx);
+}
+
+template <> void connection<replay_socket>::reset_socket() {
+    m_socket = std::make_unique<uni_socket<replay_socket>>(m_io, m_replay, m_replay_timing);
+}
+
+#ifdef NATS_ASIO_IO_URING
+template <> void connection<uring_socket>::reset_socket() {
+    m_socket = std::make_unique<uni_socket<uring_socket>>(m_io);
+}
+#endif
+
+template <class SocketType> void connection<SocketType>::start(const connect_config& conf) {
+    m_compression.clear();
+
+    for (const auto& r : conf.compression) {
+        if (r.codec != compression::none && !payload_codec::available(r.codec)) {
+            m_log->error("{} compression is not built in, {} payloads are sent as is", compression_name(r.codec),
+                         r.subject_prefix);
+            continue;
+        }
+
+        m_compression.push_back(r);
+    }
+
+    m_max_pending = conf.max_pending_bytes;
+    m_posted = std::make_unique<publish_ring>(conf.post_queue_size);
+    m_local_delivery = conf.local_delivery;
+
+    if (!conf.capture_path.empty()) {
+        m_recorder = std::make_unique<wire_recorder>();
+        auto s = m_recorder->open(conf.capture_path);
+
+        if (s.failed()) {
+            m_log->error("recording is off: {}", s.error());
+            m_recorder.reset();
+        }
+    }
+
+    m_endpoints.clear();
+    boost::asio::spawn(m_io, std::bind(&connection::run, this, conf, std::placeholders::_1));
+}
+
+template <class SocketType> void connection<SocketType>::stop() {
+    m_stop_flag = true;
+    wake_writer(); // it exits once the queue is written
+    m_space_signal.cancel();
+}
+
+template <class SocketType> void connection<SocketType>::drain(duration timeout, on_drained_cb cb) {
+    boost::asio::spawn(m_io, [this, timeout, cb](ctx c) {
+        // the first drain still owns the connection
+        if (m_draining) {
+            if (cb != nullptr) {
+                cb(status("already draining"), c);
+            }
+
+            return;
+        }
+
+        auto s = do_drain(timeout, c);
+        stop();
+
+        // the reader is waiting for data which won't come
+        if (m_is_connected) {
+            boost::system::error_code ignored;
+            m_socket->close(ignored);
+        }
+
+        if (cb != nullptr) {
+            cb(s, c);
+        }
+    });
+}
+
+template <class SocketType> status connection<SocketType>::do_drain(duration timeout, ctx c) {
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    m_draining = true;
+    auto deadline = boost::asio::deadline_timer::traits_type::now() + timeout;
+
+    // bulk lane, so own publishes queued before drain still reach our subscriptions
+    for (const auto& sub : m_subs) {
+        fmt::format_to(std::back_inserter(m_out), "UNSUB {}\r\n", sub.first);
+    }
+
+    drain_posted();
+    // server answers after everything written before it, so PONG means nothing more comes for our sids
+    append("PING\r\n");
+    wake_writer();
+    auto pongs = m_pongs;
+
+    while (m_is_connected && m_pongs == pongs) {
+        if (boost::asio::deadline_timer::traits_type::now() >= deadline) {
+            return status("drain timed out");
+        }
+
+        boost::system::error_code wait_ec;
+        m_drain_timer.expires_at(deadline);
+        m_drain_timer.async_wait(c[wait_ec]);
+    }
+
+    if (m_pongs == pongs) {
+        return status("connection lost while draining");
+    }
+
+    m_subs.clear();
+    return {};
+}
+
+template <class SocketType>
+std::pair<ipublisher_sptr, status> connection<SocketType>::make_publisher(string_view subject,
+                                                                          optional<string_view> reply_to) {
+    auto s = check_subject(subject, false);
+
+    if (!s.failed() && reply_to.has_value()) {
+        s = check_subject(reply_to.value(), false);
+    }
+
+    if (s.failed()) {
+        return {ipublisher_sptr(), s};
+    }
+
+    auto compress_from = std::numeric_limits<std::size_t>::max();
+    auto rule = find_compression_rule(m_compression, subject);
+
+    if (rule != nullptr && rule->codec != compression::none) {
+        compress_from = rule->min_size;
+    }
+
+    return {std::allocate_shared<publisher<SocketType>>(pmr::polymorphic_allocator<char>(m_resource),
+                                                        this->shared_from_this(), subject, reply_to, compress_from),
+            {}};
+}
+
+template <class SocketType>
+status connection<SocketType>::publish_prefixed(string_view prefix, const boost::asio::const_buffer* parts,
+                                                std::size_t count, std::size_t n, ctx c) {
+    auto s = check_size(n);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    s = wait_for_space(c);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    fmt::format_int size(n);
+    append(prefix);
+    append(size.data(), size.size());
+    append(sep, 2);
+    append(parts, count);
+    append(sep, 2);
+    m_out_publishes++;
+
+    // prefix is `PUB subject ...`
+    if (NATS_ASIO_PROBE_ENABLED(publish)) {
+        auto subject = prefix.substr(4, prefix.find(' ', 4) - 4);
+        NATS_ASIO_PROBE3(publish, subject.data(), subject.size(), n);
+    }
+
+    wake_writer();
+    return {};
+}
+
+template <class SocketType>
+void connection<SocketType>::append(const boost::asio::const_buffer* parts, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        append(static_cast<const char*>(parts[i].data()), parts[i].size());
+    }
+}
+
+template <class SocketType> status connection<SocketType>::check_size(std::size_t n) const {
+    if (m_max_payload > 0 && n > m_max_payload) {
+        return status(fmt::format("message of {} bytes is over max_payload {}", n, m_max_payload));
+    }
+
+    return {};
+}
+
+template <class SocketType>
+status connection<SocketType>::check_message_size(string_view subject, std::size_t n, const headers_t& headers,
+                                                  bool hpub) const {
+    auto rule = find_compression_rule(m_compression, subject);
+
+    // compressed size is known only after compression, the server checks it then
+    if (rule != nullptr && rule->codec != compression::none && n >= rule->min_size) {
+        return {};
+    }
+
+    if (!hpub) {
+        return check_size(n);
+    }
+
+    // `NATS/1.0\r\n` + `key: value\r\n` per header + `\r\n`
+    return check_size(12 + header_lines_size(headers) + n);
+}
+
+template <class SocketType> status connection<SocketType>::wait_for_space(ctx c) {
+    while (m_is_connected && !m_stop_flag && m_out.size() >= m_max_pending) {
+        boost::system::error_code wait_ec;
+        m_space_signal.async_wait(c[wait_ec]);
+    }
+
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    return {};
+}
+
+template <class SocketType> void connection<SocketType>::write_loop(uint64_t generation, ctx c) {
+    for (;;) {
+        if (generation != m_generation || !m_is_connected) {
+            return;
+        }
+
+        const char* data = nullptr;
+        std::size_t n = 0;
+        int lane = 0;
+
+        if (!m_control.empty()) {
+            m_control_writing.clear();
+            std::swap(m_control, m_control_writing);
+            m_stats.control_queue_max = std::max<uint64_t>(m_stats.control_queue_max, m_control_writing.size());
+            m_stats.control_writes++;
+            data = m_control_writing.data();
+            n = m_control_writing.size();
+            lane = 1;
+        } else if (m_writing_pos < m_out_writing.size()) {
+            while (m_writing_mark < m_writing_marks.size() && m_writing_marks[m_writing_mark] <= m_writing_pos) {
+                m_writing_mark++;
+            }
+
+            auto end = m_writing_mark < m_writing_marks.size() ? m_writing_marks[m_writing_mark] : m_out_writing.size();
+            data = m_out_writing.data() + m_writing_pos;
+            n = end - m_writing_pos;
+            m_writing_pos = end;
+        } else if (!m_out.empty()) {
+            m_out_writing.clear();
+            std::swap(m_out, m_out_writing);
+            m_writing_marks.clear();
+            std::swap(m_out_marks, m_writing_marks);
+            m_writing_pos = 0;
+            m_writing_mark = 0;
+            m_stats.bulk_queue_max = std::max<uint64_t>(m_stats.bulk_queue_max, m_out_writing.size());
+            NATS_ASIO_PROBE2(flush, m_out_writing.size(), m_out_publishes);
+            m_out_publishes = 0;
+            m_space_signal.cancel();
+
+            if (m_drain_blocked) {
+                drain_posted();
+            }
+
+            continue;
+        } else {
+            if (m_stop_flag) {
+                return;
+            }
+
+            boost::system::error_code wait_ec;
+            m_write_signal.async_wait(c[wait_ec]);
+            continue;
+        }
+
+        uint64_t started = NATS_ASIO_PROBE_ENABLED(write) ? probe_now_ns() : 0;
+        m_socket->async_write(boost::asio::buffer(data, n), boost::asio::transfer_exactly(n), c[ec]);
+        m_stats.writes++;
+        m_stats.written_bytes += n;
+
+        if (started > 0) {
+            NATS_ASIO_PROBE3(write, n, probe_now_ns() - started, lane);
+        }
+
+        // the socket is already closed by the reader
+        if (generation != m_generation || !m_is_connected) {
+            return;
+        }
+
+        auto s = handle_error(c);
+
+        if (s.failed()) {
+            m_log->error("failed to write {}", s.error());
+            return;
+        }
+    }
+}
+
+template <class SocketType>
+status connection<SocketType>::publish(string_view subject, const char* raw, std::size_t n,
+                                       optional<string_view> reply_to, ctx c) {
+    boost::asio::const_buffer part(raw, n);
+    return publish(subject, &part, 1, reply_to, c);
+}
+
+template <class SocketType>
+status connection<SocketType>::publish(string_view subject, const boost::asio::const_buffer* parts, std::size_t count,
+                                       optional<string_view> reply_to, ctx c) {
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    std::size_t n = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        n += parts[i].size();
+    }
+
+    auto rule = find_compression_rule(m_compression, subject);
+
+    // codecs need contiguous input
+    if (rule != nullptr && rule->codec != compression::none && n >= rule->min_size) {
+        auto joined = m_buffers.take();
+        joined.reserve(n);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            auto p = static_cast<const char*>(parts[i].data());
+            joined.insert(joined.end(), p, p + parts[i].size());
+        }
+
+        auto s = publish(subject, joined.data(), n, headers_t(), reply_to, c);
+        m_buffers.give(std::move(joined));
+        return s;
+    }
+
+    auto s = check_size(n);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    s = wait_for_space(c);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    append_pub(subject, reply_to, parts, count, n);
+    wake_writer();
+
+    if (m_local_delivery && has_local_match(subject)) {
+        if (count == 1) {
+            deliver_local(subject, reply_to, {}, static_cast<const char*>(parts[0].data()), n, c);
+            return {};
+        }
+
+        auto joined = m_buffers.take();
+
+        for (std::size_t i = 0; i < count; ++i) {
+            auto p = static_cast<const char*>(parts[i].data());
+            joined.insert(joined.end(), p, p + parts[i].size());
+        }
+
+        deliver_local(subject, reply_to, {}, joined.data(), n, c);
+        m_buffers.give(std::move(joined));
+    }
+
+    return {};
+}
+
+template <class SocketType>
+status connection<SocketType>::publish_encoded(string_view subject, optional<string_view> reply_to,
+                                               const payload_writer& write, ctx c) {
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    auto rule = find_compression_rule(m_compression, subject);
+
+    // compression and local delivery need the payload out of the queue
+    if ((rule != nullptr && rule->codec != compression::none) || (m_local_delivery && has_local_match(subject))) {
+        auto buf = m_buffers.take();
+        write(buf);
+        auto s = publish(subject, buf.data(), buf.size(), reply_to, c);
+        m_buffers.give(std::move(buf));
+        return s;
+    }
+
+    auto s = wait_for_space(c);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    auto start = m_out.size();
+    fmt::format_to(std::back_inserter(m_out), "PUB {} {} ", subject,
+                   reply_to.has_value() ? reply_to.value() : string_view());
+    auto size_at = m_out.size();
+    m_out.resize(size_at + m_encoded_digits + 2);
+    auto payload_at = m_out.size();
+
+    // a frame cut by an exception would break the stream
+    try {
+        write(m_out);
+    } catch (...) {
+        m_out.resize(start);
+        throw;
+    }
+
+    auto n = m_out.size() - payload_at;
+    s = check_size(n);
+
+    if (s.failed()) {
+        m_out.resize(start);
+        return s;
+    }
+
+    fmt::format_int size(n);
+
+    // payload moves only when its size has other digit count than the last one
+    if (size.size() != m_encoded_digits) {
+        auto moved_at = size_at + size.size() + 2;
+
+        if (moved_at > payload_at) {
+            m_out.resize(moved_at + n);
+        }
+
+        std::memmove(m_out.data() + moved_at, m_out.data() + payload_at, n);
+        m_out.resize(moved_at + n);
+        m_encoded_digits = size.size();
+    }
+
+    std::memcpy(m_out.data() + size_at, size.data(), size.size());
+    std::memcpy(m_out.data() + size_at + size.size(), sep, 2);
+    append(sep, 2);
+    m_out_publishes++;
+    NATS_ASIO_PROBE3(publish, subject.data(), subject.size(), n);
+    wake_writer();
+    return {};
+}
+
+template <class SocketType>
+void connection<SocketType>::append_pub(string_view subject, optional<string_view> reply_to,
+                                        const boost::asio::const_buffer* parts, std::size_t count, std::size_t n) {
+    fmt::format_to(std::back_inserter(m_out), "PUB {} {} {}\r\n", subject,
+                   reply_to.has_value() ? reply_to.value() : string_view(), n);
+    append(parts, count);
+    append(sep, 2);
+    m_out_publishes++;
+    NATS_ASIO_PROBE3(publish, subject.data(), subject.size(), n);
+}
+
+template <class SocketType>
+status connection<SocketType>::publish(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                                       optional<string_view> reply_to, ctx c) {
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    auto s = check_message_size(subject, n, headers, true);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    s = wait_for_space(c);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    append_hpub(subject, raw, n, headers, reply_to);
+    wake_writer();
+
+    if (m_local_delivery && has_local_match(subject)) {
+        if (headers.empty()) {
+            deliver_local(subject, reply_to, {}, raw, n, c);
+            return {};
+        }
+
+        auto block = m_buffers.take();
+        append_header_block(block, headers);
+        block.insert(block.end(), sep, sep + 2);
+        deliver_local(subject, reply_to, string_view(block.data(), block.size()), raw, n, c);
+        m_buffers.give(std::move(block));
+    }
+
+    return {};
+}
+
+template <class SocketType>
+void connection<SocketType>::append_hpub(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                                         optional<string_view> reply_to) {
+    append_hpub_block(subject, header_version, headers, raw, n, reply_to);
+}
+
+template <class SocketType>
+void connection<SocketType>::append_hpub_block(string_view subject, string_view block, const headers_t& headers,
+                                               const char* raw, std::size_t n, optional<string_view> reply_to) {
+    compression codec = compression::none;
+    pmr_vector<char> compressed(&m_pool);
+    // inline storage, so encoding headers don't allocate either
+    fmt::memory_buffer encoding;
+
+    if (compress_payload(subject, raw, n, codec, compressed)) {
+        fmt::format_to(std::back_inserter(encoding), "{}: {}\r\n{}: {}\r\n", encoding_header,
+                       compression_name(codec), encoded_size_header, n);
+        raw = compressed.data();
+        n = compressed.size();
+    }
+
+    auto header_n = block.size() + header_lines_size(headers) + encoding.size() + 2;
+    fmt::format_to(std::back_inserter(m_out), "HPUB {} {} {} {}\r\n", subject,
+                   reply_to.has_value() ? reply_to.value() : string_view(), header_n, header_n + n);
+    append(block);
+    append_header_lines(m_out, headers);
+    append(encoding.data(), encoding.size());
+    append(sep, 2);
+    append(raw, n);
+    append(sep, 2);
+    m_out_publishes++;
+    NATS_ASIO_PROBE3(publish, subject.data(), subject.size(), n);
+    m_buffers.give(std::move(compressed));
+}
+
+template <class SocketType> connection_stats connection<SocketType>::stats() {
+    auto st = m_stats;
+    st.bulk_queue_bytes = m_out.size() + (m_out_writing.size() - std::min(m_writing_pos, m_out_writing.size()));
+    st.control_queue_bytes = m_control.size();
+    auto& spin = boost::asio::use_service<spin_state>(m_io);
+
+    if (spin.active) {
+        st.mode = run_mode::spin;
+    }
+
+    st.spin_cpu = spin.cpu;
+    st.spin_polls = spin.polls;
+    return st;
+}
+
+template <class SocketType>
+status connection<SocketType>::post_publish(string_view subject, const char* raw, std::size_t n,
+                                            optional<string_view> reply_to) {
+    return post_publish(subject, raw, n, headers_t(), reply_to);
+}
+
+template <class SocketType>
+status connection<SocketType>::post_publish(string_view subject, const char* raw, std::size_t n,
+                                            const headers_t& headers, optional<string_view> reply_to) {
+    if (m_posted == nullptr) {
+        return status("not started");
+    }
+
+    // the server closes the connection on a bad message, which would lose everything queued with it
+    auto s = check_subject(subject, false);
+
+    if (!s.failed() && reply_to.has_value()) {
+        s = check_subject(reply_to.value(), false);
+    }
+
+    if (!s.failed()) {
+        // posted messages without headers go as PUB
+        s = check_message_size(subject, n, headers, !headers.empty());
+    }
+
+    if (s.failed()) {
+        return s;
+    }
+
+    if (!m_posted->push(subject, reply_to, headers, raw, n)) {
+        return status("post queue is full");
+    }
+
+    schedule_drain();
+    return {};
+}
+
+template <class SocketType> void connection<SocketType>::schedule_drain() {
+    // one wakeup for everything pushed until drain starts
+    if (!m_drain_scheduled.exchange(true)) {
+        boost::asio::post(m_io, std::bind(&connection::drain_posted, this->shared_from_this()));
+    }
+}
+
+template <class SocketType> void connection<SocketType>::drain_posted() {
+    static constexpr std::size_t chunk = 64;
+    m_drain_scheduled = false;
+    m_drain_blocked = false;
+    std::size_t drained = 0;
+
+    for (;;) {
+        if (!m_is_connected || m_out.size() >= m_max_pending) {
+            m_drain_blocked = true;
+            break;
+        }
+
+        auto n = m_posted->drain(chunk, [this](string_view subject, optional<string_view> reply_to,
+                                               string_view header_block, const char* raw, std::size_t n) {
+            if (m_local_delivery && has_local_match(subject)) {
+                queue_local(subject, reply_to, header_block, raw, n);
+            }
+
+            if (!header_block.empty()) {
+                append_hpub_block(subject, header_block, headers_t(), raw, n, reply_to);
+                return;
+            }
+
+            auto rule = find_compression_rule(m_compression, subject);
+
+            if (rule != nullptr && rule->codec != compression::none && n >= rule->min_size) {
+                append_hpub(subject, raw, n, headers_t(), reply_to);
+                return;
+            }
+
+            boost::asio::const_buffer part(raw, n);
+            append_pub(subject, reply_to, &part, 1, n);
+        });
+        drained += n;
+
+        if (n < chunk) {
+            break;
+        }
+    }
+
+    if (drained > 0) {
+        m_stats.posted_messages += drained;
+        m_stats.posted_batches++;
+        wake_writer();
+    }
+
+    if (!m_local_queue.empty() && !m_local_scheduled) {
+        m_local_scheduled = true;
+        boost::asio::spawn(m_io, std::bind(&connection::deliver_queued_local, this->shared_from_this(),
+                                           std::placeholders::_1));
+    }
+}
+
+template <class SocketType>
+std::pair<std::string, status> connection<SocketType>::request(string_view subject, const char* raw, std::size_t n,
+                                                              const headers_t& headers, duration timeout, ctx c) {
+    if (!m_is_connected) {
+        return {std::string(), status("not connected")};
+    }
+
+    if (m_inbox_sub == nullptr) {
+        auto r = subscribe_headers(
+            m_inbox_prefix + "*", {},
+            [this](string_view subject, optional<string_view>, string_view headers, const char* raw, std::size_t n,
+                   ctx) { on_inbox_message(subject, headers, raw, n); },
+            c);
+
+        if (r.second.failed()) {
+            return {std::string(), r.second};
+        }
+
+        m_inbox_sub = r.first;
+    }
+
+    auto id = m_request_id++;
+    auto reply_to = m_inbox_prefix + std::to_string(id);
+    pending_request r(m_io);
+    m_requests.emplace(id, &r);
+    status s;
+
+    if (headers.empty()) {
+        s = publish(subject, raw, n, optional<string_view>(reply_to), c);
+    } else {
+        s = publish(subject, raw, n, headers, optional<string_view>(reply_to), c);
+    }
+
+    // reply could come while publish was in progress
+    if (!s.failed() && !r.m_done) {
+        boost::system::error_code wait_ec;
+        r.m_timer.expires_from_now(timeout);
+        r.m_timer.async_wait(c[wait_ec]);
+    }
+
+    m_requests.erase(id);
+
+    if (s.failed()) {
+        return {std::string(), s};
+    }
+
+    if (!r.m_done) {
+        return {std::string(), status(fmt::format("request to {} timed out", subject))};
+    }
+
+    return {std::move(r.m_payload), r.m_result};
+}
+
+template <class SocketType>
+void connection<SocketType>::on_inbox_message(string_view subject, string_view headers, const char* raw,
+                                              std::size_t n) {
+    uint64_t id = 0;
+
+    if (!parse_uint(subject.substr(m_inbox_prefix.size()), id)) {
+        m_log->trace("dropping reply with unexpected subject {}", subject);
+        return;
+    }
+
+    auto it = m_requests.find(id);
+
+    if (it == m_requests.end()) {
+        m_log->trace("dropping reply to finished request {}", id);
+        return;
+    }
+
+    auto r = it->second;
+
+    if (headers_status(headers) == 503) {
+        r->m_result = status("no responders");
+    } else {
+        r->m_payload.assign(raw, n);
+    }
+
+    r->m_done = true;
+    r->m_timer.cancel();
+}
+
+template <class SocketType> status connection<SocketType>::unsubscribe(const isubscription_sptr& p, ctx /*c*/) {
+    auto sid = p->sid();
+    auto it = m_subs.find(sid);
+
+    if (it == m_subs.end()) {
+        return status(fmt::format("subscription not found {}", sid));
+    }
+    m_subs.erase(it);
+
+    if (!m_is_connected) {
+        return status("not connected");
+    }
+
+    fmt::format_to(std::back_inserter(m_control), "UNSUB {}\r\n", sid);
+    wake_writer();
+    return {};
+}
+
+template <class SocketType> void connection<SocketType>::cancel_subscription(uint64_t sid) {
+    // m_subs and m_control belong to the connection thread
+    if (!m_io.get_executor().running_in_this_thread()) {
+        boost::asio::post(m_io, std::bind(&connection::cancel_subscription, this->shared_from_this(), sid));
+        return;
+    }
+
+    auto it = m_subs.find(sid);
+
+    if (it == m_subs.end()) {
+        return;
+    }
+
+    m_subs.erase(it);
+
+    if (m_is_connected) {
+        fmt::format_to(std::back_inserter(m_control), "UNSUB {}\r\n", sid);
+        wake_writer();
+    }
+}
+
+template <class SocketType>
+std::pair<isubscription_sptr, status> connection<SocketType>::subscribe(string_view subject,
+                                                                        optional<string_view> queue, on_message_cb cb,
+                                                                        ctx c, uint64_t max_messages) {
+    if (!m_is_connected) {
+        return {isubscription_sptr(), status("not connected")};
+    }
+
+    return do_subscribe(subject, queue, make_subscription(cb), max_messages, c);
+}
+
+template <class SocketType>
+std::pair<isubscription_sptr, status>
+connection<SocketType>::subscribe_headers(string_view subject, optional<string_view> queue, on_headers_message_cb cb,
+                                          ctx c, uint64_t max_messages) {
+    if (!m_is_connected) {
+        return {isubscription_sptr(), status("not connected")};
+    }
+
+    return do_subscribe(subject, queue, make_subscription(cb), max_messages, c);
+}
+
+template <class SocketType>
+std::pair<isubscription_sptr, status>
+connection<SocketType>::subscribe_batch(string_view subject, optional<string_view> queue, on_batch_message_cb cb, ctx c,
+                                        uint64_t max_messages) {
+    if (!m_is_connected) {
+        return {isubscription_sptr(), status("not connected")};
+    }
+
+    return do_subscribe(subject, queue, make_subscription(cb), max_messages, c);
+}
+
+template <class SocketType>
+std::pair<isubscription_sptr, status>
+connection<SocketType>::do_subscribe(string_view subject, optional<string_view> queue, const subscription_sptr& sub,
+                                     uint64_t max_messages, ctx c) {
+    boost::ignore_unused(c);
+
+    if (m_draining) {
+        return {isubscription_sptr(), status("draining")};
+    }
+
+    // control lane isn't limited by max_pending_bytes
+    if (!m_is_connected) {
+        return {isubscription_sptr(), status("not connected")};
+    }
+
+    auto sid = sub->m_sid;
+    sub->m_subject.assign(subject.data(), subject.size());
+    sub->m_queue = queue.has_value() && !queue.value().empty();
+    fmt::format_to(std::back_inserter(m_control), "SUB {} {} {}\r\n", subject,
+                   queue.has_value() ? queue.value() : string_view(), sid);
+
+    if (max_messages > 0) {
+        fmt::format_to(std::back_inserter(m_control), "UNSUB {} {}\r\n", sid, max_messages);
+        sub->m_max = max_messages;
+    }
+
+    wake_writer();
+    m_subs.emplace(sid, sub);
+    return {sub, {}};
+}
+
+template <class SocketType> void connection<SocketType>::on_pong(ctx) {
+    m_log->trace("pong recived");
+    m_pongs++;
+    m_drain_timer.cancel();
+}
+
+template <class SocketType> void connection<SocketType>::on_ping(ctx) {
+    m_log->trace("ping recived");
+    append_control("PONG\r\n");
+    wake_writer();
+}
+
+template <class SocketType> void connection<SocketType>::on_info(string_view info, ctx) {
+    using nlohmann::json;
+    auto j = json::parse(info);
+    m_log->debug("got info {}", j.dump());
+    m_max_payload = j["max_payload"].get<std::size_t>();
+    m_log->trace("info recived and parsed");
+}
+
+template <class SocketType>
+void connection<SocketType>::on_message(string_view subject, string_view sid_str, optional<string_view> reply_to,
+                                        std::size_t header_n, std::size_t n, ctx c) {
+    m_stats.messages_received++;
+
+    if (n + 2 > m_buf.size()) {
+        flush_batches(c);
+        read_more(n + 2 - m_buf.size(), c);
+    }
+
+    auto s = handle_error(c);
+
+    if (s.failed()) {
+        m_log->error("failed to read {}", s.error());
+        return;
+    }
+
+    // parsed in place, sid_str isn't terminated and a string of the rest of the line would allocate
+    uint64_t sid_u = 0;
+
+    if (!parse_uint(sid_str, sid_u)) {
+        m_log->error("can't parse sid: {}", sid_str);
+        return;
+    }
+
+    auto it = m_subs.find(sid_u);
+
+    if (it == m_subs.end()) {
+        m_log->trace("dropping message because subscription not found: topic: {}, sid: {}", subject, sid_str);
+        return;
+    }
+
+    auto sub = it->second;
+
+    // cancelled from another thread, the posted cancel hasn't run yet
+    if (sub->m_cancel.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // server has unsubscribed it after this one
+    if (sub->m_max > 0 && ++sub->m_received >= sub->m_max) {
+        m_subs.erase(it);
+    }
+
+    auto b = static_cast<const char*>(m_buf.data().data());
+    auto headers = string_view(b, header_n);
+    auto payload = b + header_n;
+    auto payload_n = n - header_n;
+    pmr_vector<char> decoded(&m_pool);
+
+    if (header_n > 0) {
+        s = decode_payload(headers, payload, payload_n, decoded);
+
+        if (s.failed()) {
+            m_log->error("dropping message on {}: {}", subject, s.error());
+            return;
+        }
+    }
+
+    if (sub->m_dedup != nullptr) {
+        switch (sub->m_dedup->check(subject, headers, payload, payload_n)) {
+        case dedup_filter::result::unique:
+            m_stats.dedup_unique++;
+            break;
+        case dedup_filter::result::exact:
+            m_stats.dedup_exact_hits++;
+            m_buffers.give(std::move(decoded));
+            return;
+        case dedup_filter::result::filter:
+            m_stats.dedup_filter_hits++;
+            m_buffers.give(std::move(decoded));
+            return;
+        }
+    }
+
+    if (sub->m_bcb) {
+        subscription::batched_message m{m_batch_text.size(), subject.size(), 0, reply_to.has_value(), headers,
+                                        payload, payload_n};
+        m_batch_text.append(subject.data(), subject.size());
+
+        if (reply_to.has_value()) {
+            m.reply_to_n = reply_to.value().size();
+            m_batch_text.append(reply_to.value().data(), m.reply_to_n);
+        }
+
+        if (sub->m_batch.empty()) {
+            m_batched.push_back(sub);
+        }
+
+        sub->m_batch.push_back(m);
+
+        // payload has to live until the batch is delivered
+        if (payload == decoded.data()) {
+            m_batch_buffers.push_back(std::move(decoded));
+        }
+
+        return;
+    }
+
+    uint64_t started = NATS_ASIO_PROBE_ENABLED(dispatch) ? probe_now_ns() : 0;
+
+    if (sub->m_hcb) {
+        sub->m_hcb(subject, reply_to, headers, payload, payload_n, c);
+    } else {
+        sub->m_cb(subject, reply_to, payload, payload_n, c);
+    }
+
+    if (started > 0) {
+        NATS_ASIO_PROBE3(dispatch, sub->m_sid, payload_n, probe_now_ns() - started);
+    }
+
+    m_buffers.give(std::move(decoded));
+}
+
+template <class SocketType> bool connection<SocketType>::has_local_match(string_view subject) const {
+    for (const auto& it : m_subs) {
+        if (!it.second->m_queue && subject_matches(it.second->m_subject, subject)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <class SocketType>
+void connection<SocketType>::deliver_local(string_view subject, optional<string_view> reply_to, string_view headers,
+                                           const char* raw, std::size_t n, ctx c) {
+    // callbacks may subscribe and cancel
+    boost::container::small_vector<subscription_sptr, 8> matched;
+
+    for (const auto& it : m_subs) {
+        if (!it.second->m_queue && subject_matches(it.second->m_subject, subject)) {
+            matched.push_back(it.second);
+        }
+    }
+
+    for (const auto& sub : matched) {
+        if (sub->m_cancel.load(std::memory_order_relaxed) || m_subs.find(sub->m_sid) == m_subs.end()) {
+            continue;
+        }
+
+        // the server doesn't count messages it didn't send, so max is enforced here
+        if (sub->m_max > 0 && ++sub->m_received >= sub->m_max) {
+            cancel_subscription(sub->m_sid);
+        }
+
+        if (sub->m_dedup != nullptr) {
+            auto r = sub->m_dedup->check(subject, headers, raw, n);
+
+            if (r == dedup_filter::result::exact) {
+                m_stats.dedup_exact_hits++;
+                continue;
+            }
+
+            if (r == dedup_filter::result::filter) {
+                m_stats.dedup_filter_hits++;
+                continue;
+            }
+
+            m_stats.dedup_unique++;
+        }
+
+        m_stats.local_deliveries++;
+
+        if (sub->m_bcb) {
+            message_view v;
+            v.subject = subject;
+            v.reply_to = reply_to;
+            v.headers = headers;
+            v.raw = raw;
+            v.n = n;
+            sub->m_bcb(&v, 1, c);
+        } else if (sub->m_hcb) {
+            sub->m_hcb(subject, reply_to, headers, raw, n, c);
+        } else {
+            sub->m_cb(subject, reply_to, raw, n, c);
+        }
+    }
+}
+
+template <class SocketType>
+void connection<SocketType>::queue_local(string_view subject, optional<string_view> reply_to,
+                                         string_view header_block, const char* raw, std::size_t n) {
+    local_message m{m_local_text.size(), subject.size(), 0, reply_to.has_value(), 0, n};
+    m_local_text.insert(m_local_text.end(), subject.begin(), subject.end());
+
+    if (reply_to.has_value()) {
+        m.reply_to_n = reply_to.value().size();
+        m_local_text.insert(m_local_text.end(), reply_to.value().begin(), reply_to.value().end());
+    }
+
+    if (!header_block.empty()) {
+        m.headers_n = header_block.size() + 2;
+        m_local_text.insert(m_local_text.end(), header_block.begin(), header_block.end());
+        m_local_text.insert(m_local_text.end(), sep, sep + 2);
+    }
+
+    m_local_text.insert(m_local_text.end(), raw, raw + n);
+    m_local_queue.push_back(m);
+}
+
+template <class SocketType> void connection<SocketType>::deliver_queued_local(ctx c) {
+    m_local_scheduled = false;
+    pmr_vector<char> text(&m_pool);
+    pmr_vector<local_message> queue(&m_pool);
+    std::swap(text, m_local_text);
+    std::swap(queue, m_local_queue);
+
+    for (const auto& m : queue) {
+        auto p = text.data() + m.offset;
+        string_view subject(p, m.subject_n);
+        p += m.subject_n;
+        optional<string_view> reply_to;
+
+        if (m.has_reply_to) {
+            reply_to = string_view(p, m.reply_to_n);
+            p += m.reply_to_n;
+        }
+
+        string_view headers(p, m.headers_n);
+        deliver_local(subject, reply_to, headers, p + m.headers_n, m.n, c);
+    }
+
+    // buffers go back unless callbacks queued more meanwhile
+    if (m_local_queue.empty()) {
+        text.clear();
+        queue.clear();
+        std::swap(text, m_local_text);
+        std::swap(queue, m_local_queue);
+    }
+}
+
+template <class SocketType> status connection<SocketType>::do_connect(const connect_config& conf, ctx c) {
+    reset_socket();
+    m_socket->m_recorder = m_recorder.get();
+    m_buf.consume(m_buf.size());
+
+    // replay has nothing to connect to
+    if (m_replay == nullptr) {
+        auto deadline = boost::asio::deadline_timer::traits_type::now() + conf.connect_timeout;
+        auto s = connect_socket(conf, deadline, c);
+
+        if (s.failed()) {
+            return s;
+        }
+
+        auto id = ++m_connect_id;
+        m_connect_timer.expires_at(deadline);
+        m_connect_timer.async_wait([this, id](boost::system::error_code e) {
+            if (!e.failed() && id == m_connect_id && !m_is_connected) {
+                m_log->error("connect timed out");
+                boost::system::error_code ignored;
+                m_socket->close(ignored);
+            }
+        });
+    }
+
+    auto s = handshake(conf, c);
+    m_connect_timer.cancel();
+    return s;
+}
+
+template <class SocketType>
+status connection<SocketType>::connect_socket(const connect_config& conf, boost::posix_time::ptime deadline, ctx c) {
+    auto now = boost::asio::deadline_timer::traits_type::now();
+
+    if (m_endpoints.empty() || now - m_resolved_at > conf.resolve_cache_ttl) {
+        // addresses of both families come from one getaddrinfo call, it queries them in parallel
+        tcp::resolver res(m_io);
+        auto results = res.async_resolve(conf.address, std::to_string(conf.port), c[ec]);
+        auto s = handle_error(c);
+
+        if (s.failed()) {
+            m_log->error("async resolve of {}:{} failed with error: {}", conf.address, conf.port, s.error());
+            return s;
+        }
+
+        std::vector<tcp::endpoint> endpoints;
+
+        for (const auto& r : results) {
+            endpoints.push_back(r.endpoint());
+        }
+
+        m_endpoints = interleave_families(endpoints);
+        m_resolved_at = now;
+        m_stats.resolves++;
+    } else {
+        m_stats.resolve_cache_hits++;
+    }
+
+    tcp::socket socket(m_io);
+    ec = std::make_shared<connect_race>(m_io)->run(m_endpoints, conf.connect_stagger, deadline, socket,
+                                                   m_stats.connect_attempts, c);
+
+    if (ec.failed()) {
+        m_endpoints.clear(); // addresses may have changed
+    }
+
+    auto s = handle_error(c);
+
+    if (s.failed()) {
+        m_log->error("connect to {}:{} failed with error: {}", conf.address, conf.port, s.error());
+        return s;
+    }
+
+    if (conf.busy_poll_us > 0) {
+        int value = conf.busy_poll_us;
+
+        if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0) {
+            m_log->warn("SO_BUSY_POLL {} is not set: {}", value, std::strerror(errno));
+        }
+    }
+
+    m_socket->assign(std::move(socket), ec);
+    return handle_error(c);
+}
+
+template <class SocketType> status connection<SocketType>::handshake(const connect_config& conf, ctx c) {
+    m_socket->async_read_until_raw(m_buf, c[ec]);
+    auto s = handle_error(c);
+
+    if (s.failed()) {
+        m_log->error("read server info failed {}", s.error());
+        return s;
+    }
+
+    std::string header;
+    std::istream is(&m_buf);
+    s = parse_header(header, is, this, c);
+
+    if (s.failed()) {
+        m_log->error("process message failed with error: {}", s.error());
+        return s;
+    }
+
+    auto handshake_start = std::chrono::steady_clock::now();
+    auto resumed = m_socket->async_handshake(c[ec]);
+    s = handle_error(c);
+
+    if (s.failed()) {
+        m_log->error("async handshake failed {}", s.error());
+        return s;
+    }
+
+    if (m_tls != nullptr) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                        handshake_start)
+                      .count();
+        m_stats.tls_handshakes++;
+        m_stats.tls_resumed_handshakes += resumed ? 1 : 0;
+        m_stats.tls_handshake_last_us = static_cast<uint64_t>(us);
+        m_stats.tls_handshake_total_us += static_cast<uint64_t>(us);
+        m_log->debug("tls handshake done in {}us, session resumed: {}", us, resumed);
+    }
+
+    auto info = prepare_info(conf);
+    m_socket->async_write(boost::asio::buffer(info), boost::asio::transfer_exactly(info.size()), c[ec]);
+    s = handle_error(c);
+
+    if (s.failed()) {
+        m_log->error("failed to write info {}", s.error());
+        return s;
+    }
+
+    return {};
+}
+
+template <class SocketType> void connection<SocketType>::run(const connect_config& conf, ctx c) {
+    std::string header;
+    // connect_started is when the connection was lost, valid while reconnecting is set. A plain time point, gcc
+    // reports an optional one as maybe uninitialized
+    bool reconnecting = false;
+    auto connect_started = std::chrono::steady_clock::now();
+
+    for (;;) {
+        if (m_stop_flag) {
+            m_log->debug("stopping main connection loop");
+            return;
+        }
+
+        // drain ends with the connection, resubscribing would let the new one confirm it
+        if (!m_is_connected && m_draining) {
+            m_log->debug("connection lost while draining, not reconnecting");
+            return;
+        }
+
+        if (!m_is_connected) {
+            if (!reconnecting) {
+                reconnecting = true;
+                connect_started = std::chrono::steady_clock::now();
+                NATS_ASIO_PROBE1(reconnect_start, m_stats.connects);
+            }
+
+            // TODO: make sleep if failed
+            auto s = do_connect(conf, c);
+
+            if (s.failed()) {
+                m_log->error("connect failed with error {}", s.error());
+                continue;
+            }
+
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                            connect_started)
+                          .count();
+            NATS_ASIO_PROBE2(reconnect_end, m_stats.connects, us);
+            reconnecting = false;
+            m_stats.connects++;
+            m_stats.connect_last_us = static_cast<uint64_t>(us);
+            m_stats.connect_total_us += static_cast<uint64_t>(us);
+            m_is_connected = true;
+            m_generation++;
+            m_out.clear();
+            m_out_marks.clear();
+            // the rest of the old connection's writes is dropped too
+            m_writing_pos = m_out_writing.size();
+            m_control.clear();
+            boost::asio::spawn(m_io, std::bind(&connection::write_loop, this, m_generation, std::placeholders::_1));
+
+            if (m_drain_blocked) {
+                drain_posted();
+            }
+
+            // inbox subscription is gone with the previous connection
+            if (m_inbox_sub != nullptr) {
+                m_subs.erase(m_inbox_sub->sid());
+                m_inbox_sub.reset();
+            }
+
+            if (m_connected_cb != nullptr) {
+                m_connected_cb(*this, c);
+            }
+        }
+
+        // every complete frame in the buffer is dispatched before the next read
+        std::istream is(&m_buf);
+
+        while (m_is_connected && has_buffered_line()) {
+            auto s = parse_header(header, is, this, c);
+
+            if (s.failed()) {
+                m_log->error("process message failed with error: {}", s.error());
+            }
+        }
+
+        // batches point into m_buf, which a reconnect drops, so they go out even if the connection is lost
+        flush_batches(c);
+
+        if (!m_is_connected) {
+            continue;
+        }
+
+        read_more(1, c);
+        auto s = handle_error(c);
+
+        if (s.failed()) {
+            m_log->error("failed to read {}", s.error());
+            continue;
+        }
+    }
+}
+
+template <class SocketType> void connection<SocketType>::read_more(std::size_t n, ctx c) {
+    for (std::size_t total = 0; total < n;) {
+        auto size = std::max(m_read_size, n - total);
+        uint64_t started = NATS_ASIO_PROBE_ENABLED(read) ? probe_now_ns() : 0;
+        auto got = m_socket->async_read_some(m_buf.prepare(size), c[ec]);
+
+        // time includes waiting for data
+        if (started > 0) {
+            NATS_ASIO_PROBE3(read, size, got, probe_now_ns() - started);
+        }
+
+        if (ec.failed()) {
+            return;
+        }
+
+        m_buf.commit(got);
+        total += got;
+        m_stats.reads++;
+        m_stats.read_bytes += got;
+
+        // full reads mean more is waiting in the socket
+        if (got == size) {
+            m_stats.full_reads++;
+        }
+
+        if (got == size && m_read_size < max_read_size) {
+            m_read_size *= 2;
+        } else if (got < m_read_size / 4 && m_read_size > min_read_size) {
+            m_read_size /= 2;
+        }
+
+        m_stats.read_size = m_read_size;
+    }
+}
+
+template <class SocketType> void connection<SocketType>::flush_batches(ctx c) {
+    if (m_batched.empty()) {
+        return;
+    }
+
+    for (const auto& sub : m_batched) {
+        // cancelled by a callback of this flush
+        if (sub->m_cancel.load(std::memory_order_relaxed)) {
+            sub->m_batch.clear();
+            continue;
+        }
+
+        m_batch_views.clear();
+
+        for (const auto& m : sub->m_batch) {
+            message_view v;
+            v.subject = string_view(m_batch_text.data() + m.text_offset, m.subject_n);
+
+            if (m.has_reply_to) {
+                v.reply_to = string_view(m_batch_text.data() + m.text_offset + m.subject_n, m.reply_to_n);
+            }
+
+            v.headers = m.headers;
+            v.raw = m.raw;
+            v.n = m.n;
+            m_batch_views.push_back(v);
+        }
+
+        sub->m_batch.clear();
+        uint64_t started = NATS_ASIO_PROBE_ENABLED(dispatch) ? probe_now_ns() : 0;
+        sub->m_bcb(m_batch_views.data(), m_batch_views.size(), c);
+
+        // size of a batch is the number of messages
+        if (started > 0) {
+            NATS_ASIO_PROBE3(dispatch, sub->m_sid, m_batch_views.size(), probe_now_ns() - started);
+        }
+    }
+
+    m_batched.clear();
+    m_batch_text.clear();
+
+    for (auto& buf : m_batch_buffers) {
+        m_buffers.give(std::move(buf));
+    }
+
+    m_batch_buffers.clear();
+}
+
+template <class SocketType>
+bool connection<SocketType>::compress_payload(string_view subject, const char* raw, std::size_t n, compression& codec,
+                                              pmr_vector<char>& out) {
+    auto rule = find_compression_rule(m_compression, subject);
+
+    if (rule == nullptr || rule->codec == compression::none || n < rule->min_size) {
+        return false;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    out = m_buffers.take();
+
+    if (!m_codec.compress(rule->codec, rule->level, raw, n, out)) {
+        return false;
+    }
+
+    codec = rule->codec;
+    m_stats.compressed_messages++;
+    m_stats.compression_in_bytes += n;
+    m_stats.compression_out_bytes += out.size();
+    m_stats.compression_us += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+    return true;
+}
+
+template <class SocketType>
+status connection<SocketType>::decode_payload(string_view headers, const char*& raw, std::size_t& n,
+                                              pmr_vector<char>& out) {
+    auto name = find_header(headers, encoding_header);
+
+    if (!name.has_value()) {
+        return {};
+    }
+
+    auto codec = compression_from_name(name.value());
+    uint64_t decoded_n = 0;
+    auto size = find_header(headers, encoded_size_header);
+
+    if (!codec.has_value() || !size.has_value() || !parse_uint(size.value(), decoded_n)) {
+        return status(fmt::format("unknown payload encoding {}", name.value()));
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    out = m_buffers.take();
+    auto s = m_codec.decompress(codec.value(), raw, n, static_cast<std::size_t>(decoded_n), out);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    raw = out.data();
+    n = out.size();
+    m_stats.decompressed_messages++;
+    m_stats.decompression_us += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+    return {};
+}
+
+template <class SocketType> bool connection<SocketType>::has_buffered_line() const {
+    string_view data(static_cast<const char*>(m_buf.data().data()), m_buf.size());
+    return data.find("\r\n") != string_view::npos;
+}
+
+template <class SocketType> status connection<SocketType>::handle_error(ctx c) {
+    if (ec.failed()) {
+        auto original_msg = ec.message();
+        m_is_connected = false;
+        wake_writer();
+        m_space_signal.cancel();
+        m_drain_timer.cancel();
+        m_socket->close(ec); // TODO: handle it if error
+
+        if (ec.failed()) {
+            m_log->error("error on socket close {}", ec.message());
+        }
+
+        if (m_disconnected_cb != nullptr) {
+            m_disconnected_cb(*this, std::move(c));
+        }
+
+        return status(original_msg);
+    }
+
+    return {};
+}
+
+template <class SocketType> std::string connection<SocketType>::prepare_info(const connect_config& o) {
+    constexpr auto connect_payload = "CONNECT {}\r\n";
+    constexpr auto name = "nats_asio";
+    constexpr auto lang = "cpp";
+    constexpr auto version = "0.0.1";
+    using nlohmann::json;
+    json j = {
+        {"verbose", o.verbose}, {"pedantic", o.pedantic}, {"name", name},          {"lang", lang},
+        {"version", version},   {"headers", true},        {"no_responders", true},
+    };
+
+    if (o.user.has_value()) {
+        j["user"] = o.user.value();
+    }
+
+    if (o.password.has_value()) {
+        j["pass"] = o.password.value();
+    }
+
+    if (o.token.has_value()) {
+        j["auth_token"] = o.token.value();
+    }
+
+    // own messages are delivered without the server
+    if (o.local_delivery) {
+        j["echo"] = false;
+    }
+
+    auto info = j.dump();
+    auto connect_data = fmt::format(connect_payload, info);
+    m_log->debug("sending data on connect {}", info);
+    return connect_data;
+}
+
+std::string base64_decode(string_view in) {
+    static const auto table = [] {
+        std::array<int, 256> t;
+        t.fill(-1);
+        const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        for (int i = 0; i < 64; ++i) {
+            t[static_cast<unsigned char>(alphabet[i])] = i;
+        }
+
+        return t;
+    }();
+
+    std::string out;
+    out.reserve(in.size() / 4 * 3);
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for (auto ch : in) {
+        auto v = table[static_cast<unsigned char>(ch)];
+
+        if (v < 0) {
+            break; // padding
+        }
+
+        acc = (acc << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>((acc >> bits) & 0xff));
+        }
+    }
+
+    return out;
+}
+
+// metadata of jetstream message taken from its reply subject
+struct js_ack_info {
+    uint64_t delivered = 0;
+    uint64_t stream_seq = 0;
+    uint64_t consumer_seq = 0;
+    uint64_t pending = 0;
+};
+
+// $JS.ACK.<stream>.<consumer>.<delivered>.<sseq>.<cseq>.<ts>.<pending>
+// or $JS.ACK.<domain>.<hash>.<stream>.<consumer>.<delivered>.<sseq>.<cseq>.<ts>.<pending>[.<token>]
+bool parse_js_ack(string_view reply_to, js_ack_info& info) {
+    auto tokens = split_sv(reply_to, ".");
+
+    if (tokens.size() < 9 || tokens[0] != "$JS" || tokens[1] != "ACK") {
+        return false;
+    }
+
+    std::size_t offset = tokens.size() == 9 ? 4 : 6;
+
+    if (tokens.size() < offset + 5) {
+        return false;
+    }
+
+    return parse_uint(tokens[offset], info.delivered) && parse_uint(tokens[offset + 1], info.stream_seq) &&
+           parse_uint(tokens[offset + 2], info.consumer_seq) && parse_uint(tokens[offset + 4], info.pending);
+}
+
+// error from jetstream api response or empty status
+status js_api_error(const nlohmann::json& j) {
+    if (j.is_discarded() || !j.is_object()) {
+        return status("invalid jetstream api response");
+    }
+
+    auto it = j.find("error");
+
+    if (it == j.end()) {
+        return {};
+    }
+
+    return status(fmt::format("jetstream api error {}: {}", it->value("code", 0), it->value("description", "")));
+}
+
+kv_op kv_op_from_headers(string_view headers) {
+    if (headers.empty()) {
+        return kv_op::put;
+    }
+
+    auto op = find_header(headers, "KV-Operation");
+
+    if (!op.has_value()) {
+        return kv_op::put;
+    }
+
+    if (op.value() == "DEL") {
+        return kv_op::del;
+    }
+
+    if (op.value() == "PURGE") {
+        return kv_op::purge;
+    }
+
+    return kv_op::put;
+}
+
+bool is_valid_kv_key(string_view key) {
+    if (key.empty() || key.front() == '.' || key.back() == '.') {
+        return false;
+    }
+
+    for (auto ch : key) {
+        bool ok = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' ||
+                  ch == '_' || ch == '/' || ch == '=' || ch == '.';
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+class kv_bucket : public ikv_bucket,
+                  public std::enable_shared_from_this<kv_bucket>,
+                  private boost::asio::detail::noncopyable {
+public:
+    kv_bucket(const iconnection_sptr& conn, const kv_config& conf);
+
+    // server stops sending the watch, messages on the way find the bucket gone
+    virtual ~kv_bucket() override {
+        if (m_watch_sub != nullptr) {
+            m_watch_sub->cancel();
+        }
+    }
+
+    virtual std::pair<optional<kv_entry>, status> get(string_view key, ctx c) override;
+
+    virtual std::pair<uint64_t, status> put(string_view key, const char* raw, std::size_t n, ctx c) override;
+
+    virtual std::pair<uint64_t, status> update(string_view key, const char* raw, std::size_t n, uint64_t last_revision,
+                                               ctx c) override;
+
+    virtual std::pair<uint64_t, status> del(string_view key, ctx c) override;
+
+    virtual status watch(on_kv_update_cb cb, ctx c) override;
+
+    virtual optional<uint64_t> revision(string_view key) override;
+
+private:
+    std::pair<uint64_t, status> write(string_view key, const char* raw, std::size_t n, const headers_t& headers,
+                                      ctx c);
+
+    void on_watch_message(string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                          std::size_t n, ctx c);
+
+    iconnection_sptr m_conn;
+    kv_config m_conf;
+    std::string m_stream;
+    std::string m_prefix;
+
+    isubscription_sptr m_watch_sub;
+    on_kv_update_cb m_watch_cb;
+
+    // true when watch delivered everything stored in bucket at the moment of its start
+    bool m_synced;
+    uint64_t m_last_revision;
+
+    // values are kept only with local_cache, deleted keys are kept as tombstones
+    std::map<std::string, kv_entry, std::less<>> m_cache;
+};
+
+kv_bucket::kv_bucket(const iconnection_sptr& conn, const kv_config& conf)
+    : m_conn(conn), m_conf(conf), m_stream("KV_" + conf.bucket), m_prefix("$KV." + conf.bucket + "."),
+      m_synced(false), m_last_revision(0) {}
+
+std::pair<optional<kv_entry>, status> kv_bucket::get(string_view key, ctx c) {
+    if (!is_valid_kv_key(key)) {
+        return {optional<kv_entry>(), status(fmt::format("invalid key {}", key))};
+    }
+
+    if (m_conf.local_cache && m_synced) {
+        auto it = m_cache.find(key);
+
+        if (it == m_cache.end() || it->second.op != kv_op::put) {
+            return {optional<kv_entry>(), {}};
+        }
+
+        return {it->second, {}};
+    }
+
+    using nlohmann::json;
+    json req = {{"last_by_subj", m_prefix + std::string(key.data(), key.size())}};
+    auto payload = req.dump();
+    auto r = m_conn->request("$JS.API.STREAM.MSG.GET." + m_stream, payload.data(), payload.size(), {},
+                             m_conf.timeout, c);
+
+    if (r.second.failed()) {
+        return {optional<kv_entry>(), r.second};
+    }
+
+    auto j = json::parse(r.first, nullptr, false);
+    auto s = js_api_error(j);
+
+    if (s.failed()) {
+        if (!j.is_discarded() && j["error"].value("code", 0) == 404) {
+            return {optional<kv_entry>(), {}};
+        }
+
+        return {optional<kv_entry>(), s};
+    }
+
+    const auto& msg = j["message"];
+    kv_entry e;
+    e.key.assign(key.data(), key.size());
+    e.revision = msg.value("seq", uint64_t(0));
+
+    if (msg.contains("hdrs")) {
+        auto headers = base64_decode(msg["hdrs"].get<std::string>());
+        e.op = kv_op_from_headers(headers);
+    }
+
+    if (e.op != kv_op::put) {
+        return {optional<kv_entry>(), {}};
+    }
+
+    if (msg.contains("data")) {
+        e.value = base64_decode(msg["data"].get<std::string>());
+    }
+
+    return {std::move(e), {}};
+}
+
+std::pair<uint64_t, status> kv_bucket::put(string_view key, const char* raw, std::size_t n, ctx c) {
+    return write(key, raw, n, {}, c);
+}
+
+std::pair<uint64_t, status> kv_bucket::update(string_view key, const char* raw, std::size_t n, uint64_t last_revision,
+                                              ctx c) {
+    auto rev = std::to_string(last_revision);
+    return write(key, raw, n, {{"Nats-Expected-Last-Subject-Sequence", rev}}, c);
+}
+
+std::pair<uint64_t, status> kv_bucket::del(string_view key, ctx c) {
+    return write(key, "", 0, {{"KV-Operation", "DEL"}}, c);
+}
+
+std::pair<uint64_t, status> kv_bucket::write(string_view key, const char* raw, std::size_t n, const headers_t& headers,
+                                             ctx c) {
+    if (!is_valid_kv_key(key)) {
+        return {0, status(fmt::format("invalid key {}", key))};
+    }
+
+    auto subject = m_prefix + std::string(key.data(), key.size());
+    auto r = m_conn->request(subject, raw, n, headers, m_conf.timeout, c);
+
+    if (r.second.failed()) {
+        return {0, r.second};
+    }
+
+    auto j = nlohmann::json::parse(r.first, nullptr, false);
+    auto s = js_api_error(j);
+
+    if (s.failed()) {
+        return {0, s};
+    }
+
+    return {j.value("seq", uint64_t(0)), {}};
+}
+
+status kv_bucket::watch(on_kv_update_cb cb, ctx c) {
+    using nlohmann::json;
+
+    if (m_watch_sub != nullptr) {
+        // could be already unknown after reconnect, so result does not matter
+        m_conn->unsubscribe(m_watch_sub, c);
+        m_watch_sub.reset();
+    }
+
+    m_watch_cb = cb;
+    m_synced = false;
+    auto deliver_subject = new_inbox();
+    std::weak_ptr<kv_bucket> weak = shared_from_this();
+    auto r = m_conn->subscribe_headers(
+        deliver_subject, {},
+        [weak](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+               std::size_t n, ctx c) {
+            auto self = weak.lock();
+
+            if (self != nullptr) {
+                self->on_watch_message(subject, reply_to, headers, raw, n, c);
+            }
+        },
+        c);
+
+    if (r.second.failed()) {
+        return r.second;
+    }
+
+    m_watch_sub = r.first;
+    json config = {
+        {"deliver_subject", deliver_subject},
+        {"ack_policy", "none"},
+        {"filter_subject", m_prefix + ">"},
+        {"replay_policy", "instant"},
+    };
+
+    // after reconnect continue from the last seen revision
+    if (m_last_revision > 0) {
+        config["deliver_policy"] = "by_start_sequence";
+        config["opt_start_seq"] = m_last_revision + 1;
+    } else {
+        config["deliver_policy"] = "last_per_subject";
+    }
+
+    json req = {{"stream_name", m_stream}, {"config", config}};
+    auto payload = req.dump();
+    auto resp = m_conn->request("$JS.API.CONSUMER.CREATE." + m_stream, payload.data(), payload.size(), {},
+                                m_conf.timeout, c);
+
+    if (resp.second.failed()) {
+        return resp.second;
+    }
+
+    auto j = json::parse(resp.first, nullptr, false);
+    auto s = js_api_error(j);
+
+    if (s.failed()) {
+        return s;
+    }
+
+    if (j.value("num_pending", uint64_t(0)) == 0) {
+        m_synced = true;
+    }
+
+    return {};
+}
+
+void kv_bucket::on_watch_message(string_view subject, optional<string_view> reply_to, string_view headers,
+                                 const char* raw, std::size_t n, ctx c) {
+    js_ack_info info;
+
+    if (!reply_to.has_value() || !parse_js_ack(reply_to.value(), info) || subject.size() <= m_prefix.size()) {
+        return;
+    }
+
+    kv_entry e;
+    auto key = subject.substr(m_prefix.size());
+    e.key.assign(key.data(), key.size());
+    e.revision = info.stream_seq;
+    e.op = kv_op_from_headers(headers);
+
+    if (e.op == kv_op::put) {
+        e.value.assign(raw, n);
+    }
+
+    m_last_revision = std::max(m_last_revision, e.revision);
+
+    if (info.pending == 0) {
+        m_synced = true;
+    }
+
+    if (m_watch_cb != nullptr) {
+        m_watch_cb(e, c);
+    }
+
+    if (!m_conf.local_cache) {
+        e.value.clear();
+    }
+
+    auto it = m_cache.find(key);
+
+    if (it == m_cache.end()) {
+        m_cache.emplace(e.key, std::move(e));
+    } else {
+        it->second = std::move(e);
+    }
+}
+
+optional<uint64_t> kv_bucket::revision(string_view key) {
+    auto it = m_cache.find(key);
+
+    if (it == m_cache.end()) {
+        return {};
+    }
+
+    return it->second.revision;
+}
+
+ikv_bucket_sptr create_kv_bucket(const iconnection_sptr& conn, const kv_config& conf) {
+    return std::make_shared<kv_bucket>(conn, conf);
+}
+
+int64_t duration_ns(duration d) { return d.total_microseconds() * 1000; }
+
+class ordered_consumer : public iordered_consumer,
+                         public std::enable_shared_from_this<ordered_consumer>,
+                         private boost::asio::detail::noncopyable {
+public:
+    ordered_consumer(aio& io, const iconnection_sptr& conn, const ordered_consumer_config& conf, on_js_message_cb cb);
+
+    virtual ordered_consumer_stats stats() override { return m_stats; }
+
+    virtual status stop(ctx c) override;
+
+    // creates the consumer from the message after the last delivered one
+    status create(ctx c);
+
+    // recreates the consumer on a gap or when heartbeats stop, until stop
+    void monitor(ctx c);
+
+private:
+    void on_message(string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                    std::size_t n, ctx c);
+
+    void on_status(optional<string_view> reply_to, string_view headers, ctx c);
+
+    // drops the current subscription, monitor creates a new consumer at once
+    void request_reset();
+
+    iconnection_sptr m_conn;
+    ordered_consumer_config m_conf;
+    on_js_message_cb m_cb;
+
+    isubscription_sptr m_sub;
+    std::string m_name;
+    uint64_t m_consumer_seq;
+    // messages and heartbeats, monitor looks for it to change between intervals
+    uint64_t m_activity;
+    bool m_reset;
+    bool m_stopped;
+    boost::asio::deadline_timer m_timer;
+
+    ordered_consumer_stats m_stats;
+};
+
+ordered_consumer::ordered_consumer(aio& io, const iconnection_sptr& conn, const ordered_consumer_config& conf,
+                                   on_js_message_cb cb)
+    : m_conn(conn), m_conf(conf), m_cb(std::move(cb)), m_consumer_seq(0), m_activity(0), m_reset(false),
+      m_stopped(false), m_timer(io) {
+    m_stats.stream_seq = conf.start_seq > 0 ? conf.start_seq - 1 : 0;
+}
+
+status ordered_consumer::create(ctx c) {
+    using nlohmann::json;
+
+    if (m_sub != nullptr) {
+        m_sub->cancel();
+        m_sub.reset();
+    }
+
+    auto deliver_subject = new_inbox();
+    using namespace std::placeholders;
+    auto r = m_conn->subscribe_headers(
+        deliver_subject, {}, std::bind(&ordered_consumer::on_message, this, _1, _2, _3, _4, _5, _6), c);
+
+    if (r.second.failed()) {
+        return r.second;
+    }
+
+    m_sub = r.first;
+    m_consumer_seq = 0;
+    json config = {
+        {"deliver_subject", deliver_subject},
+        {"ack_policy", "none"},
+        {"max_deliver", 1},
+        {"flow_control", true},
+        {"idle_heartbeat", duration_ns(m_conf.idle_heartbeat)},
+        {"inactive_threshold", duration_ns(m_conf.inactive_threshold)},
+        {"replay_policy", "instant"},
+        {"mem_storage", true},
+        {"num_replicas", 1},
+    };
+
+    if (!m_conf.filter_subject.empty()) {
+        config["filter_subject"] = m_conf.filter_subject;
+    }
+
+    if (m_stats.stream_seq > 0) {
+        config["deliver_policy"] = "by_start_sequence";
+        config["opt_start_seq"] = m_stats.stream_seq + 1;
+    } else {
+        config["deliver_policy"] = "all";
+    }
+
+    json req = {{"stream_name", m_conf.stream}, {"config", config}};
+    auto payload = req.dump();
+    auto resp = m_conn->request("$JS.API.CONSUMER.CREATE." + m_conf.stream, payload.data(), payload.size(), {},
+                                m_conf.timeout, c);
+    auto j = json::parse(resp.first, nullptr, false);
+    auto s = resp.second.failed() ? resp.second : js_api_error(j);
+
+    if (!s.failed() && m_stopped) {
+        s = status("consumer is stopped");
+    }
+
+    if (s.failed()) {
+        // could be dropped by a gap meanwhile
+        if (m_sub != nullptr) {
+            m_sub->cancel();
+            m_sub.reset();
+        }
+
+        return s;
+    }
+
+    m_name = j.value("name", "");
+    return {};
+}
+
+void ordered_consumer::monitor(ctx c) {
+    uint64_t seen = m_activity;
+    std::size_t idle = 0;
+    // failed create is repeated every interval, e.g. while disconnected
+    bool retry = false;
+
+    while (!m_stopped) {
+        if (!m_reset) {
+            boost::system::error_code ec;
+            m_timer.expires_from_now(m_conf.idle_heartbeat);
+            m_timer.async_wait(c[ec]);
+
+            if (m_stopped) {
+                break;
+            }
+
+            idle = m_activity == seen ? idle + 1 : 0;
+            seen = m_activity;
+
+            if (!retry && idle < m_conf.missed_heartbeats) {
+                continue;
+            }
+
+            if (!retry) {
+                m_stats.stalls++;
+            }
+        }
+
+        // a gap found while creating asks for another reset
+        m_reset = false;
+        m_stats.resets++;
+        retry = create(c).failed();
+        idle = 0;
+        seen = m_activity;
+    }
+}
+
+void ordered_consumer::on_message(string_view subject, optional<string_view> reply_to, string_view headers,
+                                  const char* raw, std::size_t n, ctx c) {
+    m_activity++;
+
+    if (!headers.empty() && headers_status(headers) == 100) {
+        on_status(reply_to, headers, c);
+        return;
+    }
+
+    js_ack_info info;
+
+    if (!reply_to.has_value() || !parse_js_ack(reply_to.value(), info)) {
+        return;
+    }
+
+    if (info.consumer_seq != m_consumer_seq + 1) {
+        m_stats.gaps++;
+        request_reset();
+        return;
+    }
+
+    m_consumer_seq = info.consumer_seq;
+    m_stats.messages++;
+    m_stats.bytes += n;
+    m_stats.stream_seq = info.stream_seq;
+    m_stats.pending = info.pending;
+    js_message m;
+    m.subject = subject;
+    m.headers = headers;
+    m.raw = raw;
+    m.n = n;
+    m.stream_seq = info.stream_seq;
+    m.pending = info.pending;
+    m_cb(m, c);
+}
+
+void ordered_consumer::on_status(optional<string_view> reply_to, string_view headers, ctx c) {
+    // flow control request has a reply subject, a heartbeat names it in Nats-Consumer-Stalled if the reply was lost
+    if (!reply_to.has_value()) {
+        m_stats.heartbeats++;
+        reply_to = find_header(headers, "Nats-Consumer-Stalled");
+        uint64_t last = 0;
+        auto h = find_header(headers, "Nats-Last-Consumer");
+
+        if (h.has_value() && parse_uint(h.value(), last) && last != m_consumer_seq) {
+            m_stats.gaps++;
+            request_reset();
+            return;
+        }
+    }
+
+    if (reply_to.has_value() && !reply_to->empty()) {
+        m_stats.flow_control_replies++;
+        m_conn->publish(reply_to.value(), "", 0, optional<string_view>(), c);
+    }
+}
+
+void ordered_consumer::request_reset() {
+    if (m_sub != nullptr) {
+        m_sub->cancel();
+        m_sub.reset();
+    }
+
+    m_reset = true;
+    m_timer.cancel();
+}
+
+status ordered_consumer::stop(ctx c) {
+    if (m_stopped) {
+        return {};
+    }
+
+    m_stopped = true;
+    m_timer.cancel();
+
+    if (m_sub != nullptr) {
+        m_sub->cancel();
+        m_sub.reset();
+    }
+
+    if (m_name.empty()) {
+        return {};
+    }
+
+    auto resp = m_conn->request("$JS.API.CONSUMER.DELETE." + m_conf.stream + "." + m_name, "", 0, {},
+                                m_conf.timeout, c);
+
+    if (resp.second.failed()) {
+        return resp.second;
+    }
+
+    return js_api_error(nlohmann::json::parse(resp.first, nullptr, false));
+}
+
+std::pair<iordered_consumer_sptr, status> create_ordered_consumer(aio& io, const iconnection_sptr& conn,
+                                                                  const ordered_consumer_config& conf,
+                                                                  on_js_message_cb cb, ctx c) {
+    if (conf.stream.empty()) {
+        return {nullptr, status("stream is required")};
+    }
+
+    if (conf.idle_heartbeat.total_milliseconds() <= 0 || conf.missed_heartbeats == 0) {
+        return {nullptr, status("idle heartbeat is required")};
+    }
+
+    auto consumer = std::make_shared<ordered_consumer>(io, conn, conf, std::move(cb));
+    auto s = consumer->create(c);
+
+    if (s.failed()) {
+        return {nullptr, s};
+    }
+
+    boost::asio::spawn(io, std::bind(&ordered_consumer::monitor, consumer, std::placeholders::_1));
+    return {consumer, {}};
+}
+
+constexpr auto chunk_header = "Nats-Asio-Chunk";
+constexpr auto chunk_size_header = "Nats-Asio-Chunk-Size";
+
+// room for HPUB headers left in every part
+constexpr std::size_t chunk_header_room = 128;
+
+// publishes parts of one object
+class chunk_writer {
+public:
+    chunk_writer(iconnection& conn, string_view subject)
+        : m_conn(conn), m_subject(subject), m_id(random_token(22)), m_seq(0), m_size(0) {}
+
+    // part size which fits max_payload together with headers
+    std::pair<std::size_t, status> part_size() {
+        auto max = m_conn.max_payload();
+
+        if (max <= chunk_header_room) {
+            return {0, status("max_payload is unknown, not connected")};
+        }
+
+        return {max - chunk_header_room, {}};
+    }
+
+    status write(const char* raw, std::size_t n, bool last, ctx c) {
+        auto chunk = fmt::format("{} {}", m_id, m_seq++);
+        std::string size;
+        headers_t headers{{chunk_header, chunk}};
+        m_size += n;
+
+        if (last) {
+            size = std::to_string(m_size);
+            headers.emplace_back(chunk_size_header, size);
+        }
+
+        return m_conn.publish(m_subject, raw, n, headers, {}, c);
+    }
+
+private:
+    iconnection& m_conn;
+    string_view m_subject;
+    std::string m_id;
+    uint64_t m_seq;
+    uint64_t m_size;
+};
+
+status publish_chunked(iconnection& conn, string_view subject, const char* raw, std::size_t n, ctx c) {
+    chunk_writer w(conn, subject);
+    auto part = w.part_size();
+
+    if (part.second.failed()) {
+        return part.second;
+    }
+
+    std::size_t offset = 0;
+
+    do {
+        auto k = std::min(part.first, n - offset);
+        auto s = w.write(raw + offset, k, offset + k == n, c);
+
+        if (s.failed()) {
+            return s;
+        }
+
+        offset += k;
+    } while (offset < n);
+
+    return {};
+}
+
+status publish_chunked(iconnection& conn, string_view subject, const chunk_source& source, ctx c) {
+    chunk_writer w(conn, subject);
+    auto part = w.part_size();
+
+    if (part.second.failed()) {
+        return part.second;
+    }
+
+    auto fill = [&source](std::vector<char>& buf) {
+        std::size_t got = 0;
+
+        while (got < buf.size()) {
+            auto k = source(buf.data() + got, buf.size() - got);
+
+            if (k == 0) {
+                break;
+            }
+
+            got += k;
+        }
+
+        return got;
+    };
+
+    // the next part is read ahead to know if the current one is the last
+    std::vector<char> current(part.first), next(part.first);
+    auto current_n = fill(current);
+
+    for (;;) {
+        auto next_n = current_n == current.size() ? fill(next) : 0;
+        auto s = w.write(current.data(), current_n, next_n == 0, c);
+
+        if (s.failed() || next_n == 0) {
+            return s;
+        }
+
+        std::swap(current, next);
+        current_n = next_n;
+    }
+}
+
+// reassembles objects, or hands their parts to chunk_cb as they come when it is set
+class chunk_assembler {
+public:
+    chunk_assembler(const on_message_cb& object_cb, const on_chunk_cb& chunk_cb, std::size_t max_object_size)
+        : m_object_cb(object_cb), m_chunk_cb(chunk_cb), m_max_object_size(max_object_size) {}
+
+    void on_message(string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                    std::size_t n, ctx c);
+
+private:
+    struct transfer {
+        std::string subject;
+        std::string id;
+        uint64_t next_seq;
+        uint64_t size;
+        pmr_vector<char> data;
+    };
+
+    // unfinished objects of publishers which went away are dropped oldest first
+    static constexpr std::size_t max_transfers = 64;
+
+    void drop(std::vector<transfer>::iterator it) {
+        m_buffers.give(std::move(it->data));
+        m_transfers.erase(it);
+    }
+
+    // chunk_cb learns that no more parts come of an object it got parts of
+    void abort(std::vector<transfer>::iterator it, ctx c) {
+        if (m_chunk_cb != nullptr && it->next_seq > 0) {
+            m_chunk_cb(it->subject, it->id, it->size, nullptr, 0, chunk_state::dropped, c);
+        }
+
+        drop(it);
+    }
+
+    on_message_cb m_object_cb;
+    on_chunk_cb m_chunk_cb;
+    std::size_t m_max_object_size;
+    std::vector<transfer> m_transfers;
+    buffer_pool m_buffers;
+};
+
+void chunk_assembler::on_message(string_view subject, optional<string_view> reply_to, string_view headers,
+                                 const char* raw, std::size_t n, ctx c) {
+    auto chunk = find_header(headers, chunk_header);
+
+    if (!chunk.has_value()) {
+        if (m_chunk_cb != nullptr) {
+            m_chunk_cb(subject, string_view(), 0, raw, n, chunk_state::last, c);
+        } else {
+            m_object_cb(subject, reply_to, raw, n, c);
+        }
+
+        return;
+    }
+
+    auto value = chunk.value();
+    auto space = value.rfind(' ');
+    uint64_t seq = 0;
+
+    if (space == string_view::npos || !parse_uint(value.substr(space + 1), seq)) {
+        return;
+    }
+
+    auto id = value.substr(0, space);
+    auto it = std::find_if(m_transfers.begin(), m_transfers.end(), [id](const transfer& t) { return t.id == id; });
+
+    if (seq == 0) {
+        if (it != m_transfers.end()) {
+            abort(it, c);
+        }
+
+        if (m_transfers.size() >= max_transfers) {
+            abort(m_transfers.begin(), c);
+        }
+
+        m_transfers.push_back(transfer{std::string(subject.data(), subject.size()), std::string(id.data(), id.size()),
+                                       0, 0, m_buffers.take()});
+        it = std::prev(m_transfers.end());
+    } else if (it == m_transfers.end() || it->next_seq != seq) {
+        // a part is missing, the object can't be complete
+        if (it != m_transfers.end()) {
+            abort(it, c);
+        }
+
+        return;
+    }
+
+    auto offset = it->size;
+    auto size = find_header(headers, chunk_size_header);
+    auto last = size.has_value();
+    uint64_t total = 0;
+
+    if (offset + n > m_max_object_size || (last && (!parse_uint(size.value(), total) || total != offset + n))) {
+        abort(it, c);
+        return;
+    }
+
+    it->next_seq++;
+    it->size += n;
+
+    if (m_chunk_cb != nullptr) {
+        m_chunk_cb(subject, id, offset, raw, n, last ? chunk_state::last : chunk_state::part, c);
+    } else {
+        it->data.insert(it->data.end(), raw, raw + n);
+
+        if (last) {
+            m_object_cb(subject, reply_to, it->data.data(), it->data.size(), c);
+        }
+    }
+
+    if (last) {
+        drop(it);
+    }
+}
+
+std::pair<isubscription_sptr, status> subscribe_chunked(iconnection& conn, string_view subject, on_message_cb cb,
+                                                        ctx c, std::size_t max_object_size) {
+    auto assembler = std::make_shared<chunk_assembler>(cb, nullptr, max_object_size);
+    return conn.subscribe_headers(
+        subject, {},
+        [assembler](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                    std::size_t n, ctx c) { assembler->on_message(subject, reply_to, headers, raw, n, c); },
+        c);
+}
+
+std::pair<isubscription_sptr, status> subscribe_chunks(iconnection& conn, string_view subject, on_chunk_cb cb,
+                                                       ctx c) {
+    auto assembler = std::make_shared<chunk_assembler>(nullptr, cb, std::numeric_limits<std::size_t>::max());
+    return conn.subscribe_headers(
+        subject, {},
+        [assembler](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                    std::size_t n, ctx c) { assembler->on_message(subject, reply_to, headers, raw, n, c); },
+        c);
+}
+
+constexpr auto envelope_header = "Nats-Asio-Envelope";
+
+// room for HPUB headers left in an envelope
+constexpr std::size_t envelope_header_room = 64;
+
+// 7 bits per byte, high bit is set on all but the last one
+void append_varint(std::vector<char>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+
+    out.push_back(static_cast<char>(v));
+}
+
+std::size_t varint_size(uint64_t v) {
+    std::size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+bool read_varint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+
+    for (int shift = 0; p != end && shift < 64; shift += 7) {
+        auto b = static_cast<unsigned char>(*p++);
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+class envelope_publisher : public ienvelope_publisher,
+                           public std::enable_shared_from_this<envelope_publisher>,
+                           private boost::asio::detail::noncopyable {
+public:
+    envelope_publisher(aio& io, const iconnection_sptr& conn, string_view subject, const envelope_config& conf)
+        : m_io(io), m_conn(conn), m_subject(subject.data(), subject.size()), m_conf(conf), m_count(0),
+          m_timer(io), m_timer_armed(false) {
+        m_buf.reserve(conf.max_bytes);
+    }
+
+    virtual status publish(const char* raw, std::size_t n, ctx c) override;
+
+    virtual status flush(ctx c) override;
+
+    virtual envelope_stats stats() override { return m_stats; }
+
+private:
+    std::size_t max_size() {
+        auto max = m_conn->max_payload();
+
+        if (max > envelope_header_room) {
+            return std::min(m_conf.max_bytes, max - envelope_header_room);
+        }
+
+        return m_conf.max_bytes;
+    }
+
+    // flushes from io after max_delay, envelopes filled meanwhile only make it come earlier
+    void arm_timer();
+
+    aio& m_io;
+    iconnection_sptr m_conn;
+    std::string m_subject;
+    envelope_config m_conf;
+
+    std::vector<char> m_buf;
+    std::size_t m_count;
+    // buffer of the last published envelope, empty while it is being published
+    std::vector<char> m_spare;
+
+    boost::asio::deadline_timer m_timer;
+    bool m_timer_armed;
+
+    envelope_stats m_stats;
+};
+
+status envelope_publisher::publish(const char* raw, std::size_t n, ctx c) {
+    auto max = max_size();
+    auto record = varint_size(n) + n;
+
+    if (record > max || m_buf.size() + record > max) {
+        auto s = flush(c);
+
+        if (s.failed()) {
+            return s;
+        }
+    }
+
+    m_stats.messages++;
+
+    if (record > max) {
+        m_stats.unpacked++;
+        return m_conn->publish(m_subject, raw, n, optional<string_view>(), c);
+    }
+
+    append_varint(m_buf, n);
+    m_buf.insert(m_buf.end(), raw, raw + n);
+    m_count++;
+
+    if (m_count >= m_conf.max_messages) {
+        return flush(c);
+    }
+
+    if (m_count == 1) {
+        arm_timer();
+    }
+
+    return {};
+}
+
+status envelope_publisher::flush(ctx c) {
+    if (m_count == 0) {
+        return {};
+    }
+
+    // publish can wait for space, messages coming meanwhile go to the spare buffer
+    std::vector<char> buf;
+    buf.swap(m_spare);
+    buf.swap(m_buf);
+    m_buf.clear();
+    // headers view it while publish waits, a timer flush meanwhile must not change it
+    auto count = std::to_string(m_count);
+    m_count = 0;
+    headers_t headers{{envelope_header, count}};
+    auto s = m_conn->publish(m_subject, buf.data(), buf.size(), headers, {}, c);
+
+    if (!s.failed()) {
+        m_stats.envelopes++;
+    }
+
+    buf.clear();
+
+    if (m_spare.capacity() < buf.capacity()) {
+        m_spare.swap(buf);
+    }
+
+    return s;
+}
+
+void envelope_publisher::arm_timer() {
+    if (m_timer_armed) {
+        return;
+    }
+
+    m_timer_armed = true;
+    auto self = shared_from_this();
+    boost::asio::spawn(m_io, [self](ctx c) {
+        boost::system::error_code ec;
+        self->m_timer.expires_from_now(self->m_conf.max_delay);
+        self->m_timer.async_wait(c[ec]);
+        self->m_timer_armed = false;
+        self->flush(c);
+    });
+}
+
+std::pair<ienvelope_publisher_sptr, status> create_envelope_publisher(aio& io, const iconnection_sptr& conn,
+                                                                      string_view subject,
+                                                                      const envelope_config& conf) {
+    auto s = check_subject(subject, false);
+
+    if (s.failed()) {
+        return {nullptr, s};
+    }
+
+    if (conf.max_bytes <= 1 || conf.max_messages == 0) {
+        return {nullptr, status("envelope limits are too small")};
+    }
+
+    return {std::make_shared<envelope_publisher>(io, conn, subject, conf), {}};
+}
+
+std::pair<isubscription_sptr, status> subscribe_envelopes(iconnection& conn, string_view subject,
+                                                          optional<string_view> queue, on_message_cb cb, ctx c) {
+    return conn.subscribe_headers(
+        subject, queue,
+        [cb](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+             std::size_t n, ctx c) {
+            if (headers.empty() || !find_header(headers, envelope_header).has_value()) {
+                cb(subject, reply_to, raw, n, c);
+                return;
+            }
+
+            auto end = raw + n;
+            uint64_t size = 0;
+
+            // a broken record drops the rest of the envelope
+            while (raw != end && read_varint(raw, end, size) && size <= static_cast<uint64_t>(end - raw)) {
+                cb(subject, reply_to, raw, static_cast<std::size_t>(size), c);
+                raw += size;
+            }
+        },
+        c);
+}
+
+constexpr auto service_error_header = "Nats-Service-Error";
+constexpr auto service_error_code_header = "Nats-Service-Error-Code";
+
+constexpr std::size_t service_histogram_buckets = 24;
+
+struct service_endpoint : private boost::asio::detail::noncopyable {
+    service_endpoint(const service_endpoint_config& conf, on_service_request_cb cb)
+        : conf(conf), cb(std::move(cb)), requests(0), errors(0), processing_ns(0) {
+        if (this->conf.subject.empty()) {
+            this->conf.subject = this->conf.name;
+        }
+
+        for (auto& bucket : histogram) {
+            bucket = 0;
+        }
+    }
+
+    // called from connection and worker threads
+    void record(std::chrono::steady_clock::duration took, const optional<std::string>& error) {
+        auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(took).count());
+        auto us = ns / 1000;
+        std::size_t bucket = 0;
+
+        while (us > 0 && bucket + 1 < service_histogram_buckets) {
+            us >>= 1;
+            bucket++;
+        }
+
+        requests++;
+        processing_ns += ns;
+        histogram[bucket]++;
+
+        if (error.has_value()) {
+            errors++;
+            std::lock_guard<std::mutex> lock(last_error_mutex);
+            last_error = error.value();
+        }
+    }
 
-iconnection_sptr create_connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-                                   const on_disconnected_cb& disconnected_cb, optional<ssl_config> ssl_conf) {
-    if (ssl_conf.has_value()) {
-        auto ssl_ctx = std::make_shared<ssl::context>(ssl::context::tlsv12_client);
-        load_certificates(ssl_conf.value(), *ssl_ctx);
-        return std::make_shared<connection<ssl_socket>>(io, log, connected_cb, disconnected_cb, ssl_ctx);
-    } else {
-        return std::make_shared<connection<raw_socket>>(io, log, connected_cb, disconnected_cb);
+    service_endpoint_stats stats() {
+        service_endpoint_stats st;
+        st.name = conf.name;
+        st.subject = conf.subject;
+        st.queue_group = conf.queue_group;
+        st.requests = requests;
+        st.errors = errors;
+        st.processing_ns = processing_ns;
+
+        for (auto& bucket : histogram) {
+            st.histogram.push_back(bucket);
+        }
+
+        std::lock_guard<std::mutex> lock(last_error_mutex);
+        st.last_error = last_error;
+        return st;
     }
-}
 
-template <class SocketType>
-connection<SocketType>::connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-                                   const on_disconnected_cb& disconnected_cb, const std::shared_ptr<ssl::context>& ctx)
-    : m_sid(0), m_max_payload(0), m_log(log), m_io(io), m_is_connected(false), m_stop_flag(false),
-      m_connected_cb(connected_cb), m_disconnected_cb(disconnected_cb), m_ssl_ctx(ctx), m_socket(io, *ctx.get()) {}
+    service_endpoint_config conf;
+    on_service_request_cb cb;
+    isubscription_sptr sub;
 
-template <class SocketType>
-connection<SocketType>::connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-                                   const on_disconnected_cb& disconnected_cb)
-    : m_sid(0), m_max_payload(0), m_log(log), m_io(io), m_is_connected(false), m_stop_flag(false),
-      m_connected_cb(connected_cb), m_disconnected_cb(disconnected_cb), m_socket(io) {}
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> processing_ns;
+    std::array<std::atomic<uint64_t>, service_histogram_buckets> histogram;
 
-template <class SocketType> void connection<SocketType>::start(const connect_config& conf) {
-    boost::asio::spawn(m_io, std::bind(&connection::run, this, conf, std::placeholders::_1));
-}
+    std::mutex last_error_mutex;
+    std::string last_error;
+};
 
-template <class SocketType>
-status connection<SocketType>::publish(string_view subject, const char* raw, std::size_t n,
-                                       optional<string_view> reply_to, ctx c) {
-    if (!m_is_connected) {
-        return status("not connected");
+// request copied for a worker
+struct service_job {
+    std::string subject;
+    std::string reply_to;
+    std::string headers;
+    std::vector<char> payload;
+};
+
+class service : public iservice, private boost::asio::detail::noncopyable {
+public:
+    service(const iconnection_sptr& conn, const service_config& conf);
+
+    virtual ~service() override { stop(); }
+
+    virtual const std::string& id() override { return m_id; }
+
+    virtual status add_endpoint(const service_endpoint_config& conf, on_service_request_cb cb, ctx c) override;
+
+    virtual std::vector<service_endpoint_stats> stats() override;
+
+    virtual void stop() override;
+
+    status start(ctx c);
+
+private:
+    void on_request(service_endpoint& ep, string_view subject, optional<string_view> reply_to, string_view headers,
+                    const char* raw, std::size_t n, ctx c);
+
+    // runs handler and records it, reply is left in req
+    void handle(service_endpoint& ep, service_request& req);
+
+    void on_discovery(string_view verb, optional<string_view> reply_to, ctx c);
+
+    nlohmann::json describe(const char* type);
+
+    iconnection_sptr m_conn;
+    service_config m_conf;
+    std::string m_id;
+    std::string m_started;
+    bool m_stopped;
+
+    std::vector<std::unique_ptr<service_endpoint>> m_endpoints;
+    std::vector<isubscription_sptr> m_discovery;
+
+    std::unique_ptr<boost::asio::thread_pool> m_pool;
+    std::atomic<std::size_t> m_pending;
+};
+
+bool is_valid_service_name(string_view name) {
+    if (name.empty()) {
+        return false;
     }
 
-    const std::string pub_header_payload("PUB {} {} {}\r\n");
-    std::vector<boost::asio::const_buffer> buffers;
-    std::string header;
+    for (auto ch : name) {
+        bool ok = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' ||
+                  ch == '_';
 
-    if (reply_to.has_value()) {
-        header = fmt::format(pub_header_payload, subject, reply_to.value(), n);
-    } else {
-        header = fmt::format(pub_header_payload, subject, "", n);
+        if (!ok) {
+            return false;
+        }
     }
 
-    buffers.emplace_back(boost::asio::buffer(header.data(), header.size()));
-    buffers.emplace_back(boost::asio::buffer(raw, n));
-    buffers.emplace_back(boost::asio::buffer("\r\n", 2));
-    std::size_t total_size = header.size() + n + 2;
-    m_socket.async_write(buffers, boost::asio::transfer_exactly(total_size), c[ec]);
-    return handle_error(c);
+    return true;
 }
 
-template <class SocketType> status connection<SocketType>::unsubscribe(const isubscription_sptr& p, ctx c) {
-    auto sid = p->sid();
-    auto it = m_subs.find(sid);
+headers_t service_reply_headers(const service_request& req, std::string& code) {
+    headers_t headers;
 
-    if (it == m_subs.end()) {
-        return status(fmt::format("subscription not found {}", sid));
+    if (req.error.has_value()) {
+        code = std::to_string(req.error_code);
+        headers.emplace_back(service_error_header, req.error.value());
+        headers.emplace_back(service_error_code_header, code);
     }
-    m_subs.erase(it);
 
-    std::string unsub_payload(fmt::format("UNSUB {}\r\n", sid));
-    m_socket.async_write(boost::asio::buffer(unsub_payload), boost::asio::transfer_exactly(unsub_payload.size()),
-                         c[ec]);
-    return handle_error(c);
+    return headers;
 }
 
-template <class SocketType>
-std::pair<isubscription_sptr, status>
-connection<SocketType>::subscribe(string_view subject, optional<string_view> queue, on_message_cb cb, ctx c) {
-    if (!m_is_connected) {
-        return {isubscription_sptr(), status("not connected")};
+service::service(const iconnection_sptr& conn, const service_config& conf)
+    : m_conn(conn), m_conf(conf), m_id(random_token(22)), m_stopped(false), m_pending(0) {
+    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::tm tm{};
+    char buf[32];
+    gmtime_r(&now, &tm);
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    m_started = buf;
+
+    if (m_conf.workers > 0) {
+        m_pool.reset(new boost::asio::thread_pool(m_conf.workers));
     }
+}
 
-    const std::string sub_payload("SUB {} {} {}\r\n");
-    auto sid = next_sid();
-    std::string payload;
+status service::start(ctx c) {
+    for (auto verb : {"PING", "INFO", "STATS"}) {
+        std::string all = std::string("$SRV.") + verb;
 
-    if (queue.has_value()) {
-        payload = fmt::format(sub_payload, subject, queue.value(), sid);
-    } else {
-        payload = fmt::format(sub_payload, subject, "", sid);
-    }
+        for (auto subject : {all, all + "." + m_conf.name, all + "." + m_conf.name + "." + m_id}) {
+            auto r = m_conn->subscribe(
+                subject, {},
+                [this, verb](string_view, optional<string_view> reply_to, const char*, std::size_t, ctx c) {
+                    on_discovery(verb, reply_to, c);
+                },
+                c);
 
-    m_socket.async_write(boost::asio::buffer(payload), boost::asio::transfer_exactly(payload.size()), c[ec]);
-    auto s = handle_error(c);
+            if (r.second.failed()) {
+                return r.second;
+            }
 
-    if (s.failed()) {
-        return {isubscription_sptr(), s};
+            m_discovery.push_back(r.first);
+        }
     }
 
-    auto sub = std::make_shared<subscription>(sid, cb);
-    m_subs.emplace(sid, sub);
-    return {sub, {}};
+    return {};
 }
 
-template <class SocketType> void connection<SocketType>::on_ping(ctx c) {
-    m_log->trace("ping recived");
-    const std::string pong("PONG\r\n");
-    m_socket.async_write(boost::asio::buffer(pong), boost::asio::transfer_exactly(pong.size()), c[ec]);
-    handle_error(c);
-}
+status service::add_endpoint(const service_endpoint_config& conf, on_service_request_cb cb, ctx c) {
+    if (m_stopped) {
+        return status("service is stopped");
+    }
 
-template <class SocketType> void connection<SocketType>::on_info(string_view info, ctx) {
-    using nlohmann::json;
-    auto j = json::parse(info);
-    m_log->debug("got info {}", j.dump());
-    m_max_payload = j["max_payload"].get<std::size_t>();
-    m_log->trace("info recived and parsed");
-}
+    if (!is_valid_service_name(conf.name)) {
+        return status(fmt::format("invalid endpoint name {}", conf.name));
+    }
 
-template <class SocketType>
-void connection<SocketType>::on_message(string_view subject, string_view sid_str, optional<string_view> reply_to,
-                                        std::size_t n, ctx c) {
-    int bytes_to_transsfer = int(n) + 2 - int(m_buf.size());
+    std::unique_ptr<service_endpoint> ep(new service_endpoint(conf, std::move(cb)));
+    auto raw_ep = ep.get();
+    optional<string_view> queue;
 
-    if (bytes_to_transsfer > 0) {
-        m_socket.async_read(m_buf, boost::asio::transfer_at_least(std::size_t(bytes_to_transsfer)), c[ec]);
+    if (!ep->conf.queue_group.empty()) {
+        queue = ep->conf.queue_group;
     }
 
-    auto s = handle_error(c);
+    auto r = m_conn->subscribe_headers(
+        ep->conf.subject, queue,
+        [this, raw_ep](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                       std::size_t n, ctx c) { on_request(*raw_ep, subject, reply_to, headers, raw, n, c); },
+        c);
 
-    if (s.failed()) {
-        m_log->error("failed to read {}", s.error());
-        return;
+    if (r.second.failed()) {
+        return r.second;
     }
 
-    std::size_t sid_u = 0;
+    ep->sub = r.first;
+    m_endpoints.push_back(std::move(ep));
+    return {};
+}
+
+void service::handle(service_endpoint& ep, service_request& req) {
+    auto started = std::chrono::steady_clock::now();
 
     try {
-        sid_u = static_cast<std::size_t>(std::stoll(sid_str.data(), nullptr, 10));
+        ep.cb(req);
     } catch (const std::exception& e) {
-        m_log->error("can't parse sid: {}", e.what());
-        return;
+        req.response.clear();
+        req.error = std::string(e.what());
+        req.error_code = 500;
     }
 
-    auto it = m_subs.find(sid_u);
+    ep.record(std::chrono::steady_clock::now() - started, req.error);
+}
+
+void service::on_request(service_endpoint& ep, string_view subject, optional<string_view> reply_to,
+                         string_view headers, const char* raw, std::size_t n, ctx c) {
+    if (m_pool == nullptr) {
+        service_request req;
+        req.subject = subject;
+        req.headers = headers;
+        req.raw = raw;
+        req.n = n;
+        handle(ep, req);
+
+        if (reply_to.has_value()) {
+            std::string code;
+            m_conn->publish(reply_to.value(), req.response.data(), req.response.size(),
+                            service_reply_headers(req, code), {}, c);
+        }
 
-    if (it == m_subs.end()) {
-        m_log->trace("dropping message because subscription not found: topic: {}, sid: {}", subject, sid_str);
         return;
     }
 
-    if (it->second->m_cancel) {
-        m_log->trace("subscribtion canceled {}", sid_str);
-        s = unsubscribe(it->second, c);
+    if (m_pending >= m_conf.max_pending_requests) {
+        service_request req;
+        req.error = std::string("too many pending requests");
+        req.error_code = 503;
+        ep.record(std::chrono::steady_clock::duration::zero(), req.error);
 
-        if (s.failed()) {
-            m_log->error("unsubscribe failed: {}", s.error());
+        if (reply_to.has_value()) {
+            std::string code;
+            m_conn->publish(reply_to.value(), nullptr, 0, service_reply_headers(req, code), {}, c);
         }
+
+        return;
     }
 
-    auto b = m_buf.data();
+    auto job = std::make_shared<service_job>();
+    job->subject.assign(subject.data(), subject.size());
+    job->headers.assign(headers.data(), headers.size());
+    job->payload.assign(raw, raw + n);
 
     if (reply_to.has_value()) {
-        it->second->m_cb(subject, reply_to, static_cast<const char*>(b.data()), n, c);
+        job->reply_to.assign(reply_to->data(), reply_to->size());
+    }
+
+    m_pending++;
+    boost::asio::post(*m_pool, [this, &ep, job]() {
+        service_request req;
+        req.subject = job->subject;
+        req.headers = job->headers;
+        req.raw = job->payload.data();
+        req.n = job->payload.size();
+        handle(ep, req);
+
+        // headers are encoded here, the connection thread only moves the ready record to its queue
+        if (!job->reply_to.empty()) {
+            std::string code;
+            m_conn->post_publish(job->reply_to, req.response.data(), req.response.size(),
+                                 service_reply_headers(req, code), {});
+        }
+
+        m_pending--;
+    });
+}
+
+nlohmann::json service::describe(const char* type) {
+    return {{"type", type},
+            {"name", m_conf.name},
+            {"id", m_id},
+            {"version", m_conf.version},
+            {"metadata", nlohmann::json::object()}};
+}
+
+void service::on_discovery(string_view verb, optional<string_view> reply_to, ctx c) {
+    if (!reply_to.has_value()) {
+        return;
+    }
+
+    using nlohmann::json;
+    json j;
+
+    if (verb == "PING") {
+        j = describe("io.nats.micro.v1.ping_response");
+    } else if (verb == "INFO") {
+        j = describe("io.nats.micro.v1.info_response");
+        j["description"] = m_conf.description;
+        j["endpoints"] = json::array();
+
+        for (auto& ep : m_endpoints) {
+            j["endpoints"].push_back({{"name", ep->conf.name},
+                                      {"subject", ep->conf.subject},
+                                      {"queue_group", ep->conf.queue_group},
+                                      {"metadata", json::object()}});
+        }
     } else {
-        it->second->m_cb(subject, {}, static_cast<const char*>(b.data()), n, c);
+        j = describe("io.nats.micro.v1.stats_response");
+        j["started"] = m_started;
+        j["endpoints"] = json::array();
+
+        for (auto& ep : m_endpoints) {
+            auto st = ep->stats();
+            j["endpoints"].push_back({{"name", st.name},
+                                      {"subject", st.subject},
+                                      {"queue_group", st.queue_group},
+                                      {"num_requests", st.requests},
+                                      {"num_errors", st.errors},
+                                      {"last_error", st.last_error},
+                                      {"processing_time", st.processing_ns},
+                                      {"average_processing_time", st.requests > 0 ? st.processing_ns / st.requests : 0},
+                                      {"data", {{"histogram_us_log2", st.histogram}}}});
+        }
     }
+
+    auto payload = j.dump();
+    m_conn->publish(reply_to.value(), payload.data(), payload.size(), {}, c);
 }
 
-template <class SocketType> status connection<SocketType>::do_connect(const connect_config& conf, ctx c) {
-    tcp::resolver res(m_io);
-    auto it = res.async_resolve(tcp::resolver::query(conf.address, std::to_string(conf.port)), c[ec]);
-    auto s = handle_error(c);
+std::vector<service_endpoint_stats> service::stats() {
+    std::vector<service_endpoint_stats> result;
 
-    if (s.failed()) {
-        m_log->error("async resolve of {}:{} failed with error: {}", conf.address, conf.port, s.error());
-        return s;
+    for (auto& ep : m_endpoints) {
+        result.push_back(ep->stats());
     }
 
-    // TODO: how to get end here?
-    m_socket.async_connect((*it).endpoint(), c[ec]);
-    s = handle_error(c);
+    return result;
+}
 
-    if (s.failed()) {
-        return s;
+void service::stop() {
+    if (m_stopped) {
+        return;
     }
 
-    m_socket.async_read_until_raw(m_buf, c[ec]);
-    s = handle_error(c);
+    m_stopped = true;
 
-    if (s.failed()) {
-        m_log->error("read server info failed {}", s.error());
-        return s;
+    for (auto& sub : m_discovery) {
+        sub->cancel();
     }
 
-    std::string header;
-    std::istream is(&m_buf);
-    s = parse_header(header, is, this, c);
+    for (auto& ep : m_endpoints) {
+        ep->sub->cancel();
+    }
 
-    if (s.failed()) {
-        m_log->error("process message failed with error: {}", s.error());
-        return s;
+    if (m_pool != nullptr) {
+        m_pool->join();
+    }
+}
+
+std::pair<iservice_sptr, status> create_service(const iconnection_sptr& conn, const service_config& conf, ctx c) {
+    if (!is_valid_service_name(conf.name)) {
+        return {iservice_sptr(), status(fmt::format("invalid service name {}", conf.name))};
     }
 
-    m_socket.async_handshake(c[ec]);
-    s = handle_error(c);
+    auto srv = std::make_shared<service>(conn, conf);
+    auto s = srv->start(c);
 
     if (s.failed()) {
-        m_log->error("async handshake failed {}", s.error());
-        return s;
+        srv->stop();
+        return {iservice_sptr(), s};
     }
 
-    auto info = prepare_info(conf);
-    m_socket.async_write(boost::asio::buffer(info), boost::asio::transfer_exactly(info.size()), c[ec]);
-    s = handle_error(c);
+    return {srv, {}};
+}
 
-    if (s.failed()) {
-        m_log->error("failed to write info {}", s.error());
-        return s;
+// sums counters, sizes and last values are taken from the newer one
+void add_connection_stats(connection_stats& to, const connection_stats& from) {
+    to.tls_handshakes += from.tls_handshakes;
+    to.tls_resumed_handshakes += from.tls_resumed_handshakes;
+    to.tls_handshake_last_us = from.tls_handshake_last_us;
+    to.tls_handshake_total_us += from.tls_handshake_total_us;
+    to.compressed_messages += from.compressed_messages;
+    to.compression_in_bytes += from.compression_in_bytes;
+    to.compression_out_bytes += from.compression_out_bytes;
+    to.compression_us += from.compression_us;
+    to.decompressed_messages += from.decompressed_messages;
+    to.decompression_us += from.decompression_us;
+    to.posted_messages += from.posted_messages;
+    to.posted_batches += from.posted_batches;
+    to.reads += from.reads;
+    to.read_bytes += from.read_bytes;
+    to.read_size = from.read_size;
+    to.full_reads += from.full_reads;
+    to.messages_received += from.messages_received;
+    to.local_deliveries += from.local_deliveries;
+    to.writes += from.writes;
+    to.written_bytes += from.written_bytes;
+    to.connects += from.connects;
+    to.connect_last_us = from.connect_last_us;
+    to.connect_total_us += from.connect_total_us;
+    to.connect_attempts += from.connect_attempts;
+    to.resolves += from.resolves;
+    to.resolve_cache_hits += from.resolve_cache_hits;
+    to.dedup_unique += from.dedup_unique;
+    to.dedup_exact_hits += from.dedup_exact_hits;
+    to.dedup_filter_hits += from.dedup_filter_hits;
+    to.mode = from.mode;
+    to.spin_cpu = from.spin_cpu;
+    to.spin_polls += from.spin_polls;
+    to.bulk_queue_bytes += from.bulk_queue_bytes;
+    to.bulk_queue_max = std::max(to.bulk_queue_max, from.bulk_queue_max);
+    to.control_queue_bytes += from.control_queue_bytes;
+    to.control_queue_max = std::max(to.control_queue_max, from.control_queue_max);
+    to.control_writes += from.control_writes;
+}
+
+class scaled_subscription : public iscaled_subscription, private boost::asio::detail::noncopyable {
+public:
+    scaled_subscription(const logger& log, string_view subject, string_view queue, on_message_cb cb,
+                        const scaled_config& conf);
+
+    virtual ~scaled_subscription() override { stop(); }
+
+    virtual scaled_stats stats() override;
+
+    virtual void stop() override;
+
+    void start(std::size_t n);
+
+private:
+    // connection with io_context and thread of its own
+    struct member {
+        aio io;
+        iconnection_sptr conn;
+        std::thread thread;
+
+        // read on the member thread, from the last scale check
+        connection_stats last;
+    };
+
+    std::unique_ptr<member> open();
+
+    void close(std::vector<std::unique_ptr<member>> members);
+
+    // fetches stats of every member from its thread
+    void refresh();
+
+    void control();
+
+    logger m_log;
+    std::string m_subject;
+    std::string m_queue;
+    on_message_cb m_cb;
+    scaled_config m_conf;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stopped;
+    std::vector<std::unique_ptr<member>> m_members;
+
+    // stats of closed members
+    connection_stats m_closed;
+    uint64_t m_scale_outs;
+    uint64_t m_scale_ins;
+    std::atomic<uint64_t> m_messages;
+
+    std::thread m_control;
+};
+
+scaled_subscription::scaled_subscription(const logger& log, string_view subject, string_view queue,
+                                         on_message_cb cb, const scaled_config& conf)
+    : m_log(log), m_subject(subject.data(), subject.size()), m_queue(queue.data(), queue.size()),
+      m_cb(std::move(cb)), m_conf(conf), m_stopped(false), m_scale_outs(0), m_scale_ins(0), m_messages(0) {}
+
+void scaled_subscription::start(std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        m_members.push_back(open());
     }
 
-    return {};
+    m_control = std::thread([this]() { control(); });
 }
 
-template <class SocketType> void connection<SocketType>::run(const connect_config& conf, ctx c) {
-    std::string header;
+std::unique_ptr<scaled_subscription::member> scaled_subscription::open() {
+    std::unique_ptr<member> m(new member());
+    auto raw_m = m.get();
+    m->conn = create_connection(
+        m->io, m_log,
+        [this, raw_m](iconnection&, ctx c) {
+            // subscriptions don't survive reconnects
+            auto r = raw_m->conn->subscribe(
+                m_subject, optional<string_view>(m_queue),
+                [this](string_view subject, optional<string_view> reply_to, const char* raw, std::size_t n, ctx c) {
+                    m_messages++;
+                    m_cb(subject, reply_to, raw, n, c);
+                },
+                c);
+
+            if (r.second.failed()) {
+                m_log->error("scaled subscribe to {} failed: {}", m_subject, r.second.error());
+            }
+        },
+        [](iconnection&, ctx) {}, m_conf.ssl);
+    m->conn->start(m_conf.conn);
+    m->thread = std::thread([raw_m]() { raw_m->io.run(); });
+    return m;
+}
 
-    for (;;) {
-        if (m_stop_flag) {
-            m_log->debug("stopping main connection loop");
-            return;
+void scaled_subscription::close(std::vector<std::unique_ptr<member>> members) {
+    for (auto& m : members) {
+        auto raw_m = m.get();
+        boost::asio::post(m->io, [this, raw_m]() {
+            raw_m->conn->drain(m_conf.drain_timeout, [raw_m](status, ctx) {
+                raw_m->last = raw_m->conn->stats();
+                raw_m->io.stop();
+            });
+        });
+    }
+
+    for (auto& m : members) {
+        m->thread.join();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        add_connection_stats(m_closed, m->last);
+    }
+}
+
+void scaled_subscription::refresh() {
+    std::vector<std::pair<member*, std::future<connection_stats>>> pending;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto& m : m_members) {
+            auto promise = std::make_shared<std::promise<connection_stats>>();
+            auto raw_m = m.get();
+            pending.emplace_back(raw_m, promise->get_future());
+            boost::asio::post(m->io, [raw_m, promise]() { promise->set_value(raw_m->conn->stats()); });
         }
+    }
 
-        if (!m_is_connected) {
-            // TODO: make sleep if failed
-            auto s = do_connect(conf, c);
+    // a busy member keeps the stats it had
+    for (auto& p : pending) {
+        if (p.second.wait_for(std::chrono::seconds(1)) == std::future_status::ready) {
+            auto st = p.second.get();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            p.first->last = st;
+        }
+    }
+}
 
-            if (s.failed()) {
-                m_log->error("connect failed with error {}", s.error());
-                continue;
-            }
+void scaled_subscription::control() {
+    auto interval = std::chrono::milliseconds(m_conf.scale_interval.total_milliseconds());
+    uint64_t last_reads = 0;
+    uint64_t last_full_reads = 0;
 
-            m_is_connected = true;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
 
-            if (m_connected_cb != nullptr) {
-                m_connected_cb(*this, c);
+            if (m_wake.wait_for(lock, interval, [this]() { return m_stopped; })) {
+                return;
             }
         }
 
-        m_socket.async_read_until(m_buf, c[ec]);
-        auto s = handle_error(c);
+        refresh();
+        std::vector<std::unique_ptr<member>> removed;
 
-        if (s.failed()) {
-            m_log->error("failed to read {}", s.error());
-            continue;
-        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            uint64_t reads = 0;
+            uint64_t full_reads = 0;
 
-        std::istream is(&m_buf);
-        s = parse_header(header, is, this, c);
+            for (auto& m : m_members) {
+                reads += m->last.reads;
+                full_reads += m->last.full_reads;
+            }
 
-        if (s.failed()) {
-            m_log->error("process message failed with error: {}", s.error());
-            continue;
+            // drained members don't count, so counters can go down
+            auto delta_reads = reads > last_reads ? reads - last_reads : 0;
+            auto delta_full = full_reads > last_full_reads ? full_reads - last_full_reads : 0;
+            auto ratio = delta_reads > 0 ? static_cast<double>(delta_full) / delta_reads : 0.0;
+            last_reads = reads;
+            last_full_reads = full_reads;
+
+            if (ratio > m_conf.scale_out_ratio && m_members.size() < m_conf.max_connections) {
+                m_members.push_back(open());
+                m_scale_outs++;
+                m_log->info("scaled {} out to {} connections, full reads {:.2f}", m_subject, m_members.size(), ratio);
+            } else if (ratio < m_conf.scale_in_ratio && m_members.size() > m_conf.min_connections) {
+                last_reads -= m_members.back()->last.reads;
+                last_full_reads -= m_members.back()->last.full_reads;
+                removed.push_back(std::move(m_members.back()));
+                m_members.pop_back();
+                m_scale_ins++;
+                m_log->info("scaled {} in to {} connections, full reads {:.2f}", m_subject, m_members.size(), ratio);
+            }
         }
+
+        close(std::move(removed));
     }
 }
 
-template <class SocketType> status connection<SocketType>::handle_error(ctx c) {
-    if (ec.failed()) {
-        auto original_msg = ec.message();
-        m_is_connected = false;
-        m_socket.close(ec); // TODO: handle it if error
+scaled_stats scaled_subscription::stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    scaled_stats st;
+    st.connections = m_members.size();
+    st.scale_outs = m_scale_outs;
+    st.scale_ins = m_scale_ins;
+    st.messages = m_messages;
+    st.total = m_closed;
+
+    for (auto& m : m_members) {
+        add_connection_stats(st.total, m->last);
+    }
 
-        if (ec.failed()) {
-            m_log->error("error on socket close {}", ec.message());
-        }
+    return st;
+}
 
-        if (m_disconnected_cb != nullptr) {
-            m_disconnected_cb(*this, std::move(c));
+void scaled_subscription::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_stopped) {
+            return;
         }
 
-        return status(original_msg);
+        m_stopped = true;
     }
 
-    return {};
-}
+    m_wake.notify_all();
 
-template <class SocketType> std::string connection<SocketType>::prepare_info(const connect_config& o) {
-    constexpr auto connect_payload = "CONNECT {}\r\n";
-    constexpr auto name = "nats_asio";
-    constexpr auto lang = "cpp";
-    constexpr auto version = "0.0.1";
-    using nlohmann::json;
-    json j = {
-        {"verbose", o.verbose}, {"pedantic", o.pedantic}, {"name", name}, {"lang", lang}, {"version", version},
-    };
+    if (m_control.joinable()) {
+        m_control.join();
+    }
 
-    if (o.user.has_value()) {
-        j["user"] = o.user.value();
+    std::vector<std::unique_ptr<member>> members;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        members.swap(m_members);
     }
 
-    if (o.password.has_value()) {
-        j["pass"] = o.password.value();
+    close(std::move(members));
+}
+
+std::pair<iscaled_subscription_sptr, status> subscribe_scaled(const logger& log, string_view subject,
+                                                             string_view queue, std::size_t n, on_message_cb cb,
+                                                             const scaled_config& conf) {
+    // without a queue group every connection gets every message
+    if (queue.empty()) {
+        return {iscaled_subscription_sptr(), status("scaled subscription needs a queue group")};
     }
 
-    if (o.token.has_value()) {
-        j["auth_token"] = o.token.value();
+    if (conf.min_connections == 0 || conf.min_connections > conf.max_connections) {
+        return {iscaled_subscription_sptr(), status("invalid connection limits")};
     }
 
-    auto info = j.dump();
-    auto connect_data = fmt::format(connect_payload, info);
-    m_log->debug("sending data on connect {}", info);
-    return connect_data;
+    auto sub = std::make_shared<scaled_subscription>(log, subject, queue, cb, conf);
+    sub->start(std::min(std::max(n, conf.min_connections), conf.max_connections));
+    return {sub, {}};
 }
 
 } // namespace nats_asio
@@ -27,6 +27,7 @@ Software is furnished to do so, subject to the following conditions:
 #include <fmt/format.h>
 #include <spdlog/spdlog.h>
 
+#include <boost/asio/buffer.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -35,25 +36,33 @@ Software is furnished to do so, subject to the following conditions:
 #include <boost/concept/detail/general.hpp>
 
 #if __cplusplus >= 201703L
+#include <memory_resource>
 #include <optional>
 #include <string_view>
 #else
+#include <boost/container/pmr/memory_resource.hpp>
+#include <boost/container/pmr/polymorphic_allocator.hpp>
 #include <boost/optional.hpp>
 #include <boost/utility/string_view.hpp>
 #endif
 
+#include <functional>
 #include <memory>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 namespace nats_asio {
 
 #if __cplusplus >= 201703L
 using std::optional;
 using std::string_view;
+namespace pmr = std::pmr;
 
 #else
 using boost::optional;
 using boost::string_view;
+namespace pmr = boost::container::pmr;
 
 #endif
 
@@ -64,6 +73,32 @@ typedef boost::asio::yield_context ctx;
 typedef std::function<void(string_view subject, optional<string_view> reply_to, const char* raw, std::size_t n, ctx c)>
     on_message_cb;
 
+// headers is the raw header block of HMSG ("NATS/1.0\r\nKey: Value\r\n\r\n"), empty for plain MSG
+typedef std::function<void(string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                           std::size_t n, ctx c)>
+    on_headers_message_cb;
+
+// message of a batch, views point to the connection read buffer and are valid only during the batch callback
+struct message_view {
+    string_view subject;
+    optional<string_view> reply_to;
+    string_view headers;
+    const char* raw;
+    std::size_t n;
+};
+
+// messages of one subscription parsed from a single socket read, in order of arrival
+typedef std::function<void(const message_view* msgs, std::size_t count, ctx c)> on_batch_message_cb;
+
+// header views must stay valid only during the call they are passed to
+typedef std::vector<std::pair<string_view, string_view>> headers_t;
+
+// outbound queue of a connection. payload_writer appends a payload to it and must not wait or publish
+typedef std::vector<char, pmr::polymorphic_allocator<char>> outbound_buffer;
+typedef std::function<void(outbound_buffer& out)> payload_writer;
+
+typedef boost::posix_time::time_duration duration;
+
 } // namespace nats_asio
 
 namespace nats_asio {
@@ -89,12 +124,37 @@ private:
     optional<std::string> m_error;
 };
 
+// returns dedup key of a message, messages with empty key are always delivered
+typedef std::function<string_view(string_view subject, string_view headers, const char* raw, std::size_t n)>
+    dedup_key_fn;
+
+struct dedup_config {
+    // header with message id, used when key is not set
+    std::string header = "Nats-Msg-Id";
+    dedup_key_fn key;
+
+    // a key is remembered for at least window or capacity newer keys, whichever ends first, and at most twice that
+    duration window = boost::posix_time::minutes(2);
+    std::size_t capacity = 64 * 1024;
+
+    // keys older than the last exact_size are checked in a bloom filter, a unique message is dropped as
+    // duplicate with this probability
+    double false_positive_rate = 0.0001;
+    std::size_t exact_size = 256;
+};
+
 struct isubscription {
     virtual ~isubscription() = default;
 
     virtual uint64_t sid() = 0;
 
+    // stops delivery at once and queues UNSUB, messages already on the way are dropped. Can be called from any
+    // thread, off the connection thread UNSUB is queued by a post to its io
     virtual void cancel() = 0;
+
+    // drops messages with keys seen before. Memory is fixed by config, set it before the next yield to check
+    // all messages
+    virtual void dedup(const dedup_config& conf) = 0;
 };
 typedef std::shared_ptr<isubscription> isubscription_sptr;
 
@@ -105,8 +165,30 @@ struct ssl_config {
     std::string ssl_dh;
     bool ssl_required = false;
     bool ssl_verify = true;
+
+    // cache session tickets and resume them on reconnect instead of full handshake
+    bool ssl_session_resumption = true;
+
+    // max size of TLS record on write (512..16384), 0 keeps OpenSSL default
+    std::size_t ssl_max_record_size = 0;
 };
 
+enum class compression { none, lz4, zstd };
+
+// payloads of subjects starting with subject_prefix and not smaller than min_size are published compressed,
+// codecs are available if the library is built with NATS_ASIO_LZ4 and NATS_ASIO_ZSTD
+struct compression_rule {
+    std::string subject_prefix;
+    compression codec = compression::lz4;
+    std::size_t min_size = 1024;
+
+    // codec specific, 0 is a default one
+    int level = 0;
+};
+
+// blocking waits in epoll for socket readiness, spin is io run by a spin runner
+enum class run_mode { blocking, spin };
+
 struct connect_config {
     std::string address;
     uint16_t port;
@@ -117,8 +199,118 @@ struct connect_config {
     optional<std::string> user;
     optional<std::string> password;
     optional<std::string> token;
+
+    // the first matching rule is used. Compressed messages are decoded on receive regardless of the rules
+    std::vector<compression_rule> compression;
+
+    // publish waits while this much data is queued for the socket
+    std::size_t max_pending_bytes = 8 * 1024 * 1024;
+
+    // capacity of post_publish queue in messages, rounded up to a power of two
+    std::size_t post_queue_size = 4096;
+
+    // all resolved addresses are tried, the next one after this delay or as soon as the previous attempts failed
+    duration connect_stagger = boost::posix_time::milliseconds(250);
+    // limit for tcp connect, tls handshake and INFO exchange
+    duration connect_timeout = boost::posix_time::seconds(5);
+    // reconnects reuse resolved addresses this long, a failed connect resolves again
+    duration resolve_cache_ttl = boost::posix_time::seconds(60);
+
+    // SO_BUSY_POLL of the socket in microseconds, reads poll the device queue instead of waiting for an interrupt.
+    // 0 leaves it off, raising it above net.core.busy_read needs CAP_NET_ADMIN
+    int busy_poll_us = 0;
+
+    // publishes are also handed to matching subscriptions of this connection right away, and the server is asked
+    // not to echo them (CONNECT echo:false). Callbacks run inside publish, payload isn't copied. Queue
+    // subscriptions don't get own messages, the server gives them to members on other connections
+    bool local_delivery = false;
+
+    // protocol bytes read and written are appended to this file with time offsets, empty disables recording.
+    // TLS connections record plain text
+    std::string capture_path;
+};
+
+struct replay_config {
+    std::string capture_path;
+
+    // false replays as fast as the connection reads
+    bool original_timing = false;
+};
+
+struct connection_stats {
+    uint64_t tls_handshakes = 0;
+    uint64_t tls_resumed_handshakes = 0;
+    uint64_t tls_handshake_last_us = 0;
+    uint64_t tls_handshake_total_us = 0;
+
+    // compression ratio is compression_in_bytes / compression_out_bytes
+    uint64_t compressed_messages = 0;
+    uint64_t compression_in_bytes = 0;
+    uint64_t compression_out_bytes = 0;
+    uint64_t compression_us = 0;
+    uint64_t decompressed_messages = 0;
+    uint64_t decompression_us = 0;
+
+    // messages taken from post_publish queue and wakeups it took
+    uint64_t posted_messages = 0;
+    uint64_t posted_batches = 0;
+
+    // reads / messages_received is socket reads per message, read_bytes / reads is bytes per read.
+    // read_size is the current read size, it grows when reads fill it and shrinks when they don't. Full reads left
+    // more data in the socket, full_reads / reads is how much the reader is behind
+    uint64_t reads = 0;
+    uint64_t read_bytes = 0;
+    uint64_t read_size = 0;
+    uint64_t full_reads = 0;
+    uint64_t messages_received = 0;
+    // own publishes delivered with local_delivery, not included in messages_received
+    uint64_t local_deliveries = 0;
+    uint64_t writes = 0;
+    uint64_t written_bytes = 0;
+
+    // outbound lanes, bytes queued now and the most taken by the writer at once. Control frames (SUB, UNSUB,
+    // PONG) are written ahead of queued publishes at frame ends, control_writes counts such writes. They can't
+    // overtake bytes already written to the kernel socket buffer
+    uint64_t bulk_queue_bytes = 0;
+    uint64_t bulk_queue_max = 0;
+    uint64_t control_queue_bytes = 0;
+    uint64_t control_queue_max = 0;
+    uint64_t control_writes = 0;
+
+    // time to connected is from start or from losing the connection until CONNECT is sent, failed attempts included
+    uint64_t connects = 0;
+    uint64_t connect_last_us = 0;
+    uint64_t connect_total_us = 0;
+    // tcp connects started, endpoints are raced so there can be several per connect
+    uint64_t connect_attempts = 0;
+    uint64_t resolves = 0;
+    uint64_t resolve_cache_hits = 0;
+
+    // messages passed by dedup and dropped because of a key in the exact ring or in the filter only. The latter
+    // includes false positives, expected at most dedup_unique * false_positive_rate
+    uint64_t dedup_unique = 0;
+    uint64_t dedup_exact_hits = 0;
+    uint64_t dedup_filter_hits = 0;
+
+    // spin_polls counts polls of io by the spin runner, empty ones included. spin_cpu is -1 when it isn't pinned
+    run_mode mode = run_mode::blocking;
+    int spin_cpu = -1;
+    uint64_t spin_polls = 0;
 };
 
+// publisher of one subject with protocol prefix encoded once
+struct ipublisher {
+    virtual ~ipublisher() = default;
+
+    virtual status publish(const char* raw, std::size_t n, ctx c) = 0;
+
+    // payload is a concatenation of parts, they are still copied to the outbound queue
+    virtual status publish(const boost::asio::const_buffer* parts, std::size_t count, ctx c) = 0;
+};
+typedef std::shared_ptr<ipublisher> ipublisher_sptr;
+
+typedef std::function<void(status s, ctx c)> on_drained_cb;
+
 struct iconnection {
     virtual ~iconnection() = default;
 
@@ -126,22 +318,391 @@ struct iconnection {
 
     virtual void stop() = 0;
 
+    // sends UNSUB for all subscriptions in one write, keeps delivering messages already on the way, flushes queued
+    // publishes and confirms them with PING/PONG, then closes. cb gets an error if it takes longer than timeout,
+    // the connection is closed anyway
+    virtual void drain(duration timeout, on_drained_cb cb) = 0;
+
     virtual bool is_connected() = 0;
 
+    virtual connection_stats stats() = 0;
+
+    // max_payload from server INFO, 0 before the first connect. Bigger publishes fail
+    virtual std::size_t max_payload() = 0;
+
+    // publishes and subscriptions are queued and written to the socket by the connection, so a returned status
+    // reports only errors known at the moment of call. Write errors come as disconnect
     virtual status publish(string_view subject, const char* raw, std::size_t n, optional<string_view> reply_to,
                            ctx c) = 0;
 
+    // payload is a concatenation of parts. They are still copied to the outbound queue one by one, only the
+    // joining copy is saved
+    virtual status publish(string_view subject, const boost::asio::const_buffer* parts, std::size_t count,
+                           optional<string_view> reply_to, ctx c) = 0;
+
+    virtual status publish(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                           optional<string_view> reply_to, ctx c) = 0;
+
+    // write appends the payload right after the queued PUB prefix, its size is filled in after. With a compression
+    // rule for subject or a local subscriber it is written to a pooled buffer and published from there
+    virtual status publish_encoded(string_view subject, optional<string_view> reply_to, const payload_writer& write,
+                                   ctx c) = 0;
+
+    // can be called from any thread after start. Message is copied to a bounded queue, connection thread takes
+    // all queued messages on one wakeup. Fails if the queue is full, messages wait in it while disconnected
+    virtual status post_publish(string_view subject, const char* raw, std::size_t n,
+                                optional<string_view> reply_to) = 0;
+
+    virtual status post_publish(string_view subject, const char* raw, std::size_t n, const headers_t& headers,
+                                optional<string_view> reply_to) = 0;
+
     virtual status unsubscribe(const isubscription_sptr& p, ctx c) = 0;
 
+    // checks subject and reply_to once, so publishing through the handle only appends payload size and payload
+    virtual std::pair<ipublisher_sptr, status> make_publisher(string_view subject, optional<string_view> reply_to) = 0;
+
+    // non zero max_messages is sent as `UNSUB sid max`, the server unsubscribes after delivering that many
     virtual std::pair<isubscription_sptr, status> subscribe(string_view subject, optional<string_view> queue,
-                                                            on_message_cb cb, ctx c) = 0;
+                                                            on_message_cb cb, ctx c, uint64_t max_messages = 0) = 0;
+
+    virtual std::pair<isubscription_sptr, status> subscribe_headers(string_view subject, optional<string_view> queue,
+                                                                    on_headers_message_cb cb, ctx c,
+                                                                    uint64_t max_messages = 0) = 0;
+
+    // messages are collected while the read buffer has complete frames and delivered before the next socket read
+    virtual std::pair<isubscription_sptr, status> subscribe_batch(string_view subject, optional<string_view> queue,
+                                                                  on_batch_message_cb cb, ctx c,
+                                                                  uint64_t max_messages = 0) = 0;
+
+    // publishes with a reply subject from the shared connection inbox and waits for the first reply.
+    // Replies are read by the connection loop, so it can't be called from connection and message callbacks
+    virtual std::pair<std::string, status> request(string_view subject, const char* raw, std::size_t n,
+                                                   const headers_t& headers, duration timeout, ctx c) = 0;
 };
 typedef std::shared_ptr<iconnection> iconnection_sptr;
 
 typedef std::function<void(iconnection&, ctx)> on_connected_cb;
 typedef std::function<void(iconnection&, ctx)> on_disconnected_cb;
 
+// connection, subscriptions and publishers are allocated from resource, it must outlive all of them.
+// Buffers and tables of the connection come from a pool on top of it. nullptr is the default resource
 iconnection_sptr create_connection(aio& io, const logger& log, const on_connected_cb& connected_cb,
-                                   const on_disconnected_cb& disconnected_cb, optional<ssl_config> ssl_conf);
+                                   const on_disconnected_cb& disconnected_cb, optional<ssl_config> ssl_conf,
+                                   pmr::memory_resource* resource = nullptr);
+
+// connection reading server bytes of a capture instead of a socket, writes are dropped. Recorded messages go to
+// subscriptions with the same sid, so subscribe in the same order as the recorded run did. Address of the config
+// given to start is not used. Connection stops at the end of capture after disconnected_cb
+std::pair<iconnection_sptr, status> create_replay_connection(aio& io, const logger& log, const replay_config& conf,
+                                                             const on_connected_cb& connected_cb,
+                                                             const on_disconnected_cb& disconnected_cb);
+
+// thread polling io without ever sleeping, so socket readiness and posted publishes are seen without a wakeup.
+// Runs until io is out of work or stop is called, io must not be run anywhere else meanwhile. Open connections
+// and services waiting on io (io_uring completions, timers) keep it spinning until stop
+struct ispin_runner {
+    virtual ~ispin_runner() = default;
+
+    virtual void stop() = 0;
+
+    // destructor stops and joins too
+    virtual void join() = 0;
+};
+typedef std::shared_ptr<ispin_runner> ispin_runner_sptr;
+
+// thread is pinned to cpu unless it is -1. Connections on io report run_mode::spin while it runs
+ispin_runner_sptr create_spin_runner(aio& io, int cpu = -1);
+
+struct scaled_config {
+    connect_config conn;
+    optional<ssl_config> ssl;
+
+    std::size_t min_connections = 1;
+    std::size_t max_connections = 8;
+
+    // every interval a connection is added when full_reads / reads of all connections is above scale_out_ratio
+    // and the last one is drained when it is below scale_in_ratio
+    duration scale_interval = boost::posix_time::seconds(1);
+    double scale_out_ratio = 0.5;
+    double scale_in_ratio = 0.01;
+
+    // limit for draining a removed connection
+    duration drain_timeout = boost::posix_time::seconds(5);
+};
+
+struct scaled_stats {
+    std::size_t connections = 0;
+    uint64_t scale_outs = 0;
+    uint64_t scale_ins = 0;
+    uint64_t messages = 0;
+
+    // counters summed over connections as of the last scale check, drained ones included
+    connection_stats total;
+};
+
+// one subscription spread over several connections in a queue group
+struct iscaled_subscription {
+    virtual ~iscaled_subscription() = default;
+
+    virtual scaled_stats stats() = 0;
+
+    // drains all connections and joins their threads
+    virtual void stop() = 0;
+};
+typedef std::shared_ptr<iscaled_subscription> iscaled_subscription_sptr;
+
+// opens n connections, each with its own io_context and thread, subscribed to subject in queue group so the
+// server spreads messages over them. cb is called from all of these threads at once. The number of connections
+// follows the backlog between min_connections and max_connections
+std::pair<iscaled_subscription_sptr, status> subscribe_scaled(const logger& log, string_view subject,
+                                                             string_view queue, std::size_t n, on_message_cb cb,
+                                                             const scaled_config& conf);
+
+// returns value of the header `key` from a raw header block
+optional<string_view> find_header(string_view headers, string_view key);
+
+enum class kv_op { put, del, purge };
+
+struct kv_entry {
+    std::string key;
+    std::string value;
+    uint64_t revision = 0;
+    kv_op op = kv_op::put;
+};
+
+typedef std::function<void(const kv_entry& e, ctx c)> on_kv_update_cb;
+
+struct kv_config {
+    std::string bucket;
+
+    // keep materialized copy of the bucket, filled and updated by watch
+    bool local_cache = false;
+
+    duration timeout = boost::posix_time::seconds(5);
+};
+
+struct ikv_bucket {
+    virtual ~ikv_bucket() = default;
+
+    // served from local cache without network round trip after initial watch sync
+    virtual std::pair<optional<kv_entry>, status> get(string_view key, ctx c) = 0;
+
+    // returns revision of written value
+    virtual std::pair<uint64_t, status> put(string_view key, const char* raw, std::size_t n, ctx c) = 0;
+
+    // put which succeeds only if last revision of the key is `last_revision`
+    virtual std::pair<uint64_t, status> update(string_view key, const char* raw, std::size_t n, uint64_t last_revision,
+                                               ctx c) = 0;
+
+    virtual std::pair<uint64_t, status> del(string_view key, ctx c) = 0;
+
+    // starts watch of all keys, should be called again after reconnect (not from the callbacks, see request)
+    virtual status watch(on_kv_update_cb cb, ctx c) = 0;
+
+    // last revision of the key seen by watch
+    virtual optional<uint64_t> revision(string_view key) = 0;
+};
+typedef std::shared_ptr<ikv_bucket> ikv_bucket_sptr;
+
+ikv_bucket_sptr create_kv_bucket(const iconnection_sptr& conn, const kv_config& conf);
+
+// stream message delivered by an ordered consumer, views are valid during the callback
+struct js_message {
+    string_view subject;
+    string_view headers;
+    const char* raw = nullptr;
+    std::size_t n = 0;
+    uint64_t stream_seq = 0;
+    // messages left in the stream when this one was sent
+    uint64_t pending = 0;
+};
+
+typedef std::function<void(const js_message& m, ctx c)> on_js_message_cb;
+
+struct ordered_consumer_config {
+    std::string stream;
+    // all subjects of the stream when empty
+    std::string filter_subject;
+    // 0 starts from the first message of the stream
+    uint64_t start_seq = 0;
+
+    // server sends a heartbeat when there is nothing to deliver for this long. The consumer is recreated after
+    // missed_heartbeats intervals without messages or heartbeats
+    duration idle_heartbeat = boost::posix_time::seconds(5);
+    std::size_t missed_heartbeats = 2;
+
+    // consumers left behind by a reset or a lost connection are removed by the server after this
+    duration inactive_threshold = boost::posix_time::minutes(5);
+
+    duration timeout = boost::posix_time::seconds(5);
+};
+
+struct ordered_consumer_stats {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    // stream sequence of the last delivered message
+    uint64_t stream_seq = 0;
+    uint64_t pending = 0;
+    uint64_t heartbeats = 0;
+    uint64_t flow_control_replies = 0;
+    // consumer sequence jumps and heartbeats reporting an unseen message
+    uint64_t gaps = 0;
+    uint64_t stalls = 0;
+    uint64_t resets = 0;
+};
+
+struct iordered_consumer {
+    virtual ~iordered_consumer() = default;
+
+    virtual ordered_consumer_stats stats() = 0;
+
+    // unsubscribes and deletes the consumer, can't be called from callbacks (see request)
+    virtual status stop(ctx c) = 0;
+};
+typedef std::shared_ptr<iordered_consumer> iordered_consumer_sptr;
+
+// ephemeral push consumer delivering the stream in order with flow control and without acks. Flow control
+// requests are answered from the message callback. On a sequence gap or missed heartbeats a new consumer is
+// created from the message after the last delivered one, which also resumes delivery after reconnect. Runs on io
+// until stop
+std::pair<iordered_consumer_sptr, status> create_ordered_consumer(aio& io, const iconnection_sptr& conn,
+                                                                  const ordered_consumer_config& conf,
+                                                                  on_js_message_cb cb, ctx c);
+
+// reads up to n bytes of an object to raw and returns how many were read, 0 at the end
+typedef std::function<std::size_t(char* raw, std::size_t n)> chunk_source;
+
+// dropped comes once without data when a part of an object after offset is missing, no more parts of it follow
+enum class chunk_state { part, last, dropped };
+
+// part of an object at offset
+typedef std::function<void(string_view subject, string_view transfer_id, uint64_t offset, const char* raw,
+                           std::size_t n, chunk_state state, ctx c)>
+    on_chunk_cb;
+
+// publishes an object of any size as messages which fit server max_payload. Each part has header
+// `Nats-Asio-Chunk: <transfer id> <index>`, the last one also `Nats-Asio-Chunk-Size: <object size>`.
+// Parts go through the outbound queue, so it waits for space as publish does
+status publish_chunked(iconnection& conn, string_view subject, const char* raw, std::size_t n, ctx c);
+
+// reads the object from source, two parts of it are in memory at a time
+status publish_chunked(iconnection& conn, string_view subject, const chunk_source& source, ctx c);
+
+// delivers reassembled objects, their parts are collected in pooled buffers. Objects with a missing part or bigger
+// than max_object_size are dropped, messages without chunk header are delivered as they are.
+// All parts of an object must go to one subscriber, so there is no queue group
+std::pair<isubscription_sptr, status> subscribe_chunked(iconnection& conn, string_view subject, on_message_cb cb,
+                                                        ctx c, std::size_t max_object_size = std::size_t(1) << 30);
+
+// hands parts to cb as they come without keeping the object. An object cb got parts of and which can't be completed
+// ends with chunk_state::dropped instead of last
+std::pair<isubscription_sptr, status> subscribe_chunks(iconnection& conn, string_view subject, on_chunk_cb cb, ctx c);
+
+struct envelope_config {
+    // envelope is published when one more message wouldn't fit max_bytes (or server max_payload), when it has
+    // max_messages or max_delay after its first message
+    std::size_t max_bytes = 64 * 1024;
+    std::size_t max_messages = 4096;
+    duration max_delay = boost::posix_time::milliseconds(5);
+};
+
+struct envelope_stats {
+    uint64_t messages = 0;
+    uint64_t envelopes = 0;
+    // messages too big for an envelope, published as they are
+    uint64_t unpacked = 0;
+};
+
+// packs small messages of one subject into envelopes, each one a single message with header
+// `Nats-Asio-Envelope: <count>` and payload of records prefixed with varint length
+struct ienvelope_publisher {
+    virtual ~ienvelope_publisher() = default;
+
+    // copies message into the open envelope, publishes it when it is full. Messages of a failed envelope are lost
+    virtual status publish(const char* raw, std::size_t n, ctx c) = 0;
+
+    virtual status flush(ctx c) = 0;
+
+    virtual envelope_stats stats() = 0;
+};
+typedef std::shared_ptr<ienvelope_publisher> ienvelope_publisher_sptr;
+
+// envelopes left open are published from io after max_delay
+std::pair<ienvelope_publisher_sptr, status> create_envelope_publisher(aio& io, const iconnection_sptr& conn,
+                                                                      string_view subject,
+                                                                      const envelope_config& conf);
+
+// delivers messages of envelopes one by one, payload views point into the envelope. Reply subject of the envelope
+// is passed with every message. Messages without envelope header are delivered as they are
+std::pair<isubscription_sptr, status> subscribe_envelopes(iconnection& conn, string_view subject,
+                                                          optional<string_view> queue, on_message_cb cb, ctx c);
+
+// request to a service endpoint, views are valid during the handler call
+struct service_request {
+    string_view subject;
+    string_view headers;
+    const char* raw = nullptr;
+    std::size_t n = 0;
+
+    // sent as reply when the handler returns
+    std::vector<char> response;
+
+    // when set the reply is empty with Nats-Service-Error and Nats-Service-Error-Code headers
+    optional<std::string> error;
+    uint32_t error_code = 500;
+};
+
+// runs on a worker thread if the service has workers, so it must not use the connection directly
+typedef std::function<void(service_request& req)> on_service_request_cb;
+
+struct service_config {
+    std::string name;
+    std::string version = "0.0.1";
+    std::string description;
+
+    // threads running handlers, 0 runs them on the connection thread
+    std::size_t workers = 0;
+    // requests over this wait for workers get 503 reply at once
+    std::size_t max_pending_requests = 1024;
+};
+
+struct service_endpoint_config {
+    std::string name;
+    // name when empty
+    std::string subject;
+    std::string queue_group = "q";
+};
+
+struct service_endpoint_stats {
+    std::string name;
+    std::string subject;
+    std::string queue_group;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t processing_ns = 0;
+    std::string last_error;
+    // bucket i counts requests which took less than 2^i microseconds, the last one counts the rest
+    std::vector<uint64_t> histogram;
+};
+
+// endpoints in the style of NATS micro services, discoverable with $SRV.PING, $SRV.INFO and $SRV.STATS requests
+// to all services, to services of a name or to one service of a name and id
+struct iservice {
+    virtual ~iservice() = default;
+
+    virtual const std::string& id() = 0;
+
+    // subscribes subject in the endpoint queue group
+    virtual status add_endpoint(const service_endpoint_config& conf, on_service_request_cb cb, ctx c) = 0;
+
+    virtual std::vector<service_endpoint_stats> stats() = 0;
+
+    // unsubscribes everything and waits for running handlers
+    virtual void stop() = 0;
+};
+typedef std::shared_ptr<iservice> iservice_sptr;
+
+// subscriptions are gone with the connection, create the service again after reconnect
+std::pair<iservice_sptr, status> create_service(const iconnection_sptr& conn, const service_config& conf, ctx c);
 
 } // namespace nats_asio
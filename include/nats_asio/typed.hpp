@@ -0,0 +1,254 @@
+/*
+MIT License
+
+Copyright (c) 2019 Vladislav Troinich
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+                                                              copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+       THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+        SOFTWARE.
+*/
+
+#pragma once
+
+#include "nats_asio/interface.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace nats_asio {
+
+// Codec of T is a type with
+//   template <class Out> static void encode(const T& v, Out& out); appends encoded v to out, a char vector of any
+//   allocator. typed_publisher passes the connection outbound queue
+//   static bool decode(const char* raw, std::size_t n, T& v); false if payload is not a valid T
+
+// copies object representation, both sides must have the same layout and byte order
+template <class T> struct pod_codec {
+    static_assert(std::is_trivially_copyable<T>::value, "pod_codec needs trivially copyable type");
+
+    template <class Out> static void encode(const T& v, Out& out) {
+        auto p = reinterpret_cast<const char*>(&v);
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    static bool decode(const char* raw, std::size_t n, T& v) {
+        if (n != sizeof(T)) {
+            return false;
+        }
+
+        std::memcpy(&v, raw, sizeof(T));
+        return true;
+    }
+};
+
+// little endian fields, strings are prefixed with uint32 length. out is a char vector of any allocator
+class binary_writer {
+public:
+    template <class Out> explicit binary_writer(Out& out) : m_out(&out), m_append(&append_to<Out>) {}
+
+    template <class V> void put(V v) {
+        static_assert(std::is_arithmetic<V>::value || std::is_enum<V>::value, "put needs arithmetic or enum type");
+        char bytes[sizeof(V)];
+        std::memcpy(bytes, &v, sizeof(V));
+        append_le(bytes, sizeof(V));
+    }
+
+    void put(string_view str) {
+        put(static_cast<uint32_t>(str.size()));
+        m_append(m_out, str.data(), str.size());
+    }
+
+    void put(const std::string& str) { put(string_view(str)); }
+
+    void put(const char* str) { put(string_view(str)); }
+
+private:
+    template <class Out> static void append_to(void* out, const char* p, std::size_t n) {
+        auto& o = *static_cast<Out*>(out);
+        o.insert(o.end(), p, p + n);
+    }
+
+    void append_le(char* bytes, std::size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        std::reverse(bytes, bytes + n);
+#endif
+        m_append(m_out, bytes, n);
+    }
+
+    void* m_out;
+    void (*m_append)(void* out, const char* p, std::size_t n);
+};
+
+// reads what binary_writer wrote, string views point to the payload. Reads after a failed one fail too
+class binary_reader {
+public:
+    binary_reader(const char* raw, std::size_t n) : m_pos(raw), m_end(raw + n), m_ok(true) {}
+
+    template <class V> bool get(V& v) {
+        static_assert(std::is_arithmetic<V>::value || std::is_enum<V>::value, "get needs arithmetic or enum type");
+
+        if (!take(sizeof(V))) {
+            return false;
+        }
+
+        char bytes[sizeof(V)];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        std::reverse_copy(m_pos - sizeof(V), m_pos, bytes);
+#else
+        std::memcpy(bytes, m_pos - sizeof(V), sizeof(V));
+#endif
+        std::memcpy(&v, bytes, sizeof(V));
+        return true;
+    }
+
+    bool get(string_view& str) {
+        uint32_t n = 0;
+
+        if (!get(n) || !take(n)) {
+            return false;
+        }
+
+        str = string_view(m_pos - n, n);
+        return true;
+    }
+
+    bool get(std::string& str) {
+        string_view v;
+
+        if (!get(v)) {
+            return false;
+        }
+
+        str.assign(v.data(), v.size());
+        return true;
+    }
+
+    bool ok() const { return m_ok; }
+
+    bool at_end() const { return m_pos == m_end; }
+
+private:
+    bool take(std::size_t n) {
+        if (!m_ok || static_cast<std::size_t>(m_end - m_pos) < n) {
+            m_ok = false;
+            return false;
+        }
+
+        m_pos += n;
+        return true;
+    }
+
+    const char* m_pos;
+    const char* m_end;
+    bool m_ok;
+};
+
+// T provides free functions found by ADL:
+//   void encode_binary(binary_writer& w, const T& v);
+//   void decode_binary(binary_reader& r, T& v);
+template <class T> struct binary_codec {
+    template <class Out> static void encode(const T& v, Out& out) {
+        binary_writer w(out);
+        encode_binary(w, v);
+    }
+
+    static bool decode(const char* raw, std::size_t n, T& v) {
+        binary_reader r(raw, n);
+        decode_binary(r, v);
+        return r.ok() && r.at_end();
+    }
+};
+
+// T is converted with nlohmann to_json/from_json
+template <class T> struct json_codec {
+    template <class Out> static void encode(const T& v, Out& out) {
+        auto text = nlohmann::json(v).dump();
+        out.insert(out.end(), text.begin(), text.end());
+    }
+
+    static bool decode(const char* raw, std::size_t n, T& v) {
+        auto j = nlohmann::json::parse(raw, raw + n, nullptr, false);
+
+        if (j.is_discarded()) {
+            return false;
+        }
+
+        try {
+            j.get_to(v);
+        } catch (const nlohmann::json::exception&) {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+// encodes straight into the connection outbound queue once there is space in it, so the payload isn't copied
+// after encoding and publishing allocates only what Codec does
+template <class T, class Codec> class typed_publisher {
+public:
+    typed_publisher(const iconnection_sptr& conn, std::string subject)
+        : m_conn(conn), m_subject(std::move(subject)) {}
+
+    status publish(const T& v, ctx c) { return publish(v, optional<string_view>(), c); }
+
+    status publish(const T& v, optional<string_view> reply_to, ctx c) {
+        return m_conn->publish_encoded(
+            m_subject, reply_to, [&v](outbound_buffer& out) { Codec::encode(v, out); }, c);
+    }
+
+    const std::string& subject() const { return m_subject; }
+
+private:
+    iconnection_sptr m_conn;
+    std::string m_subject;
+};
+
+template <class T>
+using on_typed_message_cb = std::function<void(string_view subject, optional<string_view> reply_to, const T& v, ctx c)>;
+
+typedef std::function<void(string_view subject, ctx c)> on_decode_error_cb;
+
+// messages are decoded into one T reused for the whole subscription, callback must not keep a reference to it.
+// Messages which can't be decoded go to decode_error_cb if it is set and are skipped otherwise
+template <class T, class Codec>
+std::pair<isubscription_sptr, status> typed_subscribe(iconnection& conn, string_view subject,
+                                                      optional<string_view> queue, on_typed_message_cb<T> cb, ctx c,
+                                                      on_decode_error_cb decode_error_cb = nullptr) {
+    auto value = std::make_shared<T>();
+    return conn.subscribe(
+        subject, queue,
+        [value, cb, decode_error_cb](string_view subject, optional<string_view> reply_to, const char* raw,
+                                     std::size_t n, ctx c) {
+            if (!Codec::decode(raw, n, *value)) {
+                if (decode_error_cb != nullptr) {
+                    decode_error_cb(subject, c);
+                }
+
+                return;
+            }
+
+            cb(subject, reply_to, *value, c);
+        },
+        c);
+}
+
+} // namespace nats_asio
@@ -0,0 +1,160 @@
+// One-way publish to delivery latency on a local nats server, blocking io against spin runners:
+// latency_bench [address] [port] [messages] [interval us] [cpu]
+// Spin mode pins subscriber and publisher io threads to cpu and cpu + 1, -1 leaves them unpinned
+
+#include "../impl.hpp"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+using namespace nats_asio;
+
+struct bench_config {
+    connect_config conn;
+    std::size_t messages;
+    std::chrono::microseconds interval;
+    int cpu;
+};
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t percentile(const std::vector<int64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    auto i = static_cast<std::size_t>(p * (sorted.size() - 1));
+    return static_cast<uint64_t>(sorted[i]);
+}
+
+void run_bench(run_mode mode, const bench_config& conf, const logger& log) {
+    aio sub_io;
+    aio pub_io;
+    std::vector<int64_t> latencies;
+    latencies.reserve(conf.messages);
+    std::atomic<bool> ready{false};
+    std::string subject = mode == run_mode::spin ? "latency.spin" : "latency.blocking";
+    iconnection_sptr sub;
+    iconnection_sptr pub;
+
+    sub = create_connection(
+        sub_io, log,
+        [&](iconnection&, ctx c) {
+            auto r = sub->subscribe(subject, {},
+                                    [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) {
+                                        int64_t sent = 0;
+
+                                        if (n == sizeof(sent)) {
+                                            std::memcpy(&sent, raw, sizeof(sent));
+                                            latencies.push_back(now_ns() - sent);
+                                        }
+                                    },
+                                    c);
+
+            if (r.second.failed()) {
+                log->error("subscribe failed: {}", r.second.error());
+                return;
+            }
+
+            ready = true;
+        },
+        [](iconnection&, ctx) {}, {});
+    pub = create_connection(pub_io, log, [](iconnection&, ctx) {}, [](iconnection&, ctx) {}, {});
+    sub->start(conf.conn);
+    pub->start(conf.conn);
+
+    std::thread sub_thread;
+    std::thread pub_thread;
+    ispin_runner_sptr sub_spin;
+    ispin_runner_sptr pub_spin;
+
+    if (mode == run_mode::spin) {
+        sub_spin = create_spin_runner(sub_io, conf.cpu);
+        pub_spin = create_spin_runner(pub_io, conf.cpu >= 0 ? conf.cpu + 1 : -1);
+    } else {
+        sub_thread = std::thread([&]() { sub_io.run(); });
+        pub_thread = std::thread([&]() { pub_io.run(); });
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+    while (!ready && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // lets SUB get to the server
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for (std::size_t i = 0; ready && i < conf.messages; ++i) {
+        auto sent = now_ns();
+
+        while (pub->post_publish(subject, reinterpret_cast<const char*>(&sent), sizeof(sent), {}).failed()) {
+            std::this_thread::yield();
+            sent = now_ns();
+        }
+
+        std::this_thread::sleep_for(conf.interval);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // connections belong to io threads
+    connection_stats stats;
+    boost::asio::post(sub_io, [&]() {
+        stats = sub->stats();
+        sub->stop();
+        sub_io.stop();
+    });
+    boost::asio::post(pub_io, [&]() {
+        pub->stop();
+        pub_io.stop();
+    });
+
+    if (sub_spin) {
+        sub_spin->join();
+        pub_spin->join();
+    } else {
+        sub_thread.join();
+        pub_thread.join();
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << (stats.mode == run_mode::spin ? "spin" : "blocking") << ": " << latencies.size() << "/"
+              << conf.messages << " messages, p50 " << percentile(latencies, 0.5) / 1000.0 << " us, p99 "
+              << percentile(latencies, 0.99) / 1000.0 << " us, p999 " << percentile(latencies, 0.999) / 1000.0
+              << " us, max " << (latencies.empty() ? 0 : latencies.back() / 1000.0) << " us";
+
+    if (stats.mode == run_mode::spin) {
+        std::cout << ", cpu " << stats.spin_cpu << ", " << stats.spin_polls << " polls";
+    }
+
+    std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    bench_config conf;
+    conf.conn.address = argc > 1 ? argv[1] : "127.0.0.1";
+    conf.conn.port = static_cast<uint16_t>(argc > 2 ? std::stoul(argv[2]) : 4222);
+    conf.messages = argc > 3 ? std::stoul(argv[3]) : 100000;
+    conf.interval = std::chrono::microseconds(argc > 4 ? std::stoul(argv[4]) : 20);
+    conf.cpu = argc > 5 ? std::stoi(argv[5]) : -1;
+
+    auto log = spdlog::stdout_color_mt("bench");
+    log->set_level(spdlog::level::warn);
+
+    run_bench(run_mode::blocking, conf, log);
+
+    conf.conn.busy_poll_us = 50;
+    run_bench(run_mode::spin, conf, log);
+    return 0;
+}
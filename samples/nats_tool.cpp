@@ -92,6 +92,8 @@ int main(int argc, char* argv[]) {
         std::string ssl_cert_file;
         std::string ssl_ca_file;
         std::string ssl_dh_file;
+        std::string compression;
+        std::size_t compression_min_size = 1024;
         /* clang-format off */
 		options.add_options()
 		("h,help", "Print help")
@@ -110,6 +112,8 @@ int main(int argc, char* argv[]) {
 		("ssl_cert", "ssl_cert", cxxopts::value<std::string>(ssl_cert_file))
 		("ssl_ca", "ssl_ca", cxxopts::value<std::string>(ssl_ca_file))
 		("ssl_dh", "ssl_dh", cxxopts::value<std::string>(ssl_dh_file))
+		("compression", "compress published payloads: lz4 or zstd", cxxopts::value<std::string>(compression))
+		("compression_min_size", "compress payloads from this size", cxxopts::value<std::size_t>(compression_min_size))
 		;
         /* clang-format on */
         options.parse_positional({"mode"});
@@ -148,6 +152,22 @@ int main(int argc, char* argv[]) {
 
         mode = result["mode"].as<std::string>();
 
+        if (!compression.empty()) {
+            nats_asio::compression_rule rule;
+            rule.min_size = compression_min_size;
+
+            if (compression == "lz4") {
+                rule.codec = nats_asio::compression::lz4;
+            } else if (compression == "zstd") {
+                rule.codec = nats_asio::compression::zstd;
+            } else {
+                console->error("Invalid compression. Could be `lz4` or `zstd`");
+                return 1;
+            }
+
+            conf.compression.push_back(rule);
+        }
+
         if (mode != grub_mode && mode != gen_mode) {
             console->error("Invalid mode. Could be `{}` or `{}`", grub_mode, gen_mode);
             return 1;
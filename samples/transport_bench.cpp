@@ -0,0 +1,177 @@
+// Compares epoll and io_uring transports on a local nats server:
+// transport_bench [address] [port] [messages] [payload size]
+
+#include "../impl.hpp"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+using namespace nats_asio;
+
+// counts syscalls of the calling thread through raw_syscalls:sys_enter tracepoint
+class syscall_counter {
+public:
+    syscall_counter() : m_fd(-1) {
+        for (const char* path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                 "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+            std::ifstream f(path);
+            uint64_t id = 0;
+
+            if (!(f >> id)) {
+                continue;
+            }
+
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_TRACEPOINT;
+            attr.size = sizeof(attr);
+            attr.config = id;
+            attr.disabled = 1;
+            m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            break;
+        }
+    }
+
+    ~syscall_counter() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool available() const { return m_fd >= 0; }
+
+    void start() {
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t stop() {
+        uint64_t n = 0;
+
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(m_fd, &n, sizeof(n)) != sizeof(n)) {
+                n = 0;
+            }
+        }
+
+        return n;
+    }
+
+private:
+    int m_fd;
+};
+
+struct bench_config {
+    connect_config conn;
+    std::size_t messages;
+    std::size_t payload;
+};
+
+template <class Socket> void run_bench(const std::string& name, const bench_config& conf, const logger& log) {
+    aio io;
+    syscall_counter counter;
+    std::shared_ptr<connection<Socket>> conn;
+    std::size_t received = 0;
+    std::string payload(conf.payload, 'x');
+    std::string subject = "bench." + name;
+
+    auto connected = [&](iconnection&, ctx c) {
+        auto r = conn->subscribe(subject, {}, [&](string_view, optional<string_view>, const char*, std::size_t,
+                                                  ctx) { received++; }, c);
+
+        if (r.second.failed()) {
+            log->error("subscribe failed: {}", r.second.error());
+            io.stop();
+            return;
+        }
+
+        boost::asio::spawn(io, [&](ctx c) {
+            boost::asio::deadline_timer timer(io);
+            auto started = std::chrono::steady_clock::now();
+            counter.start();
+
+            for (std::size_t i = 0; i < conf.messages; ++i) {
+                auto s = conn->publish(subject, payload.data(), payload.size(), {}, c);
+
+                if (s.failed()) {
+                    log->error("publish failed: {}", s.error());
+                    break;
+                }
+            }
+
+            while (received < conf.messages && std::chrono::steady_clock::now() - started < std::chrono::seconds(30)) {
+                timer.expires_from_now(boost::posix_time::milliseconds(1));
+                boost::system::error_code ec;
+                timer.async_wait(c[ec]);
+            }
+
+            auto syscalls = counter.stop();
+            auto stats = conn->stats();
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started)
+                          .count();
+            double seconds = us > 0 ? us / 1e6 : 1e-6;
+            std::cout << name << ": " << received << "/" << conf.messages << " messages, "
+                      << static_cast<uint64_t>(received / seconds) << " msg/s, "
+                      << static_cast<uint64_t>(received * conf.payload / seconds / (1024 * 1024)) << " MB/s, ";
+
+            if (stats.reads > 0 && received > 0) {
+                std::cout << static_cast<double>(stats.reads) / received << " reads/msg, "
+                          << stats.read_bytes / stats.reads << " bytes/read, ";
+            }
+
+            if (counter.available() && received > 0) {
+                std::cout << static_cast<double>(syscalls) / received << " syscalls/msg" << std::endl;
+            } else {
+                std::cout << "syscalls/msg n/a" << std::endl;
+            }
+
+            conn->stop();
+            io.stop();
+        });
+    };
+
+    conn = std::make_shared<connection<Socket>>(io, log, connected, [](iconnection&, ctx) {});
+    conn->start(conf.conn);
+    io.run();
+}
+
+int main(int argc, char* argv[]) {
+    bench_config conf;
+    conf.conn.address = argc > 1 ? argv[1] : "127.0.0.1";
+    conf.conn.port = static_cast<uint16_t>(argc > 2 ? std::stoul(argv[2]) : 4222);
+    conf.messages = argc > 3 ? std::stoul(argv[3]) : 1000000;
+    conf.payload = argc > 4 ? std::stoul(argv[4]) : 128;
+
+    auto log = spdlog::stdout_color_mt("bench");
+    log->set_level(spdlog::level::warn);
+
+    run_bench<raw_socket>("epoll", conf, log);
+
+#ifdef NATS_ASIO_IO_URING
+    {
+        aio io;
+
+        if (boost::asio::use_service<uring_service>(io).ready()) {
+            run_bench<uring_socket>("io_uring", conf, log);
+        } else {
+            std::cout << "io_uring: not available" << std::endl;
+        }
+    }
+#else
+    std::cout << "io_uring: not built, configure with ENABLE_IO_URING=ON" << std::endl;
+#endif
+
+    return 0;
+}
@@ -2,9 +2,13 @@
 #include <gtest/gtest.h>
 
 #include "../impl.hpp"
+#include <nats_asio/typed.hpp>
 
+#include <cctype>
 #include <iostream>
+#include <numeric>
 #include <sstream>
+#include <thread>
 
 using namespace nats_asio;
 
@@ -15,7 +19,7 @@ struct parser_mock : public parser_observer {
     MOCK_METHOD1(on_ping, void(ctx));
     MOCK_METHOD2(on_error, void(string_view, ctx));
     MOCK_METHOD2(on_info, void(string_view, ctx));
-    MOCK_METHOD5(on_message, void(string_view, string_view, optional<string_view>, std::size_t, ctx));
+    MOCK_METHOD6(on_message, void(string_view, string_view, optional<string_view>, std::size_t, std::size_t, ctx));
 };
 
 void async_process(const std::function<void(ctx c)>& f) {
@@ -24,6 +28,100 @@ void async_process(const std::function<void(ctx c)>& f) {
     ioc.run();
 }
 
+// loopback server side of a test scenario, one client connection at a time
+struct scripted_server {
+    explicit scripted_server(aio& io, std::string info_line = "INFO {\"max_payload\":1048576}\r\n")
+        : acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), socket(io),
+          info(std::move(info_line)) {}
+
+    connect_config config() const {
+        connect_config conf;
+        conf.address = "127.0.0.1";
+        conf.port = acceptor.local_endpoint().port();
+        return conf;
+    }
+
+    // closes the previous connection, accepts the next one and sends INFO
+    void accept(ctx c) {
+        boost::system::error_code ec;
+        socket.close(ec);
+        acceptor.async_accept(socket, c);
+        accepted++;
+        write(info, c);
+    }
+
+    // reads until `what` arrives after the previous match, false if the client went away first
+    bool read_until(const std::string& what, ctx c) {
+        auto p = got.find(what, from);
+
+        while (p == std::string::npos) {
+            // only the new bytes and a partial match before them are searched again
+            auto searched = std::max(from, got.size() >= what.size() ? got.size() - what.size() + 1 : 0);
+
+            if (!read_some(c)) {
+                return false;
+            }
+
+            p = got.find(what, searched);
+        }
+
+        from = p + what.size();
+        return true;
+    }
+
+    // reads until the client goes away
+    void read_all(ctx c) {
+        while (read_some(c)) {
+        }
+    }
+
+    bool read_some(ctx c) {
+        boost::system::error_code ec;
+        auto n = socket.async_read_some(boost::asio::buffer(buf), c[ec]);
+        got.append(buf.data(), n);
+        return !ec;
+    }
+
+    void write(const std::string& out, ctx c) {
+        boost::system::error_code ec;
+        boost::asio::async_write(socket, boost::asio::buffer(out), c[ec]);
+    }
+
+    // text from the previous match up to `end`
+    std::string token(const char* end) const { return got.substr(from, got.find(end, from) - from); }
+
+    // sid the client gave to its subscription on `subject`
+    std::string sid(const std::string& subject) const {
+        auto line = got.find("SUB " + subject + " ");
+        auto end = got.find("\r\n", line);
+        auto p = got.rfind(' ', end) + 1;
+        return got.substr(p, end - p);
+    }
+
+    tcp::acceptor acceptor;
+    tcp::socket socket;
+    std::string info;
+
+    // everything the clients sent
+    std::string got;
+    std::size_t from = 0;
+    std::size_t accepted = 0;
+    std::vector<char> buf = std::vector<char>(64 * 1024);
+};
+
+std::string msg_frame(const std::string& subject, const std::string& sid, const std::string& reply,
+                      const std::string& payload) {
+    return "MSG " + subject + " " + sid + " " + reply + (reply.empty() ? "" : " ") + std::to_string(payload.size()) +
+           "\r\n" + payload + "\r\n";
+}
+
+std::string hmsg_frame(const std::string& subject, const std::string& sid, const std::string& reply,
+                       const std::string& headers, const std::string& payload = {}) {
+    return "HMSG " + subject + " " + sid + " " + reply + (reply.empty() ? "" : " ") +
+           std::to_string(headers.size()) + " " + std::to_string(headers.size() + payload.size()) + "\r\n" +
+           headers + payload + "\r\n";
+}
+
 TEST(small_messages, ping) {
     parser_mock m;
     std::string payload("PING\r\n");
@@ -110,8 +208,8 @@ TEST(payload_messages, on_message) {
     std::string header;
     std::string payload = fmt::format("MSG {} {} {}\r\n{}\r\n", subject, sid, msg_size, msg);
     std::string payload2 = fmt::format("MSG {} {} {} {}\r\n{}\r\n", subject, sid, reply_to, msg_size, msg);
-    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), msg_size, testing::_)).Times(1);
-    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(reply_to), msg_size, testing::_)).Times(1);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), 0, msg_size, testing::_)).Times(1);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(reply_to), 0, msg_size, testing::_)).Times(1);
     EXPECT_CALL(m, consumed(msg_size + 2)).Times(2);
     async_process([&](auto c) {
         std::stringstream ss(payload);
@@ -141,7 +239,7 @@ TEST(payload_messages, on_message_binary) {
     buffer.push_back('\r');
     buffer.push_back('\n');
     std::string header;
-    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), msg_size, testing::_)).Times(1);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), 0, msg_size, testing::_)).Times(1);
     EXPECT_CALL(m, consumed(msg_size + 2)).Times(1);
     async_process([&](auto c) {
         std::stringstream ss2(payload_header);
@@ -169,7 +267,7 @@ TEST(payload_messages, on_message_not_full) {
     string_view subject("sub1.1");
     std::string header;
     auto payload = fmt::format("MSG {} {} {}\r\n{}", subject, sid, msg_size, msg);
-    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), msg_size, testing::_)).Times(1);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), 0, msg_size, testing::_)).Times(1);
     EXPECT_CALL(m, consumed(msg_size + 2)).Times(1);
     async_process([&](auto c) {
         std::stringstream ss(payload);
@@ -177,3 +275,2042 @@ TEST(payload_messages, on_message_not_full) {
         EXPECT_EQ(false, s1.failed());
     });
 }
+
+TEST(payload_messages, on_hmessage) {
+    parser_mock m;
+    const char* headers = "NATS/1.0\r\nKV-Operation: DEL\r\n\r\n";
+    const char* msg = R"(subscription payload)";
+    auto headers_size = strlen(headers);
+    auto total_size = headers_size + strlen(msg);
+    string_view sid("6789654");
+    string_view subject("sub1.1");
+    string_view reply_to("some_reply_to");
+    std::string header;
+    std::string payload = fmt::format("HMSG {} {} {} {}\r\n{}{}\r\n", subject, sid, headers_size, total_size,
+                                      headers, msg);
+    std::string payload2 = fmt::format("HMSG {} {} {} {} {}\r\n{}{}\r\n", subject, sid, reply_to, headers_size,
+                                       total_size, headers, msg);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(), headers_size, total_size, testing::_)).Times(1);
+    EXPECT_CALL(m, on_message(subject, sid, optional<string_view>(reply_to), headers_size, total_size, testing::_))
+        .Times(1);
+    EXPECT_CALL(m, consumed(total_size + 2)).Times(2);
+    async_process([&](auto c) {
+        std::stringstream ss(payload);
+        auto s1 = parse_header(header, ss, &m, c);
+        EXPECT_EQ(false, s1.failed());
+        std::stringstream ss2(payload2);
+        auto s2 = parse_header(header, ss2, &m, c);
+        EXPECT_EQ(false, s2.failed());
+    });
+}
+
+TEST(payload_messages, on_hmessage_bad_sizes) {
+    parser_mock m;
+    std::string payload("HMSG sub1.1 1 20 10\r\n");
+    std::string header;
+    async_process([&](auto c) {
+        std::stringstream ss(payload);
+        auto s1 = parse_header(header, ss, &m, c);
+        EXPECT_EQ(true, s1.failed());
+    });
+}
+
+TEST(headers, find_header) {
+    string_view headers("NATS/1.0\r\nNats-Msg-Id: abc\r\nKV-Operation: DEL\r\n\r\n");
+    EXPECT_EQ(optional<string_view>("abc"), find_header(headers, "Nats-Msg-Id"));
+    EXPECT_EQ(optional<string_view>("DEL"), find_header(headers, "kv-operation"));
+    EXPECT_EQ(optional<string_view>(), find_header(headers, "Missing"));
+    EXPECT_EQ(0u, headers_status(headers));
+    EXPECT_EQ(503u, headers_status("NATS/1.0 503\r\n\r\n"));
+}
+
+TEST(headers, js_ack) {
+    js_ack_info info;
+    EXPECT_TRUE(parse_js_ack("$JS.ACK.KV_cfg.cons.1.42.7.1600000000.3", info));
+    EXPECT_EQ(42u, info.stream_seq);
+    EXPECT_EQ(7u, info.consumer_seq);
+    EXPECT_EQ(3u, info.pending);
+    EXPECT_TRUE(parse_js_ack("$JS.ACK.hub.ACCHASH.KV_cfg.cons.1.43.8.1600000000.0.xyz", info));
+    EXPECT_EQ(43u, info.stream_seq);
+    EXPECT_EQ(0u, info.pending);
+    EXPECT_FALSE(parse_js_ack("_INBOX.abc", info));
+}
+
+TEST(compression, find_rule) {
+    compression_rule metrics;
+    metrics.subject_prefix = "metrics.";
+    compression_rule skip;
+    skip.subject_prefix = "metrics.raw";
+    skip.codec = compression::none;
+    std::vector<compression_rule> rules{skip, metrics};
+    EXPECT_EQ(&rules[1], find_compression_rule(rules, "metrics.cpu"));
+    EXPECT_EQ(&rules[0], find_compression_rule(rules, "metrics.raw.cpu"));
+    EXPECT_EQ(nullptr, find_compression_rule(rules, "events"));
+    EXPECT_EQ(nullptr, find_compression_rule(rules, "metrics"));
+}
+
+#ifdef NATS_ASIO_LZ4
+TEST(compression, lz4_round_trip) {
+    payload_codec codec;
+    std::string payload;
+
+    for (int i = 0; i < 100; ++i) {
+        payload += "{\"value\": 123},";
+    }
+
+    pmr_vector<char> compressed;
+    ASSERT_TRUE(codec.compress(compression::lz4, 0, payload.data(), payload.size(), compressed));
+    EXPECT_LT(compressed.size(), payload.size());
+    pmr_vector<char> decoded;
+    ASSERT_FALSE(codec.decompress(compression::lz4, compressed.data(), compressed.size(), payload.size(), decoded)
+                     .failed());
+    EXPECT_EQ(payload, std::string(decoded.data(), decoded.size()));
+    EXPECT_TRUE(codec.decompress(compression::lz4, compressed.data(), compressed.size() / 2, payload.size(), decoded)
+                    .failed());
+}
+#endif
+
+struct tick {
+    uint32_t id;
+    double price;
+};
+
+struct quote {
+    std::string symbol;
+    int64_t bid = 0;
+    int64_t ask = 0;
+};
+
+void encode_binary(binary_writer& w, const quote& q) {
+    w.put(q.symbol);
+    w.put(q.bid);
+    w.put(q.ask);
+}
+
+void decode_binary(binary_reader& r, quote& q) {
+    r.get(q.symbol);
+    r.get(q.bid);
+    r.get(q.ask);
+}
+
+void to_json(nlohmann::json& j, const quote& q) { j = {{"symbol", q.symbol}, {"bid", q.bid}, {"ask", q.ask}}; }
+
+void from_json(const nlohmann::json& j, quote& q) {
+    j.at("symbol").get_to(q.symbol);
+    j.at("bid").get_to(q.bid);
+    j.at("ask").get_to(q.ask);
+}
+
+TEST(typed, pod_codec) {
+    std::vector<char> buf;
+    pod_codec<tick>::encode({7, 1.5}, buf);
+    EXPECT_EQ(sizeof(tick), buf.size());
+    tick t{};
+    EXPECT_TRUE(pod_codec<tick>::decode(buf.data(), buf.size(), t));
+    EXPECT_EQ(7u, t.id);
+    EXPECT_EQ(1.5, t.price);
+    EXPECT_FALSE(pod_codec<tick>::decode(buf.data(), buf.size() - 1, t));
+}
+
+TEST(typed, binary_codec) {
+    std::vector<char> buf;
+    quote q;
+    q.symbol = "ABC";
+    q.bid = 100;
+    q.ask = -101;
+    binary_codec<quote>::encode(q, buf);
+    EXPECT_EQ(4u + 3u + 8u + 8u, buf.size());
+    quote decoded;
+    EXPECT_TRUE(binary_codec<quote>::decode(buf.data(), buf.size(), decoded));
+    EXPECT_EQ("ABC", decoded.symbol);
+    EXPECT_EQ(100, decoded.bid);
+    EXPECT_EQ(-101, decoded.ask);
+    EXPECT_FALSE(binary_codec<quote>::decode(buf.data(), buf.size() - 1, decoded));
+    buf.push_back(0);
+    EXPECT_FALSE(binary_codec<quote>::decode(buf.data(), buf.size(), decoded));
+}
+
+TEST(typed, json_codec) {
+    std::vector<char> buf;
+    quote q;
+    q.symbol = "ABC";
+    q.bid = 1;
+    q.ask = 2;
+    json_codec<quote>::encode(q, buf);
+    quote decoded;
+    EXPECT_TRUE(json_codec<quote>::decode(buf.data(), buf.size(), decoded));
+    EXPECT_EQ("ABC", decoded.symbol);
+    EXPECT_EQ(2, decoded.ask);
+    std::string wrong("{\"symbol\": 1}");
+    EXPECT_FALSE(json_codec<quote>::decode(wrong.data(), wrong.size(), decoded));
+    std::string broken("{\"symbol\"");
+    EXPECT_FALSE(json_codec<quote>::decode(broken.data(), broken.size(), decoded));
+}
+
+TEST(typed, publish_and_subscribe_through_connection) {
+    aio io;
+    scripted_server srv(io);
+    std::vector<std::string> payloads;
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB done  0\r\n", c);
+
+        // payloads of PUB frames go back as messages of the typed subscription
+        for (auto p = srv.got.find("PUB quotes "); p != std::string::npos; p = srv.got.find("PUB quotes ", p)) {
+            auto end = srv.got.find("\r\n", p);
+            auto space = srv.got.rfind(' ', end);
+            auto size = std::stoul(srv.got.substr(space + 1, end - space - 1));
+            payloads.push_back(srv.got.substr(end + 2, size));
+            p = end + 2 + size;
+        }
+
+        std::string frames;
+
+        for (const auto& payload : payloads) {
+            frames += msg_frame("quotes", srv.sid("quotes"), "", payload);
+        }
+
+        srv.write(frames + msg_frame("quotes", srv.sid("quotes"), "", "bad"), c);
+        srv.read_all(c);
+    });
+
+    std::vector<quote> sent(3);
+    sent[0].symbol = "ABC";
+    sent[0].bid = 1;
+    sent[0].ask = 2;
+    // payload size gets another digit and loses it again
+    sent[1].symbol = std::string(100, 'x');
+    sent[1].bid = -3;
+    sent[2].symbol = "DEF";
+    std::vector<quote> received;
+    std::size_t decode_errors = 0;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            typed_subscribe<quote, binary_codec<quote>>(
+                *conn, "quotes", {},
+                [&](string_view, optional<string_view>, const quote& q, ctx) { received.push_back(q); }, c,
+                [&](string_view, ctx) {
+                    decode_errors++;
+                    conn->stop();
+                    io.stop();
+                });
+            typed_publisher<quote, binary_codec<quote>> publisher(conn, "quotes");
+            EXPECT_FALSE(publisher.publish(sent[0], c).failed());
+            EXPECT_FALSE(publisher.publish(sent[1], c).failed());
+            EXPECT_FALSE(publisher.publish(sent[2], string_view("r"), c).failed());
+            conn->publish("done", "", 0, {}, c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(srv.config());
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+
+    std::string expected;
+
+    for (std::size_t i = 0; i < sent.size(); ++i) {
+        std::vector<char> buf;
+        binary_codec<quote>::encode(sent[i], buf);
+        expected += "PUB quotes " + std::string(i == 2 ? "r " : " ") + std::to_string(buf.size()) + "\r\n" +
+                    std::string(buf.begin(), buf.end()) + "\r\n";
+    }
+
+    EXPECT_NE(std::string::npos, srv.got.find(expected));
+    ASSERT_EQ(3u, received.size());
+
+    for (std::size_t i = 0; i < sent.size(); ++i) {
+        EXPECT_EQ(sent[i].symbol, received[i].symbol);
+        EXPECT_EQ(sent[i].bid, received[i].bid);
+        EXPECT_EQ(sent[i].ask, received[i].ask);
+    }
+
+    EXPECT_EQ(1u, decode_errors);
+}
+
+TEST(subjects, check_subject) {
+    EXPECT_FALSE(check_subject("orders.eu.new", false).failed());
+    EXPECT_FALSE(check_subject("orders.*.new", true).failed());
+    EXPECT_FALSE(check_subject("orders.>", true).failed());
+    EXPECT_TRUE(check_subject("orders.>", false).failed());
+    EXPECT_TRUE(check_subject("orders.*", false).failed());
+    EXPECT_TRUE(check_subject("", false).failed());
+    EXPECT_TRUE(check_subject("orders..new", false).failed());
+    EXPECT_TRUE(check_subject(".orders", false).failed());
+    EXPECT_TRUE(check_subject("orders.", false).failed());
+    EXPECT_TRUE(check_subject("orders new", false).failed());
+    EXPECT_TRUE(check_subject("orders\r\n", false).failed());
+}
+
+TEST(subjects, subject_matches) {
+    EXPECT_TRUE(subject_matches("orders.eu.new", "orders.eu.new"));
+    EXPECT_TRUE(subject_matches("orders.*.new", "orders.eu.new"));
+    EXPECT_TRUE(subject_matches("orders.>", "orders.eu.new"));
+    EXPECT_TRUE(subject_matches(">", "orders"));
+    EXPECT_FALSE(subject_matches("orders.>", "orders"));
+    EXPECT_FALSE(subject_matches("orders.*", "orders.eu.new"));
+    EXPECT_FALSE(subject_matches("orders.eu", "orders.eu.new"));
+    EXPECT_FALSE(subject_matches("orders.eu.new", "orders.eu"));
+    EXPECT_FALSE(subject_matches("orders.us.*", "orders.eu.new"));
+}
+
+TEST(post, publish_ring) {
+    publish_ring ring(6);
+    std::string payload("abc");
+
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_TRUE(ring.push("a", {}, payload.data(), payload.size()));
+    }
+
+    EXPECT_FALSE(ring.push("a", {}, payload.data(), payload.size()));
+    std::size_t drained = ring.drain(3, [&](string_view subject, optional<string_view> reply_to, string_view headers,
+                                            const char* raw, std::size_t n) {
+        EXPECT_EQ("a", subject);
+        EXPECT_TRUE(headers.empty());
+        EXPECT_FALSE(reply_to.has_value());
+        EXPECT_EQ(payload, std::string(raw, n));
+    });
+    EXPECT_EQ(3u, drained);
+    EXPECT_TRUE(ring.push("b", string_view("r"), {{"k", "v"}}, payload.data(), payload.size()));
+    EXPECT_EQ(6u, ring.drain(100, [](string_view, optional<string_view>, string_view, const char*, std::size_t) {}));
+    ring.drain(1, [&](string_view subject, optional<string_view> reply_to, string_view headers, const char* raw,
+                      std::size_t n) {
+        EXPECT_EQ("b", subject);
+        EXPECT_EQ(optional<string_view>("r"), reply_to);
+        EXPECT_EQ("NATS/1.0\r\nk: v\r\n", headers);
+        EXPECT_EQ(payload, std::string(raw, n));
+    });
+    EXPECT_EQ(0u, ring.drain(100, [](string_view, optional<string_view>, string_view, const char*, std::size_t) {}));
+}
+
+TEST(post, publish_ring_threads) {
+    const int producers = 4;
+    const int messages = 20000;
+    publish_ring ring(256);
+    std::vector<std::thread> threads;
+
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&ring, p] {
+            for (int i = 0; i < messages;) {
+                auto payload = std::to_string(i);
+
+                if (ring.push(std::to_string(p), {}, payload.data(), payload.size())) {
+                    ++i;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<int> next(producers, 0);
+    int received = 0;
+    bool ordered = true;
+
+    while (received < producers * messages) {
+        auto n = ring.drain(64, [&](string_view subject, optional<string_view>, string_view, const char* raw,
+                                    std::size_t n) {
+            auto& expected = next[std::stoul(std::string(subject))];
+            ordered = ordered && std::to_string(expected) == std::string(raw, n);
+            expected++;
+        });
+
+        if (n == 0) {
+            std::this_thread::yield();
+        }
+
+        received += static_cast<int>(n);
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(std::vector<int>(producers, messages), next);
+}
+
+TEST(post, rejects_messages_server_would_close_for) {
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":32}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB ok ", c);
+        io.stop();
+    });
+
+    auto conf = srv.config();
+    std::vector<bool> failed;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            std::string big(33, 'x');
+            failed.push_back(conn->post_publish("a", big.data(), big.size(), {}).failed());
+            // framing and `k: v\r\n` take 18 bytes, so 14 bytes of payload fit and 15 don't
+            failed.push_back(conn->post_publish("a", big.data(), 14, {{"k", "v"}}, {}).failed());
+            failed.push_back(conn->post_publish("a", big.data(), 15, {{"k", "v"}}, {}).failed());
+            failed.push_back(conn->post_publish("a b", "x", 1, {}).failed());
+            failed.push_back(conn->post_publish("a.>", "x", 1, {}).failed());
+            failed.push_back(conn->post_publish("a", "x", 1, string_view("r..1")).failed());
+            failed.push_back(conn->post_publish("ok", "x", 1, {}).failed());
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ((std::vector<bool>{true, false, true, true, true, true, false}), failed);
+    EXPECT_EQ(std::string::npos, srv.got.find("\nPUB a "));
+    EXPECT_NE(std::string::npos, srv.got.find("HPUB a "));
+}
+
+TEST(publish, rejects_messages_over_max_payload) {
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":32,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB done  0\r\n", c);
+        io.stop();
+    });
+
+    std::vector<bool> failed;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            std::string big(33, 'x');
+            failed.push_back(conn->publish("a", big.data(), 33, {}, c).failed());
+            failed.push_back(conn->publish("a", big.data(), 32, {}, c).failed());
+            // `NATS/1.0\r\nk: v\r\n\r\n` takes 18 bytes
+            failed.push_back(conn->publish("h", big.data(), 15, {{"k", "v"}}, {}, c).failed());
+            failed.push_back(conn->publish("h", big.data(), 14, {{"k", "v"}}, {}, c).failed());
+            auto publisher = conn->make_publisher("p", {});
+            failed.push_back(publisher.first->publish(big.data(), 33, c).failed());
+            failed.push_back(publisher.first->publish(big.data(), 32, c).failed());
+            // nothing of a rejected encoded payload stays queued
+            auto write = [&](std::size_t n) {
+                return [&big, n](outbound_buffer& out) { out.insert(out.end(), big.data(), big.data() + n); };
+            };
+            failed.push_back(conn->publish_encoded("e", {}, write(33), c).failed());
+            failed.push_back(conn->publish_encoded("e", {}, write(32), c).failed());
+            conn->publish("done", "", 0, {}, c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(srv.config());
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+    EXPECT_EQ((std::vector<bool>{true, false, true, false, true, false, true, false}), failed);
+    auto x = std::string(32, 'x');
+    EXPECT_NE(std::string::npos, srv.got.find("PUB a  32\r\n" + x + "\r\nHPUB h  18 32\r\n"));
+    EXPECT_NE(std::string::npos, srv.got.find("\r\nPUB p 32\r\n" + x + "\r\nPUB e  32\r\n" + x +
+                                              "\r\nPUB done  0\r\n"));
+}
+
+TEST(capture, round_trip) {
+    char path[] = "/tmp/nats_asio_capture_XXXXXX";
+    ::close(mkstemp(path));
+    std::string big(3 * 1024 * 1024, 'x');
+    {
+        wire_recorder recorder;
+        ASSERT_FALSE(recorder.open(path).failed());
+        recorder.record(wire_direction::in, "INFO {}\r\n", 9);
+        std::array<boost::asio::const_buffer, 2> parts{boost::asio::buffer("PUB a 1\r\n", 9),
+                                                       boost::asio::buffer("x", 1)};
+        recorder.record(wire_direction::out, parts.begin(), parts.end());
+        recorder.record(wire_direction::in, big.data(), big.size());
+    }
+
+    capture_reader reader;
+    ASSERT_FALSE(reader.open(path).failed());
+    capture_record r;
+    ASSERT_TRUE(reader.next(r));
+    EXPECT_EQ(wire_direction::in, r.direction);
+    EXPECT_EQ("INFO {}\r\n", std::string(r.data, r.size));
+    auto first_offset = r.offset_ns;
+    ASSERT_TRUE(reader.next(r));
+    EXPECT_EQ(wire_direction::out, r.direction);
+    EXPECT_EQ("PUB a 1\r\nx", std::string(r.data, r.size));
+    ASSERT_TRUE(reader.next(r));
+    EXPECT_EQ(big.size(), r.size);
+    EXPECT_LE(first_offset, r.offset_ns);
+    EXPECT_FALSE(reader.next(r));
+    std::remove(path);
+    EXPECT_TRUE(capture_reader().open(path).failed());
+}
+
+TEST(capture, replay_connection) {
+    char path[] = "/tmp/nats_asio_replay_XXXXXX";
+    ::close(mkstemp(path));
+    {
+        wire_recorder recorder;
+        ASSERT_FALSE(recorder.open(path).failed());
+        auto record = [&](wire_direction dir, const std::string& data) {
+            recorder.record(dir, data.data(), data.size());
+        };
+        record(wire_direction::in, "INFO {\"max_payload\":1024}\r\n");
+        record(wire_direction::out, "CONNECT {}\r\nSUB a  0\r\n");
+        record(wire_direction::in, msg_frame("a", "0", "", "hello"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        record(wire_direction::in, msg_frame("a", "0", "r", "world"));
+    }
+
+    // messages, gap between them and disconnects of one replay
+    struct replayed {
+        std::vector<std::string> messages;
+        std::chrono::steady_clock::duration gap;
+        std::size_t connects = 0;
+        std::size_t disconnects = 0;
+    };
+
+    auto replay = [&](bool original_timing) {
+        aio io;
+        replayed r;
+        std::chrono::steady_clock::time_point first;
+        replay_config conf;
+        conf.capture_path = path;
+        conf.original_timing = original_timing;
+        boost::asio::deadline_timer done(io, boost::posix_time::seconds(5));
+        auto stop = [&](boost::system::error_code ec) {
+            if (!ec) {
+                io.stop();
+            }
+        };
+        done.async_wait(stop);
+        iconnection_sptr conn;
+        auto created = create_replay_connection(
+            io, std::make_shared<spdlog::logger>("test"), conf,
+            [&](iconnection&, ctx c) {
+                r.connects++;
+                conn->subscribe(
+                    "a", {},
+                    [&](string_view, optional<string_view> reply_to, const char* raw, std::size_t n, ctx) {
+                        auto now = std::chrono::steady_clock::now();
+                        r.gap = now - first;
+                        first = now;
+                        r.messages.push_back(std::string(raw, n) + (reply_to.has_value() ? " r" : ""));
+                    },
+                    c);
+            },
+            [&](iconnection&, ctx) {
+                // a while longer to see that nothing follows the end of capture
+                r.disconnects++;
+                done.expires_from_now(boost::posix_time::milliseconds(50));
+                done.async_wait(stop);
+            });
+        EXPECT_FALSE(created.second.failed());
+        conn = created.first;
+        connect_config cc;
+        cc.address = "unused";
+        cc.port = 0;
+        conn->start(cc);
+        io.run();
+        return r;
+    };
+
+    auto fast = replay(false);
+    auto timed = replay(true);
+    std::remove(path);
+
+    for (const auto& r : {fast, timed}) {
+        EXPECT_EQ((std::vector<std::string>{"hello", "world r"}), r.messages);
+        EXPECT_EQ(1u, r.connects);
+        EXPECT_EQ(1u, r.disconnects);
+    }
+
+    EXPECT_LT(fast.gap, std::chrono::milliseconds(50));
+    EXPECT_GE(timed.gap, std::chrono::milliseconds(90));
+
+    // the capture is gone
+    aio io;
+    replay_config missing;
+    missing.capture_path = path;
+    auto created = create_replay_connection(io, std::make_shared<spdlog::logger>("test"), missing, nullptr, nullptr);
+    EXPECT_TRUE(created.second.failed());
+}
+
+// global allocations of a thread are counted while a test enables it, steady state paths must not allocate
+std::size_t global_allocations = 0;
+thread_local bool count_global_allocations = false;
+
+// replacements are kept out of line, gcc otherwise sees free() inlined against a pointer from operator new and
+// warns about mismatched new and delete
+__attribute__((noinline)) void* operator new(std::size_t n) {
+    if (count_global_allocations) {
+        global_allocations++;
+    }
+
+    if (auto p = std::malloc(n > 0 ? n : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](std::size_t n) { return operator new(n); }
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+struct allocation_counter {
+    allocation_counter() {
+        global_allocations = 0;
+        count_global_allocations = true;
+    }
+
+    ~allocation_counter() { count_global_allocations = false; }
+
+    std::size_t count() const { return global_allocations; }
+};
+
+struct counting_resource : public pmr::memory_resource {
+    std::size_t allocations = 0;
+
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        allocations++;
+        return pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    virtual bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+struct skipping_observer : public parser_observer {
+    std::istream* is = nullptr;
+    std::size_t messages = 0;
+
+    virtual void consumed(std::size_t n) override { is->ignore(static_cast<std::streamsize>(n)); }
+    virtual void on_ok(ctx) override {}
+    virtual void on_pong(ctx) override {}
+    virtual void on_ping(ctx) override {}
+    virtual void on_error(string_view, ctx) override {}
+    virtual void on_info(string_view, ctx) override {}
+    virtual void on_message(string_view, string_view, optional<string_view>, std::size_t, std::size_t, ctx) override {
+        messages++;
+    }
+};
+
+TEST(connect, interleave_families) {
+    auto v4 = [](int port) { return tcp::endpoint(boost::asio::ip::address_v4::loopback(), port); };
+    auto v6 = [](int port) { return tcp::endpoint(boost::asio::ip::address_v6::loopback(), port); };
+    auto out = interleave_families({v6(1), v6(2), v6(3), v4(4)});
+    std::vector<tcp::endpoint> expected{v6(1), v4(4), v6(2), v6(3)};
+    EXPECT_EQ(expected, out);
+    EXPECT_TRUE(interleave_families({}).empty());
+}
+
+TEST(connect, race_skips_stalled_endpoint) {
+    aio io;
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    tcp::acceptor good(io, tcp::endpoint(loopback, 0));
+    // accept queue of a backlog 0 listener takes one connection, later handshakes hang
+    tcp::acceptor stalled(io, tcp::endpoint(loopback, 0));
+    stalled.listen(0);
+    std::vector<std::unique_ptr<tcp::socket>> fillers;
+    boost::system::error_code raced, timed_out;
+    tcp::socket out(io);
+    uint64_t attempts = 0;
+
+    boost::asio::spawn(io, [&](ctx c) {
+        for (int i = 0; i < 4; ++i) {
+            fillers.push_back(std::make_unique<tcp::socket>(io));
+            fillers.back()->async_connect(stalled.local_endpoint(), [](boost::system::error_code) {});
+        }
+
+        boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(50));
+        timer.async_wait(c);
+        auto now = boost::asio::deadline_timer::traits_type::now();
+        raced = std::make_shared<connect_race>(io)->run({stalled.local_endpoint(), good.local_endpoint()},
+                                                        boost::posix_time::milliseconds(20),
+                                                        now + boost::posix_time::seconds(5), out, attempts, c);
+        now = boost::asio::deadline_timer::traits_type::now();
+        tcp::socket unused(io);
+        timed_out = std::make_shared<connect_race>(io)->run({stalled.local_endpoint()},
+                                                            boost::posix_time::milliseconds(20),
+                                                            now + boost::posix_time::milliseconds(100), unused,
+                                                            attempts, c);
+
+        for (auto& f : fillers) {
+            f->close();
+        }
+    });
+
+    auto started = std::chrono::steady_clock::now();
+    io.run();
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(2));
+    EXPECT_FALSE(raced.failed());
+    EXPECT_EQ(good.local_endpoint(), out.remote_endpoint());
+    EXPECT_EQ(boost::asio::error::timed_out, timed_out);
+    EXPECT_EQ(3u, attempts);
+}
+
+TEST(reads, adaptive_size_and_dispatch_before_read) {
+    aio io;
+    scripted_server srv(io);
+    const std::size_t small = 20;
+    const std::size_t big = 512;
+    const std::size_t tail = 12;
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("SUB a  0\r\n", c);
+
+        // one write, so one read
+        std::string out;
+
+        for (std::size_t i = 0; i < small; ++i) {
+            out += "MSG a 0 1\r\nx\r\n";
+        }
+
+        srv.write(out, c);
+        srv.read_until("PUB ack ", c);
+
+        // many times the initial read size
+        out.clear();
+
+        for (std::size_t i = 0; i < big; ++i) {
+            out += "MSG a 0 1000\r\n" + std::string(1000, 'y') + "\r\n";
+        }
+
+        srv.write(out, c);
+        srv.read_until("PUB ack ", c);
+
+        // short reads, one message each
+        for (std::size_t i = 0; i < tail; ++i) {
+            srv.write("MSG a 0 1\r\nz\r\n", c);
+            srv.read_until("PUB ack ", c);
+        }
+    });
+
+    auto conf = srv.config();
+    std::size_t got = 0;
+    std::vector<uint64_t> small_reads;
+    connection_stats grown;
+    connection_stats shrunk;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            conn->subscribe(
+                "a", {},
+                [&](string_view, optional<string_view>, const char*, std::size_t, ctx c) {
+                    got++;
+                    auto st = conn->stats();
+
+                    if (got <= small) {
+                        small_reads.push_back(st.reads);
+                    }
+
+                    if (got == small + big) {
+                        grown = st;
+                    }
+
+                    if (got == small || got >= small + big) {
+                        conn->publish("ack", "", 0, {}, c);
+                    }
+
+                    if (got == small + big + tail) {
+                        shrunk = st;
+                        io.stop();
+                    }
+                },
+                c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+    ASSERT_EQ(small + big + tail, got);
+    // all frames of a read are dispatched before the next one
+    EXPECT_EQ(std::vector<uint64_t>(small, small_reads.front()), small_reads);
+    EXPECT_GT(grown.full_reads, 0u);
+    EXPECT_GT(grown.read_size, 4096u);
+    EXPECT_LT(shrunk.read_size, grown.read_size);
+    EXPECT_EQ(4096u, shrunk.read_size);
+    EXPECT_GE(shrunk.reads, grown.reads + tail);
+}
+
+TEST(subscriptions, max_messages_and_cancel) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("SUB b  1\r\n", c);
+        // the third one is past max, a real server wouldn't send it
+        srv.write("MSG a 0 1\r\nx\r\nMSG a 0 1\r\nx\r\nMSG a 0 1\r\nx\r\nMSG b 1 1\r\ny\r\n", c);
+        srv.read_until("UNSUB 1\r\n", c);
+        // was on the way when cancel was called
+        srv.write("MSG b 1 1\r\nz\r\nPING\r\n", c);
+        srv.read_until("PONG\r\n", c);
+        io.stop();
+    });
+
+    auto conf = srv.config();
+    std::size_t a_got = 0, b_got = 0;
+    iconnection_sptr conn;
+    isubscription_sptr b;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            auto r = conn->subscribe(
+                "a", {}, [&](string_view, optional<string_view>, const char*, std::size_t, ctx) { a_got++; }, c, 2);
+            ASSERT_FALSE(r.second.failed());
+            r = conn->subscribe(
+                "b", {},
+                [&](string_view, optional<string_view>, const char*, std::size_t, ctx) {
+                    b_got++;
+                    b->cancel();
+                },
+                c);
+            b = r.first;
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_NE(std::string::npos, srv.got.find("SUB a  0\r\nUNSUB 0 2\r\n"));
+    EXPECT_EQ(2u, a_got);
+    EXPECT_EQ(1u, b_got);
+}
+
+TEST(subscriptions, cancel_from_another_thread) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("SUB a  0\r\n", c);
+        srv.write("MSG a 0 1\r\nx\r\n", c);
+        srv.read_until("UNSUB 0\r\n", c);
+        srv.write("MSG a 0 1\r\ny\r\nPING\r\n", c);
+        srv.read_until("PONG\r\n", c);
+        io.stop();
+    });
+
+    auto conf = srv.config();
+    std::size_t got = 0;
+    iconnection_sptr conn;
+    isubscription_sptr sub;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            auto r = conn->subscribe(
+                "a", {},
+                [&](string_view, optional<string_view>, const char*, std::size_t, ctx) {
+                    got++;
+                    // UNSUB is posted, the connection thread is blocked in join meanwhile
+                    std::thread([&] { sub->cancel(); }).join();
+                },
+                c);
+            sub = r.first;
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ(1u, got);
+}
+
+TEST(subscriptions, batches_across_partial_payload_and_disconnect) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("SUB p  1\r\n", c);
+        // every batch is confirmed with a publish to ack
+        srv.write("MSG b 0 1\r\n1\r\nMSG b 0 1\r\n2\r\nMSG b 0 5\r\n34", c);
+        srv.read_until("PUB ack ", c);
+        srv.write("567\r\n", c);
+        srv.read_until("PUB ack ", c);
+        // callback of p keeps publishing until the connection is found lost
+        srv.write("MSG b 0 1\r\n3\r\nMSG p 1 1\r\nx\r\n", c);
+        srv.accept(c);
+        srv.write("MSG b 0 1\r\n4\r\n", c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    std::vector<std::string> batches;
+    bool subscribed = false;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            if (subscribed) {
+                return;
+            }
+
+            subscribed = true;
+            conn->subscribe_batch(
+                "b", {},
+                [&](const message_view* msgs, std::size_t count, ctx c) {
+                    std::string batch;
+
+                    for (std::size_t i = 0; i < count; ++i) {
+                        batch += (i > 0 ? "," : "") + std::string(msgs[i].raw, msgs[i].n);
+                    }
+
+                    batches.push_back(batch);
+                    conn->publish("ack", "", 0, {}, c);
+
+                    if (batches.size() == 4) {
+                        io.stop();
+                    }
+                },
+                c);
+            conn->subscribe(
+                "p", {},
+                [&](string_view, optional<string_view>, const char*, std::size_t, ctx c) {
+                    boost::asio::deadline_timer timer(io);
+
+                    for (int i = 0; i < 100 && conn->is_connected(); ++i) {
+                        conn->publish("z", "z", 1, {}, c);
+                        timer.expires_from_now(boost::posix_time::milliseconds(10));
+                        timer.async_wait(c);
+                    }
+                },
+                c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+    EXPECT_EQ((std::vector<std::string>{"1,2", "34567", "3", "4"}), batches);
+}
+
+TEST(lanes, control_frames_overtake_bulk) {
+    aio io;
+    scripted_server srv(io);
+    // kernel buffers take what they can hold before anything can overtake it, so keep them small and queue more
+    // than they can hold
+    srv.acceptor.set_option(tcp::socket::receive_buffer_size(64 * 1024));
+    const std::size_t bulk = 16 * 1024;
+    iconnection_sptr conn;
+    std::size_t queued_at_ping = 0;
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+
+        // client fills socket buffers meanwhile
+        boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(200));
+        timer.async_wait(c);
+        srv.write("PING\r\n", c);
+        // the writer is stuck on full buffers, so this is still queued when the client answers
+        timer.expires_from_now(boost::posix_time::milliseconds(50));
+        timer.async_wait(c);
+        queued_at_ping = conn->stats().bulk_queue_bytes;
+        srv.read_until("PUB end ", c);
+        io.stop();
+    });
+
+    auto conf = srv.config();
+    conf.max_pending_bytes = 2 * bulk * 1024;
+    std::size_t queued_at_sub = 0;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            std::string payload(1024, 'x');
+
+            for (std::size_t i = 0; i < bulk; ++i) {
+                ASSERT_FALSE(conn->publish("bulk", payload.data(), payload.size(), {}, c).failed());
+            }
+
+            conn->subscribe("late", {}, [](string_view, optional<string_view>, const char*, std::size_t, ctx) {},
+                            c);
+            queued_at_sub = conn->stats().bulk_queue_bytes;
+            conn->publish("end", "x", 1, {}, c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    auto pong = srv.got.find("PONG\r\n");
+    auto sub = srv.got.find("SUB late  0\r\n");
+    ASSERT_NE(std::string::npos, pong);
+    ASSERT_NE(std::string::npos, sub);
+    // everything still queued when they were made goes after them
+    EXPECT_GT(queued_at_ping, 0u);
+    EXPECT_GT(queued_at_sub, 0u);
+    EXPECT_GE(srv.got.size() - pong, queued_at_ping);
+    EXPECT_GE(srv.got.size() - sub, queued_at_sub);
+    // control frames go in between whole frames
+    EXPECT_EQ('\n', srv.got[pong - 1]);
+    EXPECT_EQ('\n', srv.got[sub - 1]);
+    auto st = conn->stats();
+    EXPECT_GE(st.control_writes, 2u);
+    EXPECT_GT(st.bulk_queue_max, 1024u * 1024);
+    EXPECT_EQ(0u, st.control_queue_bytes);
+}
+
+TEST(publish, scatter_gather_parts) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB done  0\r\n", c);
+        io.stop();
+    });
+
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            std::string head("head-"), middle("middle-"), tail("tail");
+            // an empty part adds nothing
+            boost::asio::const_buffer parts[] = {boost::asio::buffer(head), boost::asio::const_buffer(),
+                                                 boost::asio::buffer(middle), boost::asio::buffer(tail)};
+            EXPECT_FALSE(conn->publish("sg", parts, 4, {}, c).failed());
+            EXPECT_FALSE(conn->publish("sg", parts + 2, 2, string_view("r"), c).failed());
+            auto publisher = conn->make_publisher("sg.p", string_view("r"));
+            ASSERT_FALSE(publisher.second.failed());
+            EXPECT_FALSE(publisher.first->publish(parts, 4, c).failed());
+            EXPECT_FALSE(publisher.first->publish(parts, 0, c).failed());
+            conn->publish("done", "", 0, {}, c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(srv.config());
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+    EXPECT_NE(std::string::npos, srv.got.find("PUB sg  16\r\nhead-middle-tail\r\n"
+                                              "PUB sg r 11\r\nmiddle-tail\r\n"
+                                              "PUB sg.p r 16\r\nhead-middle-tail\r\n"
+                                              "PUB sg.p r 0\r\n\r\n"
+                                              "PUB done  0\r\n"));
+}
+
+TEST(local, delivers_own_publishes_without_server) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    conf.local_delivery = true;
+    std::vector<std::string> all, one, queued;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            conn->subscribe_headers(
+                "ev.>", {},
+                [&](string_view subject, optional<string_view>, string_view headers, const char* raw, std::size_t n,
+                    ctx) {
+                    auto h = find_header(headers, "K");
+                    all.push_back(std::string(subject.data(), subject.size()) + " " + std::string(raw, n) + " " +
+                                  (h.has_value() ? std::string(h->data(), h->size()) : ""));
+                },
+                c);
+            conn->subscribe(
+                "ev.a", {},
+                [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) {
+                    one.emplace_back(raw, n);
+                },
+                c, 1);
+            conn->subscribe(
+                "ev.a", string_view("q"),
+                [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) {
+                    queued.emplace_back(raw, n);
+                },
+                c);
+
+            conn->publish("ev.a", "1", 1, {}, c);
+            // delivered inside publish
+            EXPECT_EQ(1u, all.size());
+            conn->publish("ev.a", "2", 1, headers_t{{"K", "v"}}, {}, c);
+            conn->publish("other", "3", 1, {}, c);
+            ASSERT_FALSE(conn->post_publish("ev.b", "4", 1, {}).failed());
+            boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(50));
+            timer.async_wait(c);
+            conn->stop();
+            io.stop();
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ((std::vector<std::string>{"ev.a 1 ", "ev.a 2 v", "ev.b 4 "}), all);
+    EXPECT_EQ(std::vector<std::string>{"1"}, one);
+    EXPECT_TRUE(queued.empty());
+    EXPECT_EQ(4u, conn->stats().local_deliveries);
+    EXPECT_NE(std::string::npos, srv.got.find("\"echo\":false"));
+    EXPECT_NE(std::string::npos, srv.got.find("UNSUB 1\r\n"));
+    EXPECT_NE(std::string::npos, srv.got.find("PUB ev.b  1\r\n4\r\n"));
+}
+
+TEST(drain, unsubscribes_and_confirms) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PING\r\n", c);
+        // sent before UNSUB was processed, still has to be delivered
+        srv.write("MSG a 0 2\r\nhi\r\nPONG\r\n", c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    std::vector<std::string> delivered;
+    optional<status> drained;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            conn->subscribe(
+                "a", {},
+                [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) {
+                    delivered.emplace_back(raw, n);
+                },
+                c);
+            ASSERT_FALSE(conn->publish("b", "x", 1, {}, c).failed());
+            conn->drain(boost::posix_time::seconds(5), [&](status s, ctx) {
+                drained = s;
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    ASSERT_TRUE(drained.has_value());
+    EXPECT_FALSE(drained.value().failed());
+    EXPECT_EQ(std::vector<std::string>{"hi"}, delivered);
+    auto unsub = srv.got.find("UNSUB 0\r\n");
+    ASSERT_NE(std::string::npos, unsub);
+    EXPECT_LT(srv.got.find("PUB b "), srv.got.find("PING\r\n"));
+    EXPECT_LT(unsub, srv.got.find("PING\r\n"));
+}
+
+TEST(drain, second_call_keeps_first) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PING\r\n", c);
+        srv.write("PONG\r\n", c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    optional<status> first;
+    optional<status> second;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            conn->drain(boost::posix_time::seconds(5), [&](status s, ctx) {
+                first = s;
+                io.stop();
+            });
+            conn->drain(boost::posix_time::seconds(5), [&](status s, ctx) { second = s; });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    ASSERT_TRUE(second.has_value());
+    EXPECT_EQ("already draining", second.value().error());
+    ASSERT_TRUE(first.has_value());
+    EXPECT_FALSE(first.value().failed());
+}
+
+TEST(drain, connection_lost_ends_drain_without_reconnect) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        // no PONG, the connection is gone with the next accept
+        for (;;) {
+            srv.accept(c);
+            srv.read_until("PING\r\n", c);
+        }
+    });
+
+    auto conf = srv.config();
+    std::size_t connects = 0;
+    optional<status> drained;
+    auto started = std::chrono::steady_clock::now();
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            connects++;
+            conn->subscribe("a", {}, [](string_view, optional<string_view>, const char*, std::size_t, ctx) {}, c);
+            conn->drain(boost::posix_time::seconds(5), [&](status s, ctx c) {
+                drained = s;
+                // gives a reconnect the chance to happen
+                boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(50));
+                timer.async_wait(c);
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    ASSERT_TRUE(drained.has_value());
+    EXPECT_EQ("connection lost while draining", drained.value().error());
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(2));
+    EXPECT_EQ(1u, connects);
+    EXPECT_EQ(1u, srv.accepted);
+}
+
+TEST(drain, times_out) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    optional<status> drained;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            conn->drain(boost::posix_time::milliseconds(50), [&](status s, ctx) {
+                drained = s;
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    ASSERT_TRUE(drained.has_value());
+    EXPECT_TRUE(drained.value().failed());
+}
+
+TEST(ordered_consumer, flow_control_gap_and_stall) {
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":1048576,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        std::string inbox_sid;
+        // answers consumer create and returns deliver subject and its sid
+        auto created = [&](const std::string& name, std::string& sid) {
+            srv.read_until("PUB $JS.API.CONSUMER.CREATE.S ", c);
+            auto reply = srv.token(" ");
+            srv.read_until("\"deliver_subject\":\"", c);
+            auto deliver = srv.token("\"");
+            srv.read_until("\"stream_name\":\"S\"}\r\n", c);
+            sid = srv.sid(deliver);
+            inbox_sid = srv.sid(reply.substr(0, reply.rfind('.')) + ".*");
+            auto out = msg_frame(reply, inbox_sid, "", "{\"name\":\"" + name + "\"}");
+            return std::make_pair(deliver, out);
+        };
+
+        std::string sid;
+        auto first = created("c1", sid);
+        srv.write(first.second + msg_frame(first.first, sid, "$JS.ACK.S.c1.1.1.1.0.3", "a") +
+                      msg_frame(first.first, sid, "$JS.ACK.S.c1.1.2.2.0.2", "b") +
+                      hmsg_frame(first.first, sid, "$JS.FC.S.c1.x", "NATS/1.0 100 FlowControl Request\r\n\r\n") +
+                      msg_frame(first.first, sid, "$JS.ACK.S.c1.1.4.4.0.1", "d"),
+                  c);
+        srv.read_until("PUB $JS.FC.S.c1.x  0\r\n", c);
+
+        // gap resumes from stream sequence 3
+        auto second = created("c2", sid);
+        srv.write(second.second + msg_frame(second.first, sid, "$JS.ACK.S.c2.1.3.1.0.2", "c") +
+                      msg_frame(second.first, sid, "$JS.ACK.S.c2.1.4.2.0.1", "d") +
+                      msg_frame(second.first, sid, "$JS.ACK.S.c2.1.5.3.0.0", "e") +
+                      hmsg_frame(second.first, sid, "",
+                                 "NATS/1.0 100 Idle Heartbeat\r\nNats-Last-Consumer: 3\r\nNats-Last-Stream: 5\r\n\r\n"),
+                  c);
+
+        // then silence until heartbeats are missed
+        auto third = created("c3", sid);
+        srv.write(third.second + msg_frame(third.first, sid, "$JS.ACK.S.c3.1.6.1.0.0", "f"), c);
+        srv.read_until("PUB $JS.API.CONSUMER.DELETE.S.c3 ", c);
+        auto reply = srv.token(" ");
+        srv.read_until("\r\n\r\n", c);
+        srv.write(msg_frame(reply, inbox_sid, "", "{\"success\":true}"), c);
+    });
+
+    auto conf = srv.config();
+    iconnection_sptr conn;
+    std::string got;
+    std::vector<uint64_t> seqs;
+    ordered_consumer_stats st;
+    status stopped("not stopped");
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            boost::asio::spawn(io, [&](ctx c) {
+                ordered_consumer_config oc;
+                oc.stream = "S";
+                oc.idle_heartbeat = boost::posix_time::milliseconds(50);
+                auto r = create_ordered_consumer(
+                    io, conn, oc,
+                    [&](const js_message& m, ctx) {
+                        got.append(m.raw, m.n);
+                        seqs.push_back(m.stream_seq);
+                    },
+                    c);
+                ASSERT_FALSE(r.second.failed());
+                boost::asio::deadline_timer timer(io);
+
+                for (int i = 0; i < 200 && got.size() < 6; ++i) {
+                    timer.expires_from_now(boost::posix_time::milliseconds(10));
+                    timer.async_wait(c);
+                }
+
+                st = r.first->stats();
+                stopped = r.first->stop(c);
+                conn->stop();
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ("abcdef", got);
+    EXPECT_EQ((std::vector<uint64_t>{1, 2, 3, 4, 5, 6}), seqs);
+    EXPECT_EQ(6u, st.messages);
+    EXPECT_EQ(6u, st.stream_seq);
+    EXPECT_EQ(1u, st.flow_control_replies);
+    EXPECT_EQ(1u, st.heartbeats);
+    EXPECT_EQ(1u, st.gaps);
+    EXPECT_EQ(1u, st.stalls);
+    EXPECT_EQ(2u, st.resets);
+    EXPECT_FALSE(stopped.failed());
+    EXPECT_NE(std::string::npos, srv.got.find("\"flow_control\":true"));
+    EXPECT_NE(std::string::npos, srv.got.find("\"opt_start_seq\":3"));
+    EXPECT_NE(std::string::npos, srv.got.find("\"opt_start_seq\":6"));
+}
+
+TEST(kv, watch_updates_cache_revisions_and_markers) {
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":1048576,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB $JS.API.CONSUMER.CREATE.KV_cfg ", c);
+        auto reply = srv.token(" ");
+        srv.read_until("\"deliver_subject\":\"", c);
+        auto sid = srv.sid(srv.token("\""));
+        srv.read_until("\"stream_name\":\"KV_cfg\"}\r\n", c);
+        auto inbox_sid = srv.sid(reply.substr(0, reply.rfind('.')) + ".*");
+
+        // initial state has a and b, then a is deleted, b purged and c written
+        srv.write(msg_frame(reply, inbox_sid, "", "{\"name\":\"w\",\"num_pending\":2}") +
+                      msg_frame("$KV.cfg.a", sid, "$JS.ACK.KV_cfg.w.1.1.1.1600000000.1", "x") +
+                      msg_frame("$KV.cfg.b", sid, "$JS.ACK.KV_cfg.w.1.2.2.1600000000.0", "y") +
+                      hmsg_frame("$KV.cfg.a", sid, "$JS.ACK.KV_cfg.w.1.3.3.1600000000.0",
+                                 "NATS/1.0\r\nKV-Operation: DEL\r\n\r\n") +
+                      hmsg_frame("$KV.cfg.b", sid, "$JS.ACK.KV_cfg.w.1.4.4.1600000000.0",
+                                 "NATS/1.0\r\nKV-Operation: PURGE\r\n\r\n") +
+                      msg_frame("$KV.cfg.c", sid, "$JS.ACK.KV_cfg.w.1.5.5.1600000000.0", "z"),
+                  c);
+
+        // keeps reading to see whether gets go to the server
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    iconnection_sptr conn;
+    std::vector<kv_entry> updates;
+    std::map<std::string, optional<kv_entry>> gets;
+    std::map<std::string, optional<uint64_t>> revisions;
+    status watched("not watched");
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            boost::asio::spawn(io, [&](ctx c) {
+                kv_config kc;
+                kc.bucket = "cfg";
+                kc.local_cache = true;
+                kc.timeout = boost::posix_time::seconds(1);
+                auto kv = create_kv_bucket(conn, kc);
+                watched = kv->watch([&](const kv_entry& e, ctx) { updates.push_back(e); }, c);
+                boost::asio::deadline_timer timer(io);
+
+                for (int i = 0; i < 200 && updates.size() < 5; ++i) {
+                    timer.expires_from_now(boost::posix_time::milliseconds(10));
+                    timer.async_wait(c);
+                }
+
+                for (auto key : {"a", "b", "c", "d"}) {
+                    auto r = kv->get(key, c);
+                    EXPECT_FALSE(r.second.failed());
+                    gets[key] = r.first;
+                    revisions[key] = kv->revision(key);
+                }
+
+                conn->stop();
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_FALSE(watched.failed());
+    ASSERT_EQ(5u, updates.size());
+    EXPECT_EQ("a", updates[0].key);
+    EXPECT_EQ("x", updates[0].value);
+    EXPECT_EQ(1u, updates[0].revision);
+    EXPECT_TRUE(updates[0].op == kv_op::put);
+    EXPECT_EQ("b", updates[1].key);
+    EXPECT_EQ("y", updates[1].value);
+    EXPECT_TRUE(updates[2].op == kv_op::del);
+    EXPECT_EQ(3u, updates[2].revision);
+    EXPECT_TRUE(updates[3].op == kv_op::purge);
+    EXPECT_EQ(4u, updates[3].revision);
+    EXPECT_EQ("z", updates[4].value);
+
+    // deleted and purged keys are gone from the cache but keep their revisions
+    EXPECT_FALSE(gets["a"].has_value());
+    EXPECT_FALSE(gets["b"].has_value());
+    ASSERT_TRUE(gets["c"].has_value());
+    EXPECT_EQ("z", gets["c"]->value);
+    EXPECT_EQ(5u, gets["c"]->revision);
+    EXPECT_FALSE(gets["d"].has_value());
+    EXPECT_EQ(3u, revisions["a"].value_or(0));
+    EXPECT_EQ(4u, revisions["b"].value_or(0));
+    EXPECT_EQ(5u, revisions["c"].value_or(0));
+    EXPECT_FALSE(revisions["d"].has_value());
+
+    // all gets were served from the cache
+    EXPECT_EQ(std::string::npos, srv.got.find("MSG.GET"));
+}
+
+TEST(kv, released_bucket_cancels_watch) {
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":1048576,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB $JS.API.CONSUMER.CREATE.KV_cfg ", c);
+        auto reply = srv.token(" ");
+        srv.read_until("\"deliver_subject\":\"", c);
+        auto sid = srv.sid(srv.token("\""));
+        srv.read_until("\"stream_name\":\"KV_cfg\"}\r\n", c);
+        auto inbox_sid = srv.sid(reply.substr(0, reply.rfind('.')) + ".*");
+        srv.write(msg_frame(reply, inbox_sid, "", "{\"name\":\"w\",\"num_pending\":0}"), c);
+        srv.read_until("UNSUB " + sid + "\r\n", c);
+
+        // delivered after the bucket is gone, must not reach it
+        srv.write(msg_frame("$KV.cfg.a", sid, "$JS.ACK.KV_cfg.w.1.1.1.1600000000.0", "x"), c);
+        srv.read_all(c);
+    });
+
+    auto conf = srv.config();
+    iconnection_sptr conn;
+    int updates = 0;
+    status watched("not watched");
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            boost::asio::spawn(io, [&](ctx c) {
+                kv_config kc;
+                kc.bucket = "cfg";
+                kc.timeout = boost::posix_time::seconds(1);
+                auto kv = create_kv_bucket(conn, kc);
+                watched = kv->watch([&](const kv_entry&, ctx) { ++updates; }, c);
+                kv.reset();
+                boost::asio::deadline_timer timer(io);
+                timer.expires_from_now(boost::posix_time::milliseconds(100));
+                timer.async_wait(c);
+                conn->stop();
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_FALSE(watched.failed());
+    EXPECT_NE(std::string::npos, srv.got.find("UNSUB "));
+    EXPECT_EQ(0, updates);
+}
+
+TEST(chunks, reassembly) {
+    std::vector<std::string> objects;
+    chunk_assembler assembler(
+        [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) { objects.emplace_back(raw, n); },
+        nullptr, 100);
+
+    async_process([&](ctx c) {
+        auto part = [&](const std::string& headers, const std::string& payload) {
+            auto block = "NATS/1.0\r\n" + headers + "\r\n";
+            assembler.on_message("s", {}, block, payload.data(), payload.size(), c);
+        };
+
+        part("Nats-Asio-Chunk: a 0\r\n", "he");
+        part("Nats-Asio-Chunk: b 0\r\n", "xx");
+        part("Nats-Asio-Chunk: a 1\r\n", "ll");
+        part("Nats-Asio-Chunk: a 2\r\nNats-Asio-Chunk-Size: 5\r\n", "o");
+        // b lost part 1
+        part("Nats-Asio-Chunk: b 2\r\nNats-Asio-Chunk-Size: 6\r\n", "zz");
+        // size doesn't match
+        part("Nats-Asio-Chunk: c 0\r\nNats-Asio-Chunk-Size: 3\r\n", "ab");
+        // over max_object_size
+        part("Nats-Asio-Chunk: d 0\r\nNats-Asio-Chunk-Size: 101\r\n", std::string(101, 'x'));
+        part("", "plain");
+    });
+
+    EXPECT_EQ((std::vector<std::string>{"hello", "plain"}), objects);
+}
+
+TEST(chunks, streaming_sink) {
+    std::map<std::string, std::string> objects;
+    std::vector<std::string> events;
+    chunk_assembler assembler(nullptr,
+                              [&](string_view, string_view id, uint64_t offset, const char* raw, std::size_t n,
+                                  chunk_state state, ctx) {
+                                  auto key = std::string(id.data(), id.size());
+                                  objects[key].append(raw, n);
+                                  const char* names[] = {"part", "last", "dropped"};
+                                  events.push_back(key + " " + std::to_string(offset) + " " +
+                                                   names[static_cast<int>(state)]);
+                              },
+                              std::numeric_limits<std::size_t>::max());
+
+    async_process([&](ctx c) {
+        auto part = [&](const std::string& headers, const std::string& payload) {
+            auto block = "NATS/1.0\r\n" + headers + "\r\n";
+            assembler.on_message("s", {}, block, payload.data(), payload.size(), c);
+        };
+
+        part("Nats-Asio-Chunk: a 0\r\n", "abc");
+        part("Nats-Asio-Chunk: b 0\r\n", "xy");
+        part("Nats-Asio-Chunk: a 1\r\nNats-Asio-Chunk-Size: 5\r\n", "de");
+        // b lost part 1, the sink is told once and nothing more of b comes
+        part("Nats-Asio-Chunk: b 2\r\n", "zz");
+        part("Nats-Asio-Chunk: b 3\r\n", "zz");
+        // c lost part 0, the sink never saw it
+        part("Nats-Asio-Chunk: c 1\r\n", "q");
+        // d ends with a wrong size
+        part("Nats-Asio-Chunk: d 0\r\n", "12");
+        part("Nats-Asio-Chunk: d 1\r\nNats-Asio-Chunk-Size: 9\r\n", "34");
+    });
+
+    EXPECT_EQ("abcde", objects["a"]);
+    EXPECT_EQ("xy", objects["b"]);
+    EXPECT_EQ(0u, objects.count("c"));
+    EXPECT_EQ((std::vector<std::string>{"a 0 part", "b 0 part", "a 3 last", "b 2 dropped", "d 0 part",
+                                        "d 2 dropped"}),
+              events);
+}
+
+TEST(chunks, publish_splits_at_part_size) {
+    aio io;
+    // parts are max_payload less 128 bytes of header room
+    scripted_server srv(io, "INFO {\"max_payload\":228,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("PUB done  0\r\n", c);
+        io.stop();
+    });
+
+    std::string object(250, ' ');
+
+    for (std::size_t i = 0; i < object.size(); ++i) {
+        object[i] = static_cast<char>('a' + i % 26);
+    }
+
+    // source gives 30 bytes at a time and records what was queued when each part started
+    std::size_t offset = 0;
+    std::vector<uint64_t> queued_at_part;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            EXPECT_FALSE(publish_chunked(*conn, "mem", object.data(), object.size(), c).failed());
+            auto queued = conn->stats().bulk_queue_bytes;
+            auto source = [&](char* raw, std::size_t n) {
+                if (offset % 100 == 0 && offset < 200) {
+                    queued_at_part.push_back(conn->stats().bulk_queue_bytes - queued);
+                }
+
+                auto k = std::min<std::size_t>({n, 30, 200 - offset});
+                std::memcpy(raw, object.data() + offset, k);
+                offset += k;
+                return k;
+            };
+            // a multiple of part size ends with a full last part, not an empty one
+            EXPECT_FALSE(publish_chunked(*conn, "src", source, c).failed());
+            conn->publish("done", "", 0, {}, c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(srv.config());
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+
+    // HPUB subject id headers_n total_n, then headers and payload
+    struct part {
+        std::string subject, chunk, size, payload;
+    };
+    std::vector<part> parts;
+
+    for (auto p = srv.got.find("HPUB "); p != std::string::npos; p = srv.got.find("HPUB ", p)) {
+        auto end = srv.got.find("\r\n", p);
+        std::istringstream line(srv.got.substr(p + 5, end - p - 5));
+        part item;
+        std::size_t headers_n = 0, total_n = 0;
+        line >> item.subject >> headers_n >> total_n;
+        string_view headers(srv.got.data() + end + 2, headers_n);
+        auto chunk = find_header(headers, "Nats-Asio-Chunk");
+        auto size = find_header(headers, "Nats-Asio-Chunk-Size");
+        item.chunk = chunk.has_value() ? std::string(chunk->data(), chunk->size()) : "";
+        item.size = size.has_value() ? std::string(size->data(), size->size()) : "";
+        item.payload = srv.got.substr(end + 2 + headers_n, total_n - headers_n);
+        EXPECT_LE(total_n, 228u);
+        parts.push_back(item);
+        p = end + 2 + total_n;
+    }
+
+    ASSERT_EQ(5u, parts.size());
+    std::vector<std::size_t> sizes;
+    std::string mem, src;
+
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        sizes.push_back(parts[i].payload.size());
+        (i < 3 ? mem : src) += parts[i].payload;
+        auto seq = std::to_string(i < 3 ? i : i - 3);
+        EXPECT_EQ(seq, parts[i].chunk.substr(parts[i].chunk.rfind(' ') + 1));
+    }
+
+    EXPECT_EQ((std::vector<std::size_t>{100, 100, 50, 100, 100}), sizes);
+    EXPECT_EQ(object, mem);
+    EXPECT_EQ(object.substr(0, 200), src);
+    // one transfer id per object, the size header only on last parts
+    EXPECT_EQ(parts[0].chunk.substr(0, 22), parts[2].chunk.substr(0, 22));
+    EXPECT_NE(parts[0].chunk.substr(0, 22), parts[3].chunk.substr(0, 22));
+    EXPECT_EQ((std::vector<std::string>{"", "", "250", "", "200"}),
+              (std::vector<std::string>{parts[0].size, parts[1].size, parts[2].size, parts[3].size, parts[4].size}));
+    // the second part is read before the first one is published
+    EXPECT_EQ((std::vector<uint64_t>{0, 0}), queued_at_part);
+}
+
+TEST(envelopes, pack_flush_and_unpack) {
+    std::vector<char> out;
+    append_varint(out, 300);
+    uint64_t v = 0;
+    const char* p = out.data();
+    ASSERT_TRUE(read_varint(p, out.data() + out.size(), v));
+    EXPECT_EQ(300u, v);
+    EXPECT_EQ(2u, varint_size(300));
+
+    aio io;
+    scripted_server srv(io, "INFO {\"max_payload\":1048576,\"headers\":true}\r\n");
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_all(c);
+    });
+
+    // own publishes come back without the server
+    auto conf = srv.config();
+    conf.local_delivery = true;
+    std::vector<std::string> got;
+    envelope_stats st;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            boost::asio::spawn(io, [&](ctx c) {
+                auto sub = subscribe_envelopes(
+                    *conn, "tm.x", {},
+                    [&](string_view, optional<string_view>, const char* raw, std::size_t n, ctx) {
+                        got.emplace_back(raw, n);
+                    },
+                    c);
+                ASSERT_FALSE(sub.second.failed());
+                envelope_config ec;
+                ec.max_bytes = 64;
+                ec.max_messages = 3;
+                auto r = create_envelope_publisher(io, conn, "tm.x", ec);
+                ASSERT_FALSE(r.second.failed());
+                auto pub = r.first;
+
+                for (auto m : {"m0", "m1", "m2", "m3"}) {
+                    EXPECT_FALSE(pub->publish(m, 2, c).failed());
+                }
+
+                // full envelope goes at once, the open one waits for max_delay
+                EXPECT_EQ(3u, got.size());
+                std::string big(70, 'b');
+                EXPECT_FALSE(pub->publish(big.data(), big.size(), c).failed());
+                EXPECT_FALSE(pub->publish("m4", 2, c).failed());
+                EXPECT_EQ(5u, got.size());
+                boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(30));
+                timer.async_wait(c);
+                st = pub->stats();
+                conn->stop();
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ((std::vector<std::string>{"m0", "m1", "m2", "m3", std::string(70, 'b'), "m4"}), got);
+    EXPECT_EQ(6u, st.messages);
+    EXPECT_EQ(3u, st.envelopes);
+    EXPECT_EQ(1u, st.unpacked);
+    EXPECT_NE(std::string::npos, srv.got.find("Nats-Asio-Envelope: 3\r\n\r\n\x02m0\x02m1\x02m2\r\n"));
+}
+
+TEST(service, requests_errors_and_stats) {
+    aio io;
+    scripted_server srv(io);
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        // nine discovery subscriptions come first
+        srv.read_until("SUB svc.upper q 9\r\n", c);
+        srv.write("MSG svc.upper 9 _r.1 2\r\nab\r\nMSG svc.upper 9 _r.2 0\r\n\r\n", c);
+        // workers reply in any order
+        srv.read_until("PUB _r.1 ", c);
+        srv.from = 0;
+        srv.read_until("Nats-Service-Error-Code: 400\r\n", c);
+        srv.write("MSG $SRV.STATS.calc 7 _r.3 0\r\n\r\n", c);
+        srv.read_until("stats_response", c);
+        srv.read_until("}\r\n", c);
+        io.stop();
+    });
+
+    auto conf = srv.config();
+    iconnection_sptr conn;
+    iservice_sptr svc;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            service_config sc;
+            sc.name = "calc";
+            sc.workers = 2;
+            auto r = create_service(conn, sc, c);
+            ASSERT_FALSE(r.second.failed());
+            svc = r.first;
+            service_endpoint_config ec;
+            ec.name = "upper";
+            ec.subject = "svc.upper";
+            auto s = svc->add_endpoint(ec,
+                                       [](service_request& req) {
+                                           if (req.n == 0) {
+                                               req.error = std::string("bad");
+                                               req.error_code = 400;
+                                               return;
+                                           }
+
+                                           for (std::size_t i = 0; i < req.n; ++i) {
+                                               req.response.push_back(static_cast<char>(std::toupper(req.raw[i])));
+                                           }
+                                       },
+                                       c);
+            ASSERT_FALSE(s.failed());
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(conf);
+    io.run();
+    ASSERT_NE(nullptr, svc);
+    svc->stop();
+    EXPECT_NE(std::string::npos, srv.got.find("SUB $SRV.PING.calc." + svc->id() + "  2\r\n"));
+    EXPECT_NE(std::string::npos, srv.got.find("PUB _r.1  2\r\nAB\r\n"));
+    EXPECT_NE(std::string::npos, srv.got.find("Nats-Service-Error: bad\r\n"));
+    auto body = srv.got.substr(srv.got.find("{\"average_processing_time"));
+    EXPECT_NE(std::string::npos, body.find("\"num_requests\":2"));
+    EXPECT_NE(std::string::npos, body.find("\"num_errors\":1"));
+    auto st = svc->stats();
+    ASSERT_EQ(1u, st.size());
+    EXPECT_EQ(2u, st[0].requests);
+    EXPECT_EQ(1u, st[0].errors);
+    EXPECT_EQ("bad", st[0].last_error);
+    EXPECT_EQ(2u, std::accumulate(st[0].histogram.begin(), st[0].histogram.end(), uint64_t(0)));
+}
+
+TEST(spin, runner_polls_and_reports_mode) {
+    aio io;
+    auto conn = create_connection(io, std::make_shared<spdlog::logger>("test"), [](iconnection&, ctx) {},
+                                  [](iconnection&, ctx) {}, {});
+    EXPECT_EQ(run_mode::blocking, conn->stats().mode);
+    connection_stats during;
+    boost::asio::deadline_timer timer(io, boost::posix_time::milliseconds(20));
+    std::atomic<ispin_runner*> runner(nullptr);
+    // io has work before the runner starts, and the runner is known before the timer is done
+    timer.async_wait([&](const boost::system::error_code&) {
+        during = conn->stats();
+        runner.load()->stop();
+    });
+    auto r = create_spin_runner(io, 0);
+    runner = r.get();
+    r->join();
+    EXPECT_EQ(run_mode::spin, during.mode);
+    EXPECT_EQ(0, during.spin_cpu);
+    EXPECT_GT(during.spin_polls, 0u);
+    EXPECT_EQ(run_mode::blocking, conn->stats().mode);
+}
+
+TEST(scaled, spreads_and_scales_in) {
+    aio server_io;
+    scripted_server srv(server_io);
+    boost::asio::spawn(server_io, [&](ctx c) {
+        // each connection is served on its own
+        for (;;) {
+            srv.accept(c);
+            auto s = std::make_shared<tcp::socket>(std::move(srv.socket));
+            boost::asio::spawn(server_io, [s](ctx c) {
+                std::array<char, 4096> buf;
+                std::string got;
+                boost::system::error_code ec;
+
+                while (!ec) {
+                    auto n = s->async_read_some(boost::asio::buffer(buf), c[ec]);
+                    got.append(buf.data(), n);
+
+                    if (got.find("SUB s q 0\r\n") != std::string::npos) {
+                        std::string msg("MSG s 0 1\r\nx\r\n");
+                        boost::asio::async_write(*s, boost::asio::buffer(msg), c[ec]);
+                        got.clear();
+                    } else if (got.find("PING\r\n") != std::string::npos) {
+                        std::string pong("PONG\r\n");
+                        boost::asio::async_write(*s, boost::asio::buffer(pong), c[ec]);
+                        got.clear();
+                    }
+                }
+            });
+        }
+    });
+    std::thread server([&]() { server_io.run(); });
+
+    scaled_config conf;
+    conf.conn = srv.config();
+    conf.max_connections = 2;
+    conf.scale_interval = boost::posix_time::milliseconds(100);
+    auto r = subscribe_scaled(std::make_shared<spdlog::logger>("test"), "s", "q", 2,
+                              [](string_view, optional<string_view>, const char*, std::size_t, ctx) {}, conf);
+    ASSERT_FALSE(r.second.failed());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+    // idle connections have no backlog, so one is drained
+    while ((r.first->stats().messages < 2 || r.first->stats().scale_ins == 0) &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    auto st = r.first->stats();
+    EXPECT_EQ(2u, st.messages);
+    EXPECT_EQ(1u, st.scale_ins);
+    EXPECT_EQ(1u, st.connections);
+    r.first->stop();
+    EXPECT_EQ(2u, r.first->stats().total.messages_received);
+    EXPECT_EQ(2u, r.first->stats().total.connects);
+    EXPECT_TRUE(subscribe_scaled(std::make_shared<spdlog::logger>("test"), "s", "", 2, nullptr, conf).second.failed());
+    server_io.stop();
+    server.join();
+}
+
+TEST(dedup, exact_and_filter) {
+    dedup_config conf;
+    conf.capacity = 100;
+    conf.exact_size = 4;
+    dedup_filter f(conf);
+    auto check = [&](const std::string& id) {
+        auto headers = "NATS/1.0\r\nNats-Msg-Id: " + id + "\r\n\r\n";
+        return f.check("s", headers, "x", 1);
+    };
+
+    EXPECT_EQ(dedup_filter::result::unique, check("a"));
+    EXPECT_EQ(dedup_filter::result::exact, check("a"));
+
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(dedup_filter::result::unique, check("k" + std::to_string(i)));
+    }
+
+    // out of the ring, still in the filter
+    EXPECT_EQ(dedup_filter::result::filter, check("a"));
+    EXPECT_EQ(dedup_filter::result::unique, f.check("s", "", "x", 1));
+    EXPECT_EQ(dedup_filter::result::unique, f.check("s", "", "x", 1));
+
+    // two generations later it is forgotten
+    for (int i = 0; i < 200; ++i) {
+        check("g" + std::to_string(i));
+    }
+
+    EXPECT_EQ(dedup_filter::result::unique, check("a"));
+}
+
+TEST(dedup, key_and_false_positives) {
+    dedup_config conf;
+    conf.capacity = 20000;
+    conf.false_positive_rate = 0.01;
+    conf.key = [](string_view, string_view, const char* raw, std::size_t n) { return string_view(raw, n); };
+    dedup_filter f(conf);
+    std::size_t false_positives = 0;
+
+    for (int i = 0; i < 20000; ++i) {
+        auto key = std::to_string(i);
+        false_positives += f.check("s", "", key.data(), key.size()) != dedup_filter::result::unique;
+    }
+
+    EXPECT_LT(false_positives, 400u);
+    EXPECT_EQ(dedup_filter::result::exact, f.check("s", "", "19999", 5));
+}
+
+TEST(allocations, parser_steady_state) {
+    std::string frames;
+
+    for (int i = 0; i < 100; ++i) {
+        frames += "MSG orders.eu 12 5\r\nhello\r\n";
+        frames += "HMSG orders.eu 12 _INBOX.x 12 17\r\nNATS/1.0\r\n\r\nhello\r\n";
+        frames += "PING\r\n";
+    }
+
+    skipping_observer o;
+    async_process([&](auto c) {
+        std::stringstream ss(frames);
+        std::string header;
+        o.is = &ss;
+
+        // header line grows to the longest frame
+        for (int i = 0; i < 3; ++i) {
+            ASSERT_FALSE(parse_header(header, ss, &o, c).failed());
+        }
+
+        allocation_counter counter;
+
+        while (!parse_header(header, ss, &o, c).failed()) {
+        }
+
+        EXPECT_EQ(0u, counter.count());
+    });
+    EXPECT_EQ(200u, o.messages);
+}
+
+TEST(allocations, read_steady_state) {
+    // the server runs on its own thread, so only the client is counted
+    aio server_io;
+    scripted_server srv(server_io);
+    const std::size_t per_round = 600;
+    boost::asio::spawn(server_io, [&](ctx c) {
+        srv.accept(c);
+        srv.read_until("SUB orders.eu  0\r\n", c);
+        std::string frames;
+
+        for (std::size_t i = 0; i < per_round / 2; ++i) {
+            frames += "MSG orders.eu 0 5\r\nhello\r\n";
+            frames += "HMSG orders.eu 0 _INBOX.x 12 17\r\nNATS/1.0\r\n\r\nhello\r\n";
+            frames += "PING\r\n";
+        }
+
+        // the same rounds again and again, the client confirms each one
+        for (int round = 0; round < 3; ++round) {
+            srv.write(frames, c);
+            srv.read_until("PUB ack ", c);
+        }
+
+        srv.read_all(c);
+    });
+    std::thread server([&]() { server_io.run(); });
+
+    aio io;
+    std::size_t received = 0;
+    std::size_t allocations = 1;
+    uint64_t operations = 0;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx c) {
+            conn->subscribe(
+                "orders.eu", {},
+                [&](string_view, optional<string_view>, const char*, std::size_t, ctx c) {
+                    received++;
+
+                    // the first two rounds grow read buffer, frame line and control lane
+                    if (received == 3 * per_round) {
+                        count_global_allocations = false;
+                        allocations = global_allocations;
+                        operations += conn->stats().reads + conn->stats().writes;
+                        conn->stop();
+                        io.stop();
+                        return;
+                    }
+
+                    if (received % per_round == 0) {
+                        conn->publish("ack", "", 0, {}, c);
+                    }
+
+                    if (received == 2 * per_round) {
+                        operations -= conn->stats().reads + conn->stats().writes;
+                        global_allocations = 0;
+                        count_global_allocations = true;
+                    }
+                },
+                c);
+        },
+        [](iconnection&, ctx) {}, {});
+    conn->start(srv.config());
+    boost::asio::deadline_timer limit(io, boost::posix_time::seconds(5));
+    limit.async_wait([&](boost::system::error_code) { io.stop(); });
+    io.run();
+    count_global_allocations = false;
+    server_io.stop();
+    server.join();
+    EXPECT_EQ(3 * per_round, received);
+    // asio allocates an operation and its work tracking per socket read or write, never per message. io_uring
+    // completions are also bound to a function and posted back to the strand with a boxed executor
+#ifdef NATS_ASIO_IO_URING
+    const uint64_t per_operation = 8;
+#else
+    const uint64_t per_operation = 2;
+#endif
+    EXPECT_GT(operations, 0u);
+    EXPECT_LE(allocations, per_operation * operations);
+    EXPECT_GT(conn->stats().reads, 3u);
+}
+
+TEST(allocations, publish_steady_state) {
+    aio io;
+    scripted_server srv(io);
+    std::size_t server_read = 0;
+    boost::asio::spawn(io, [&](ctx c) {
+        srv.accept(c);
+        boost::system::error_code ec;
+
+        // only counted, keeping it would allocate while the client is measured
+        while (!ec) {
+            server_read += srv.socket.async_read_some(boost::asio::buffer(srv.buf), c[ec]);
+        }
+    });
+
+    counting_resource resource;
+    auto conf = srv.config();
+    std::string payload(100, 'x');
+    std::size_t allocations = 1;
+    iconnection_sptr conn;
+    conn = create_connection(
+        io, std::make_shared<spdlog::logger>("test"),
+        [&](iconnection&, ctx) {
+            boost::asio::spawn(io, [&](ctx c) {
+                boost::asio::deadline_timer timer(io);
+
+                headers_t headers{{"k", "v"}};
+                typed_publisher<tick, pod_codec<tick>> typed(conn, "a.b");
+
+                // the first rounds grow both outbound buffers
+                for (int round = 0; round < 3; ++round) {
+                    auto expected = server_read + 1000 * (payload.size() + 14) + 1000 * (payload.size() + 38) +
+                                    1000 * (sizeof(tick) + 15);
+                    allocation_counter counter;
+
+                    for (int i = 0; i < 1000; ++i) {
+                        ASSERT_FALSE(conn->publish("a.b", payload.data(), payload.size(), {}, c).failed());
+                        ASSERT_FALSE(conn->publish("a.b", payload.data(), payload.size(), headers, {}, c).failed());
+                        ASSERT_FALSE(typed.publish(tick{static_cast<uint32_t>(i), 1.5}, c).failed());
+                    }
+
+                    allocations = counter.count();
+
+                    for (int i = 0; i < 500 && server_read < expected; ++i) {
+                        timer.expires_from_now(boost::posix_time::milliseconds(2));
+                        timer.async_wait(c);
+                    }
+                }
+
+                conn->stop();
+                io.stop();
+            });
+        },
+        [](iconnection&, ctx) {}, {}, &resource);
+    conn->start(conf);
+    io.run();
+    EXPECT_EQ(0u, allocations);
+    EXPECT_GT(resource.allocations, 0u);
+}